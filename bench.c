@@ -0,0 +1,1569 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Dumb benchmarks for dumb websockets.
+ *
+ * Nothing here talks to a real server: we wire a websocket up to one end of
+ * a socketpair(2) and fork a child that drains (or feeds) the other end.
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <tls.h>
+
+#include "dws.h"
+#include "dws_reactor.h"
+#include "dws_pool.h"
+#include "dws_sender.h"
+
+#define DEFAULT_ITERATIONS	200000
+#define MAX_BYTES		(1UL << 30)
+
+/*
+ * Count calls into the allocator so we can prove the send path doesn't make
+ * any (atomically, since some benchmarks have threads). Only glibc lets us
+ * interpose this cheaply, elsewhere we report -1.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static long allocs = 0;
+
+void *
+malloc(size_t n)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t sz)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, sz);
+}
+
+void *
+realloc(void *p, size_t n)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, n);
+}
+#define ALLOCS()	(allocs)
+#else
+#define ALLOCS()	(-1L)
+#endif
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * Hook a websocket up to one end of a socketpair and fork a child that just
+ * reads and discards whatever we send it.
+ */
+static pid_t
+sink(struct websocket *ws)
+{
+	int sv[2];
+	pid_t pid;
+	char buf[65536];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		while (read(sv[1], buf, sizeof(buf)) > 0)
+			;
+		_exit(0);
+	}
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	memset(ws, 0, sizeof(*ws));
+	ws->s = sv[0];
+	return pid;
+}
+
+/*
+ * Like sink(), but the child plays server and streams `n` unmasked binary
+ * frames of `size` bytes at us as fast as it can.
+ */
+static pid_t
+source(struct websocket *ws, long n, size_t size)
+{
+	int sv[2];
+	pid_t pid;
+	uint8_t *buf, *p;
+	size_t header_len, per, batch, i;
+	long sent;
+	int j;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+
+		header_len = size < 126 ? 2 : size <= 0xFFFF ? 4 : 10;
+		per = header_len + size;
+		batch = 65536 / per + 1;
+		buf = calloc(batch, per);
+		for (i = 0, p = buf; i < batch; i++, p += per) {
+			p[0] = 0x80 | BINARY;
+			if (size < 126) {
+				p[1] = (uint8_t) size;
+			} else if (size <= 0xFFFF) {
+				p[1] = 126;
+				p[2] = (uint8_t) (size >> 8);
+				p[3] = (uint8_t) size;
+			} else {
+				p[1] = 127;
+				for (j = 0; j < 8; j++)
+					p[2 + j] = (uint8_t) ((uint64_t) size
+					    >> (56 - 8 * j));
+			}
+			memset(p + header_len, 'B', size);
+		}
+
+		for (sent = 0; sent < n; sent += (long) batch) {
+			i = (size_t) (n - sent) < batch ? (size_t) (n - sent) : batch;
+			if (write(sv[1], buf, i * per) < 0)
+				break;
+		}
+		_exit(0);
+	}
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	memset(ws, 0, sizeof(*ws));
+	ws->s = sv[0];
+	return pid;
+}
+
+static void
+unsink(struct websocket *ws, pid_t pid)
+{
+	close(ws->s);
+	waitpid(pid, NULL, 0);
+	free(ws->wbuf);
+	free(ws->rbuf);
+}
+
+static void
+report(const char *name, size_t size, long n, double secs, long nallocs)
+{
+	printf("%-18s %8zu B %10.0f msg/s %8.1f MB/s %8.2f allocs/msg\n",
+	    name, size, (double) n / secs, (double) n * size / secs / 1e6,
+	    nallocs < 0 ? -1.0 : (double) nallocs / (double) n);
+}
+
+static void
+bench_send(long n, size_t size)
+{
+	struct websocket ws;
+	struct dumb_stats stats;
+	uint8_t *payload, *buf;
+	long i, before;
+	double start;
+	pid_t pid;
+
+	// Don't spend all day pushing the big payloads around.
+	if (n > (long) (MAX_BYTES / size))
+		n = (long) (MAX_BYTES / size);
+
+	payload = malloc(size);
+	buf = malloc(size + DWS_FRAME_HEADROOM);
+	assert(payload && buf);
+	memset(payload, 'A', size);
+
+	pid = sink(&ws);
+	assert(pid > 0);
+
+	// Warm up so the frame buffer reaches its final size.
+	assert(dumb_send(&ws, payload, size) > 0);
+
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++)
+		assert(dumb_send(&ws, payload, size) > 0);
+	report("dumb_send", size, n, now() - start, ALLOCS() - before);
+
+	// Same again, counting everything, to see what that costs.
+	memset(&stats, 0, sizeof(stats));
+	ws.stats = &stats;
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++)
+		assert(dumb_send(&ws, payload, size) > 0);
+	report("dumb_send +stats", size, n, now() - start, ALLOCS() - before);
+	ws.stats = NULL;
+
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++) {
+		memcpy(buf + DWS_FRAME_HEADROOM, payload, size);
+		assert(dumb_send_inplace(&ws, buf, size) > 0);
+	}
+	report("dumb_send_inplace", size, n, now() - start, ALLOCS() - before);
+
+	unsink(&ws, pid);
+	free(payload);
+	free(buf);
+}
+
+/*
+ * Same small messages, sent one at a time and then in batches, to see what
+ * coalescing buys us per syscall.
+ */
+static void
+bench_batch(long n, size_t size)
+{
+	struct websocket ws;
+	struct iovec msgs[64];
+	uint8_t *payload;
+	char name[32];
+	long i, before;
+	int batch, j;
+	double start;
+	pid_t pid;
+
+	payload = malloc(size);
+	assert(payload);
+	memset(payload, 'A', size);
+	for (j = 0; j < 64; j++) {
+		msgs[j].iov_base = payload;
+		msgs[j].iov_len = size;
+	}
+
+	pid = sink(&ws);
+	assert(pid > 0);
+	assert(dumb_send_batch(&ws, msgs, 64) > 0);
+
+	for (batch = 1; batch <= 64; batch *= 4) {
+		before = ALLOCS();
+		start = now();
+		for (i = 0; i < n; i += batch)
+			assert(dumb_send_batch(&ws, msgs, batch) > 0);
+		snprintf(name, sizeof(name), "dumb_send_batch/%d", batch);
+		report(name, size, i, now() - start, ALLOCS() - before);
+	}
+
+	unsink(&ws, pid);
+	free(payload);
+}
+
+static void
+bench_recv(long n, size_t size)
+{
+	struct websocket ws;
+	struct dumb_msg msg;
+	uint8_t *buf;
+	long i, before;
+	ssize_t len;
+	double start;
+	pid_t pid;
+
+	if (size > 65535)
+		size = 65535;
+	if (n > (long) (MAX_BYTES / size))
+		n = (long) (MAX_BYTES / size);
+
+	buf = malloc(size);
+	assert(buf);
+
+	pid = source(&ws, n, size);
+	assert(pid > 0);
+
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++) {
+		do {
+			len = dumb_recv(&ws, buf, size);
+		} while (len == DWS_WANT_POLL);
+		assert(len == (ssize_t) size);
+	}
+	report("dumb_recv", size, n, now() - start, ALLOCS() - before);
+	unsink(&ws, pid);
+
+	// Same again, minus the copy.
+	pid = source(&ws, n, size);
+	assert(pid > 0);
+
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++) {
+		do {
+			len = dumb_recv_view(&ws, &msg);
+		} while (len == DWS_WANT_POLL);
+		assert(len == (ssize_t) size);
+	}
+	report("dumb_recv_view", size, n, now() - start, ALLOCS() - before);
+
+	unsink(&ws, pid);
+	free(buf);
+}
+
+static ssize_t
+fill_zeros(void *buf, size_t len, void *arg)
+{
+	(void) arg;
+	memset(buf, 0, len);
+	return (ssize_t) len;
+}
+
+/*
+ * Big messages, streamed both ways a chunk at a time. The interesting bit
+ * is how small the buffers stay.
+ */
+static void
+bench_stream(long n, size_t size)
+{
+	struct websocket ws;
+	uint8_t buf[65536];
+	size_t left, total, peak;
+	long i, before;
+	ssize_t len;
+	double start;
+	pid_t pid;
+
+	if (n > (long) (MAX_BYTES / size))
+		n = (long) (MAX_BYTES / size);
+	if (n < 1)
+		n = 1;
+
+	pid = sink(&ws);
+	assert(pid > 0);
+
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++)
+		assert(dumb_send_stream(&ws, size, fill_zeros, NULL) > 0);
+	report("dumb_send_stream", size, n, now() - start, ALLOCS() - before);
+	printf("%-18s %8zu B frame buffer\n", "", ws.wcap);
+
+	unsink(&ws, pid);
+
+	pid = source(&ws, n, size);
+	assert(pid > 0);
+
+	peak = 0;
+	before = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++) {
+		total = 0;
+		do {
+			len = dumb_recv_chunk(&ws, buf, sizeof(buf), &left);
+			if (len == DWS_WANT_POLL)
+				continue;
+			assert(len > 0);
+			total += (size_t) len;
+			if (ws.rcap > peak)
+				peak = ws.rcap;
+		} while (len == DWS_WANT_POLL || left > 0);
+		assert(total == size);
+	}
+	report("dumb_recv_chunk", size, n, now() - start, ALLOCS() - before);
+	printf("%-18s %8zu B receive buffer\n", "", peak);
+
+	unsink(&ws, pid);
+}
+
+/*
+ * Like sink(), but the child answers the upgrade request first, agreeing to
+ * permessage-deflate if `deflate` is set.
+ */
+static pid_t
+upgraded_sink(struct websocket *ws, int deflate)
+{
+	static const char ok[] = "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n";
+	static const char ext[] =
+	    "Sec-WebSocket-Extensions: permessage-deflate\r\n";
+	char buf[65536];
+	size_t n = 0;
+	ssize_t r;
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		while (n < 4 || memcmp(buf + n - 4, "\r\n\r\n", 4)) {
+			if ((r = read(sv[1], buf + n, 1)) <= 0)
+				_exit(1);
+			n += (size_t) r;
+		}
+		buf[n] = '\0';
+		deflate = deflate && strstr(buf, "permessage-deflate") != NULL;
+		if (write(sv[1], ok, sizeof(ok) - 1) < 0
+		    || (deflate && write(sv[1], ext, sizeof(ext) - 1) < 0)
+		    || write(sv[1], "\r\n", 2) < 0)
+			_exit(1);
+		while (read(sv[1], buf, sizeof(buf)) > 0)
+			;
+		_exit(0);
+	}
+
+	close(sv[1]);
+
+	memset(ws, 0, sizeof(*ws));
+	ws->s = sv[0];
+	ws->host = strdup("localhost");
+	ws->port = 80;
+	ws->deflate = deflate;
+	ws->state = DWS_ST_CONNECTED;
+	if (dumb_handshake(ws, "/", "dumb-ws"))
+		return -1;
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	return pid;
+}
+
+/*
+ * JSON telemetry, like what we actually ship, with and without
+ * permessage-deflate: what ends up on the wire and what it costs in CPU.
+ */
+static void
+bench_deflate(long n)
+{
+	struct websocket ws;
+	static char msg[256][512];
+	size_t len[256], payload, wire;
+	double start, cpu;
+	clock_t c;
+	long i;
+	int on, j;
+	pid_t pid;
+
+	// Same shape every time, different numbers.
+	srand(1);
+	for (j = 0; j < 256; j++)
+		len[j] = (size_t) snprintf(msg[j], sizeof(msg[j]),
+		    "{\"host\": \"edge-%02d.example.net\", \"ts\": %d,"
+		    " \"cpu\": [%d, %d, %d, %d], \"mem_free\": %d,"
+		    " \"net\": { \"rx_bytes\": %d, \"tx_bytes\": %d },"
+		    " \"disks\": [ { \"name\": \"sda\", \"used\": 0.%02d },"
+		    " { \"name\": \"sdb\", \"used\": 0.%02d } ],"
+		    " \"status\": \"ok\" }", rand() % 64, 1592483696 + j,
+		    rand() % 100, rand() % 100, rand() % 100, rand() % 100,
+		    rand(), rand(), rand(), rand() % 100, rand() % 100);
+
+#ifndef DWS_WITH_ZLIB
+	printf("(built without DWS_WITH_ZLIB, so both of these are off)\n");
+#endif
+
+	for (on = 0; on <= 1; on++) {
+		pid = upgraded_sink(&ws, on);
+		assert(pid > 0);
+
+		payload = wire = 0;
+		c = clock();
+		start = now();
+		for (i = 0; i < n; i++) {
+			payload += len[i & 255];
+			wire += (size_t) dumb_send(&ws, msg[i & 255], len[i & 255]);
+		}
+		cpu = (double) (clock() - c) / CLOCKS_PER_SEC;
+		printf("%-18s %8zu B %10.0f msg/s %8.1f B/msg on the wire "
+		    "%6.2f us/msg cpu\n", on ? "permessage-deflate" : "uncompressed",
+		    payload / (size_t) n, (double) n / (now() - start),
+		    (double) wire / (double) n, cpu * 1e6 / (double) n);
+
+		unsink(&ws, pid);
+		free(ws.host);
+	}
+}
+
+/*
+ * Reactor benchmark: open a pile of websockets to a real echo server, then
+ * have each one bounce `n` messages off it, one at a time.
+ */
+struct rconn {
+	struct websocket	 ws;
+	long			 left;
+};
+
+static struct {
+	long		 open;
+	long		 closed;
+	long		 failed;
+	long		 msgs;
+	uint8_t		*payload;
+	size_t		 size;
+	int		 sending;
+} rstate;
+
+static void
+r_open(struct websocket *ws, void *arg)
+{
+	rstate.open++;
+}
+
+static void
+r_message(struct websocket *ws, const void *buf, size_t len, void *arg)
+{
+	struct rconn *c = arg;
+
+	rstate.msgs++;
+	if (--c->left > 0)
+		dumb_send(ws, rstate.payload, rstate.size);
+}
+
+static void
+r_close(struct websocket *ws, int reason, void *arg)
+{
+	rstate.closed++;
+	if (reason != DWS_OK) {
+		rstate.failed++;
+		if (ws->s >= 0)
+			close(ws->s);
+	}
+}
+
+static void
+bench_reactor(const char *host, uint16_t port, long conns, long n,
+    size_t size)
+{
+	struct dumb_reactor_callbacks cb = {
+		.on_open = r_open,
+		.on_message = r_message,
+		.on_close = r_close,
+	};
+	struct dumb_reactor *r;
+	struct rconn *c;
+	struct rlimit rl;
+	long i;
+	double start, secs;
+
+	// Thousands of sockets need thousands of descriptors.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&rstate, 0, sizeof(rstate));
+	rstate.size = size;
+	rstate.payload = malloc(size);
+	assert(rstate.payload);
+	memset(rstate.payload, 'C', size);
+
+	c = calloc((size_t) conns, sizeof(*c));
+	r = dumb_reactor_new(&cb, 0);
+	assert(c && r);
+
+	start = now();
+	for (i = 0; i < conns; i++) {
+		if (dumb_connect(&c[i].ws, host, port)) {
+			printf("connect failed after %ld connections\n", i);
+			exit(1);
+		}
+		c[i].left = n;
+		assert(dumb_reactor_add(r, &c[i].ws, "/", "dumb-ws", &c[i]) == 0);
+
+		// Keep handshakes moving while we connect the rest.
+		dumb_reactor_run(r, 0);
+	}
+	while (rstate.open + rstate.failed < conns)
+		dumb_reactor_run(r, 1000);
+	secs = now() - start;
+	printf("reactor %8ld conns %10.0f conn/s (%ld failed)\n",
+	    conns, (double) conns / secs, rstate.failed);
+
+	start = now();
+	for (i = 0; i < conns; i++) {
+		if (c[i].ws.state == DWS_ST_OPEN && n > 0)
+			dumb_send(&c[i].ws, rstate.payload, size);
+	}
+	while (rstate.msgs < (conns - rstate.failed) * n
+	    && dumb_reactor_count(r) > 0)
+		dumb_reactor_run(r, 1000);
+	secs = now() - start;
+	printf("reactor %8ld conns %8zu B %10.0f msg/s\n",
+	    conns, size, (double) rstate.msgs / secs);
+
+	for (i = 0; i < conns; i++) {
+		if (c[i].ws.state == DWS_ST_OPEN)
+			dumb_reactor_close(r, &c[i].ws);
+	}
+	while (dumb_reactor_count(r) > 0)
+		dumb_reactor_run(r, 1000);
+
+	dumb_reactor_free(r);
+	for (i = 0; i < conns; i++) {
+		free(c[i].ws.wbuf);
+		free(c[i].ws.rbuf);
+		free(c[i].ws.host);
+	}
+	free(c);
+	free(rstate.payload);
+}
+
+/*
+ * How long until we have a usable websocket again after ours dies: a fresh
+ * connect and handshake versus grabbing the pool's warm spare.
+ */
+static void
+bench_pool(const char *host, uint16_t port, long n)
+{
+	struct dumb_pool_config cfg;
+	struct dumb_pool *p;
+	struct websocket ws, *pws;
+	double start, fresh = 0, pooled = 0;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		memset(&ws, 0, sizeof(ws));
+		start = now();
+		if (dumb_connect(&ws, host, port)
+		    || dumb_handshake(&ws, "/", "dumb-ws")) {
+			printf("connect failed after %ld connections\n", i);
+			exit(1);
+		}
+		fresh += now() - start;
+		dumb_free(&ws);
+	}
+	printf("%-24s %10.1f us to a usable websocket\n", "dumb_connect",
+	    fresh * 1e6 / (double) n);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.host = host;
+	cfg.port = port;
+	cfg.path = "/";
+	cfg.proto = "dumb-ws";
+	cfg.size = 2;
+	p = dumb_pool_new(&cfg);
+	assert(p);
+
+	for (i = 0; i < n; i++) {
+		// Failures are rare, so let the pool get back to full strength.
+		while (dumb_pool_ready(p) < cfg.size)
+			usleep(1000);
+		start = now();
+		pws = dumb_pool_get(p, -1);
+		pooled += now() - start;
+		assert(pws && pws->state == DWS_ST_OPEN);
+		dumb_pool_put(p, pws, 1);
+	}
+	printf("%-24s %10.1f us to a usable websocket\n", "dumb_pool_get",
+	    pooled * 1e6 / (double) n);
+
+	dumb_pool_free(p);
+}
+
+/*
+ * User plus system CPU seconds this process has burned so far.
+ */
+static double
+cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (double) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+	    + (double) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * Time n TLS connects and handshakes with a shared dumb_tls, either making
+ * every one start from scratch or letting them resume the session the
+ * first one left behind.
+ */
+static void
+tls_round(const char *name, const char *host, uint16_t port, long n,
+    int resume)
+{
+	struct dumb_tls_opts opts;
+	struct dumb_tls *tls;
+	struct websocket ws;
+	double start, start_cpu, wall = 0, used = 0;
+	long i, resumed = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.insecure = 1;	// the test servers use self-signed certs
+	opts.protocols = "tlsv1.2";	// what LibreSSL knows how to resume
+	opts.no_resume = !resume;
+	tls = dumb_tls_new(&opts);
+	assert(tls);
+
+	for (i = -1; i < n; i++) {
+		memset(&ws, 0, sizeof(ws));
+		start = now();
+		start_cpu = cpu();
+		if (dumb_connect_tls_shared(&ws, host, port, tls)
+		    || dumb_handshake(&ws, "/", "dumb-ws")) {
+			printf("connect failed after %ld connections\n", i + 1);
+			exit(1);
+		}
+		// The first one just primes the session.
+		if (i >= 0) {
+			wall += now() - start;
+			used += cpu() - start_cpu;
+			resumed += dumb_tls_resumed(&ws);
+		}
+		dumb_close(&ws);
+		dumb_free(&ws);
+	}
+	dumb_tls_unref(tls);
+
+	printf("%-24s %10.1f us wall %10.1f us cpu %5ld/%ld resumed\n", name,
+	    wall * 1e6 / (double) n, used * 1e6 / (double) n, resumed, n);
+}
+
+static void
+bench_tls(const char *host, uint16_t port, long n)
+{
+	tls_round("tls cold", host, port, n, 0);
+	tls_round("tls resumed", host, port, n, 1);
+}
+
+/*
+ * Fork a child that listens on loopback and dumb_accept()s whatever
+ * connects, one at a time, hanging up as soon as the handshake's done (or
+ * isn't coming). Its port goes in *port.
+ */
+static pid_t
+acceptor(uint16_t *port)
+{
+	struct sockaddr_in sin;
+	struct websocket ws;
+	socklen_t len;
+	int l, fd;
+	pid_t pid;
+
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	assert(l >= 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(l, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	assert(listen(l, 128) == 0);
+	len = sizeof(sin);
+	assert(getsockname(l, (struct sockaddr *) &sin, &len) == 0);
+	*port = ntohs(sin.sin_port);
+
+	pid = fork();
+	if (pid == 0) {
+		while ((fd = accept(l, NULL, NULL)) >= 0) {
+			memset(&ws, 0, sizeof(ws));
+			dumb_accept(&ws, fd, "dumb-ws");
+			dumb_free(&ws);
+		}
+		_exit(0);
+	}
+
+	close(l);
+	return pid;
+}
+
+/*
+ * Time n connects to port, with or without an upgrade on top, so the
+ * difference is what the handshake costs. Without one, we hang up our end
+ * and wait for the acceptor to hang up its, or we'd just be timing how
+ * fast we can fill its backlog. cpu() only counts us, not the acceptor.
+ */
+static void
+handshake_round(const char *name, uint16_t port, long n, int upgrade)
+{
+	struct websocket ws;
+	struct pollfd pfd;
+	double start, start_cpu;
+	char c;
+	long i;
+
+	start = now();
+	start_cpu = cpu();
+	for (i = 0; i < n; i++) {
+		memset(&ws, 0, sizeof(ws));
+		if (dumb_connect(&ws, "127.0.0.1", port)
+		    || (upgrade && dumb_handshake(&ws, "/", "dumb-ws"))) {
+			printf("%s failed after %ld connections\n", name, i);
+			exit(1);
+		}
+		if (!upgrade) {
+			shutdown(dumb_fd(&ws), SHUT_WR);
+			pfd.fd = dumb_fd(&ws);
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+			(void) read(pfd.fd, &c, 1);
+		}
+		dumb_free(&ws);
+	}
+
+	printf("%-24s %10.0f conn/s %8.1f us wall %8.1f us cpu\n", name,
+	    (double) n / (now() - start), (now() - start) * 1e6 / (double) n,
+	    (cpu() - start_cpu) * 1e6 / (double) n);
+}
+
+static void
+bench_handshake(long n)
+{
+	uint16_t port;
+	pid_t pid;
+
+	pid = acceptor(&port);
+	handshake_round("tcp connect", port, n, 0);
+	handshake_round("connect + handshake", port, n, 1);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Round trips to an echo server with one sockopts preset: n single
+ * messages, then n pairs sent back to back (the second one is where Nagle
+ * and delayed ACKs like to get in the way). Over TLS if tls is set, where
+ * the connect and handshake time is worth a look too, since a cork in the
+ * wrong place holds up the TLS handshake.
+ */
+static void
+latency_round(const char *name, const char *host, uint16_t port, int tls,
+    long n, size_t size, int preset)
+{
+	struct websocket ws;
+	uint8_t *msg, *reply;
+	double *lat, start, connect;
+	long i;
+	int burst, j;
+	ssize_t len;
+
+	msg = calloc(1, size);
+	reply = malloc(size + 64);
+	lat = calloc((size_t) n, sizeof(*lat));
+	assert(msg && reply && lat);
+
+	memset(&ws, 0, sizeof(ws));
+	dumb_sockopts_preset(&ws.sockopts, preset);
+	start = now();
+	if ((tls ? dumb_connect_tls(&ws, host, port, 1)
+	    : dumb_connect(&ws, host, port))
+	    || dumb_handshake(&ws, "/", "dumb-ws")) {
+		printf("can't connect to %s:%u\n", host, port);
+		exit(1);
+	}
+	connect = now() - start;
+	printf("%-12s %s connect and handshake %8.1f us\n", name,
+	    tls ? "tls" : "tcp", connect * 1e6);
+
+	for (burst = 1; burst <= 2; burst++) {
+		for (i = 0; i < n; i++) {
+			start = now();
+			for (j = 0; j < burst; j++)
+				assert(dumb_send(&ws, msg, size) > 0);
+			for (j = 0; j < burst; j++) {
+				do {
+					len = dumb_recv(&ws, reply, size + 64);
+				} while (len == DWS_WANT_POLL);
+				assert(len == (ssize_t) size + 10);
+			}
+			lat[i] = now() - start;
+		}
+		qsort(lat, (size_t) n, sizeof(*lat), cmp_double);
+		printf("%-12s %s x%d %6zu bytes  p50 %8.1f us  p99 %8.1f us\n",
+		    name, tls ? "tls" : "tcp", burst, size, lat[n / 2] * 1e6,
+		    lat[(n * 99) / 100] * 1e6);
+	}
+
+	dumb_close(&ws);
+	dumb_free(&ws);
+	free(msg);
+	free(reply);
+	free(lat);
+}
+
+static void
+bench_latency(const char *host, uint16_t port, uint16_t tls_port, long n,
+    size_t size)
+{
+	static const struct {
+		const char	*name;
+		int		 preset;
+	} presets[] = {
+		{ "default", DWS_SOCKOPTS_DEFAULT },
+		{ "latency", DWS_SOCKOPTS_LATENCY },
+		{ "throughput", DWS_SOCKOPTS_THROUGHPUT },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++)
+		latency_round(presets[i].name, host, port, 0, n, size,
+		    presets[i].preset);
+	// Same again over TLS, if there's a TLS echo server to talk to.
+	for (i = 0; tls_port && i < sizeof(presets) / sizeof(presets[0]); i++)
+		latency_round(presets[i].name, host, tls_port, 1, n, size,
+		    presets[i].preset);
+}
+
+/*
+ * Many threads sending small messages down one websocket: the old way, a
+ * mutex around dumb_send(), versus handing them to a dumb_sender.
+ */
+struct producer {
+	pthread_t		 t;
+	pthread_mutex_t		*lock;		/* baseline only */
+	struct websocket	*ws;		/* baseline only */
+	struct dumb_sender	*sender;
+	const void		*msg;
+	size_t			 size;
+	long			 n;
+	double			*lat;		/* seconds per call */
+};
+
+static void *
+produce(void *arg)
+{
+	struct producer *p = arg;
+	double start;
+	long i;
+
+	for (i = 0; i < p->n; i++) {
+		start = now();
+		if (p->sender) {
+			assert(dumb_sender_send(p->sender, p->msg, p->size)
+			    == 0);
+		} else {
+			pthread_mutex_lock(p->lock);
+			assert(dumb_send(p->ws, p->msg, p->size) > 0);
+			pthread_mutex_unlock(p->lock);
+		}
+		p->lat[i] = now() - start;
+	}
+	return NULL;
+}
+
+static void
+sender_round(const char *name, int threads, long n, size_t size, int locked)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct dumb_sender_config cfg;
+	struct dumb_sender *sender = NULL;
+	struct producer *p;
+	struct websocket ws;
+	double *lat, start, secs;
+	uint8_t *msg;
+	long per, i;
+	pid_t pid;
+
+	per = n / threads;
+	if (per < 1)
+		per = 1;
+	p = calloc((size_t) threads, sizeof(*p));
+	lat = calloc((size_t) (per * threads), sizeof(*lat));
+	msg = malloc(size);
+	assert(p && lat && msg);
+	memset(msg, 'S', size);
+
+	pid = sink(&ws);
+	assert(pid > 0);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.policy = DWS_SENDER_BLOCK;
+
+	for (i = 0; i < threads; i++) {
+		p[i].lock = &lock;
+		p[i].ws = &ws;
+		p[i].msg = msg;
+		p[i].size = size;
+		p[i].n = per;
+		p[i].lat = lat + i * per;
+	}
+
+	start = now();
+	if (!locked) {
+		sender = dumb_sender_new(&ws, &cfg);
+		assert(sender);
+		for (i = 0; i < threads; i++)
+			p[i].sender = sender;
+	}
+	for (i = 0; i < threads; i++)
+		assert(pthread_create(&p[i].t, NULL, produce, &p[i]) == 0);
+	for (i = 0; i < threads; i++)
+		pthread_join(p[i].t, NULL);
+	// It's not sent until it's all out the door.
+	if (!locked)
+		dumb_sender_free(sender);
+	secs = now() - start;
+
+	qsort(lat, (size_t) (per * threads), sizeof(*lat), cmp_double);
+	printf("%-12s %3d threads %6zu B  %10.0f msg/s"
+	    "  enqueue p50 %8.2f us  p99 %8.2f us\n", name, threads, size,
+	    (double) (per * threads) / secs, lat[per * threads / 2] * 1e6,
+	    lat[(per * threads * 99) / 100] * 1e6);
+
+	unsink(&ws, pid);
+	pthread_mutex_destroy(&lock);
+	free(p);
+	free(lat);
+	free(msg);
+}
+
+static void
+bench_sender(long n, size_t size)
+{
+	int threads;
+
+	for (threads = 1; threads <= 32; threads *= 2) {
+		sender_round("mutex", threads, n, size, 1);
+		sender_round("dumb_sender", threads, n, size, 0);
+	}
+}
+
+/*
+ * The masking loop dumb_frame() used to have, for comparison.
+ */
+static void
+mask_bytewise(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t mask[4])
+{
+	int i;
+
+	for (i = 0; i < (int) len; i++)
+		dst[i] = src[i] ^ mask[i % 4];
+}
+
+static void
+bench_mask(long n, size_t size)
+{
+	uint8_t mask[4] = { 0xde, 0xad, 0xbe, 0xef };
+	uint8_t *src, *dst, *ref;
+	long i;
+	size_t j;
+	double start, t_old, t_new;
+
+	if (n > (long) (MAX_BYTES / 4 / size))
+		n = (long) (MAX_BYTES / 4 / size);
+	if (n < 1)
+		n = 1;
+
+	// Skew the buffers by a byte so we exercise the unaligned head/tail.
+	src = malloc(size + 1);
+	dst = malloc(size + 1);
+	ref = malloc(size + 1);
+	assert(src && dst && ref);
+	for (j = 0; j < size + 1; j++)
+		src[j] = (uint8_t) j;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		mask_bytewise(ref + 1, src + 1, size, mask);
+	t_old = now() - start;
+
+	start = now();
+	for (i = 0; i < n; i++)
+		dumb_apply_mask(dst + 1, src + 1, size, mask, 0);
+	t_new = now() - start;
+
+	assert(memcmp(dst + 1, ref + 1, size) == 0);
+
+	printf("mask %10zu B %10.1f MB/s (bytewise) %10.1f MB/s (dumb_apply_mask)"
+	    " %6.1fx\n", size, (double) n * size / t_old / 1e6,
+	    (double) n * size / t_new / 1e6, t_old / t_new);
+
+	free(src);
+	free(dst);
+	free(ref);
+}
+
+/*
+ * The obvious way to check UTF-8, a character at a time, for comparison.
+ */
+static int
+utf8_bytewise(const uint8_t *s, size_t len)
+{
+	uint32_t cp, min;
+	size_t i = 0, n, k;
+
+	while (i < len) {
+		if (s[i] < 0x80) {
+			i++;
+			continue;
+		} else if ((s[i] & 0xE0) == 0xC0) {
+			n = 1;
+			cp = s[i] & 0x1F;
+			min = 0x80;
+		} else if ((s[i] & 0xF0) == 0xE0) {
+			n = 2;
+			cp = s[i] & 0x0F;
+			min = 0x800;
+		} else if ((s[i] & 0xF8) == 0xF0) {
+			n = 3;
+			cp = s[i] & 0x07;
+			min = 0x10000;
+		} else
+			return -1;
+
+		if (len - i - 1 < n)
+			return -1;
+		for (k = 1; k <= n; k++) {
+			if ((s[i + k] & 0xC0) != 0x80)
+				return -1;
+			cp = cp << 6 | (s[i + k] & 0x3F);
+		}
+		if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+			return -1;
+		i += n + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Validate size bytes of text made of the given characters over and over,
+ * padded out with spaces, old way and new.
+ */
+static void
+utf8_round(const char *name, const char *chars, long n, size_t size)
+{
+	uint8_t *buf;
+	size_t len = strlen(chars), off;
+	uint32_t state;
+	long i;
+	int bad = 0;
+	double start, t_old, t_new;
+
+	buf = malloc(size);
+	assert(buf);
+	for (off = 0; off + len <= size; off += len)
+		memcpy(buf + off, chars, len);
+	memset(buf + off, ' ', size - off);
+
+	start = now();
+	for (i = 0; i < n; i++)
+		bad |= utf8_bytewise(buf, size);
+	t_old = now() - start;
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		state = 0;
+		bad |= dumb_utf8_check(&state, buf, size) | (int) state;
+	}
+	t_new = now() - start;
+	assert(bad == 0);
+
+	printf("utf8 %-6s %8zu B %8.2f GB/s (bytewise) %8.2f GB/s "
+	    "(dumb_utf8_check) %6.1fx\n", name, size,
+	    (double) n * size / t_old / 1e9, (double) n * size / t_new / 1e9,
+	    t_old / t_new);
+
+	free(buf);
+}
+
+static void
+bench_utf8(long n, size_t size)
+{
+	if (n > (long) (MAX_BYTES / 4 / size))
+		n = (long) (MAX_BYTES / 4 / size);
+	if (n < 1)
+		n = 1;
+
+	utf8_round("ascii", "{\"dumb\": \"ws\", \"n\": 12345}, ", n, size);
+	utf8_round("latin", "caf\xc3\xa9 \xc3\xbc" "ber na\xc3\xafve ", n, size);
+	utf8_round("cjk", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae"
+	    "\xe6\x96\x87\xe7\xab\xa0", n, size);
+	utf8_round("emoji", "\xf0\x9f\x98\x80\xf0\x9f\x8e\x89\xf0\x9f\x90\xb8",
+	    n, size);
+	utf8_round("mixed", "ok caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac "
+	    "\xf0\x9f\x98\x80 done, ", n, size);
+}
+
+/*
+ * Play server to conns websockets on socketpairs, with one child reading
+ * and discarding whatever comes out the other ends.
+ */
+static pid_t
+sink_many(struct websocket *ws, long conns)
+{
+	struct pollfd *pfd;
+	char buf[65536];
+	int sv[2];
+	long i;
+	pid_t pid;
+
+	pfd = calloc((size_t) conns, sizeof(*pfd));
+	assert(pfd);
+	for (i = 0; i < conns; i++) {
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		memset(&ws[i], 0, sizeof(ws[i]));
+		ws[i].s = sv[0];
+		ws[i].server = 1;
+		ws[i].state = DWS_ST_OPEN;
+		pfd[i].fd = sv[1];
+		pfd[i].events = POLLIN;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		for (i = 0; i < conns; i++)
+			close(ws[i].s);
+		for (;;) {
+			if (poll(pfd, (nfds_t) conns, -1) < 0)
+				_exit(1);
+			for (i = 0; i < conns; i++) {
+				if (pfd[i].revents & POLLHUP)
+					_exit(0);
+				if (pfd[i].revents & POLLIN)
+					(void) read(pfd[i].fd, buf, sizeof(buf));
+			}
+		}
+	}
+
+	for (i = 0; i < conns; i++) {
+		close(pfd[i].fd);
+		fcntl(ws[i].s, F_SETFL, O_NONBLOCK);
+	}
+	free(pfd);
+	return pid;
+}
+
+/*
+ * Send n messages to every one of conns websockets, framing each message
+ * for every websocket with dumb_send() or once for all of them with a
+ * dumb_bcast.
+ */
+static void
+broadcast_round(const char *name, long conns, long n, size_t size,
+    int shared)
+{
+	struct websocket *ws;
+	struct dumb_bcast *b;
+	struct rlimit rl;
+	uint8_t *msg;
+	double start, secs;
+	long i, j, nallocs;
+	pid_t pid;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	ws = calloc((size_t) conns, sizeof(*ws));
+	msg = malloc(size);
+	assert(ws && msg);
+	memset(msg, 'B', size);
+	pid = sink_many(ws, conns);
+	assert(pid > 0);
+
+	// Warm the frame buffers up.
+	for (j = 0; j < conns; j++)
+		assert(dumb_send(&ws[j], msg, size) > 0);
+
+	nallocs = ALLOCS();
+	start = now();
+	for (i = 0; i < n; i++) {
+		if (shared) {
+			b = dumb_bcast_new(msg, size);
+			assert(b);
+			for (j = 0; j < conns; j++)
+				assert(dumb_bcast_send(&ws[j], b) > 0);
+			dumb_bcast_unref(b);
+		} else {
+			for (j = 0; j < conns; j++)
+				assert(dumb_send(&ws[j], msg, size) > 0);
+		}
+	}
+	secs = now() - start;
+	if (nallocs >= 0)
+		nallocs = ALLOCS() - nallocs;
+
+	printf("%-12s %5ld conns %7zu B %10.0f msg/s %8.1f MB/s %8.3f "
+	    "allocs/msg\n", name, conns, size, (double) (n * conns) / secs,
+	    (double) (n * conns) * size / secs / 1e6,
+	    nallocs < 0 ? -1.0 : (double) nallocs / (double) (n * conns));
+
+	for (j = 0; j < conns; j++)
+		dumb_free(&ws[j]);
+	waitpid(pid, NULL, 0);
+	free(ws);
+	free(msg);
+}
+
+static void
+bench_broadcast(long conns, long n, size_t size)
+{
+	broadcast_round("dumb_send", conns, n, size, 0);
+	broadcast_round("dumb_bcast", conns, n, size, 1);
+}
+
+/*
+ * A thread making masks as fast as it can, either from a websocket of its
+ * own or from random(3), which is what dumb_mask() used to boil down to on
+ * older glibc: one generator for the whole process, behind a lock.
+ */
+struct masker {
+	pthread_t		 t;
+	struct websocket	 ws;
+	int			 shared;
+	long			 n;
+	uint8_t			 first[16];	/* its first four masks */
+	uint32_t		 sum;		/* so nothing's optimized out */
+	double			 secs;
+};
+
+/*
+ * CPU time the calling thread has used, so threads waiting their turn for a
+ * core don't look like threads waiting on each other.
+ */
+static double
+thread_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void *
+make_masks(void *arg)
+{
+	struct masker *m = arg;
+	uint8_t mask[4];
+	uint32_t r;
+	double start;
+	long i;
+
+	start = thread_now();
+	for (i = 0; i < m->n; i++) {
+		if (m->shared) {
+			r = (uint32_t) random();
+			memcpy(mask, &r, sizeof(mask));
+		} else
+			dumb_mask(&m->ws, mask);
+		if (i < 4)
+			memcpy(m->first + 4 * i, mask, sizeof(mask));
+		m->sum += mask[0];
+	}
+	m->secs = thread_now() - start;
+	return NULL;
+}
+
+static void
+rng_round(const char *name, int threads, long n, int shared)
+{
+	struct masker *m;
+	double start, wall, secs = 0;
+	int i, j;
+
+	m = calloc((size_t) threads, sizeof(*m));
+	assert(m);
+	for (i = 0; i < threads; i++) {
+		m[i].shared = shared;
+		m[i].n = n;
+	}
+	start = now();
+	for (i = 0; i < threads; i++)
+		assert(pthread_create(&m[i].t, NULL, make_masks, &m[i]) == 0);
+	for (i = 0; i < threads; i++) {
+		pthread_join(m[i].t, NULL);
+		secs += m[i].secs;
+	}
+	wall = now() - start;
+
+	// Every websocket gets a keystream of its own.
+	if (!shared) {
+		for (i = 0; i < threads; i++) {
+			for (j = i + 1; j < threads; j++)
+				assert(memcmp(m[i].first, m[j].first,
+				    sizeof(m[i].first)) != 0);
+			dumb_free(&m[i].ws);
+		}
+	}
+
+	printf("%-10s %3d threads %8.1f ns CPU/mask %8.1f Mmasks/s\n", name,
+	    threads, secs / ((double) n * threads) * 1e9,
+	    (double) n * threads / wall / 1e6);
+	free(m);
+}
+
+static void
+bench_rng(long n)
+{
+	int threads;
+
+	srandom((unsigned int) time(NULL));
+	for (threads = 1; threads <= 32; threads *= 2) {
+		rng_round("random()", threads, n, 1);
+		rng_round("dumb_mask", threads, n, 0);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+	long n = DEFAULT_ITERATIONS, conns = 1000;
+	char *host = "localhost";
+	uint16_t port = 8000, tls_port = 8443;
+	size_t size = 0;
+	size_t sizes[] = { 16, 64, 512, 4096, 65535 };
+	size_t i, sz;
+
+	while ((ch = getopt(argc, argv, "c:h:n:p:s:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			conns = atol(optarg);
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = (uint16_t) atoi(optarg);
+			break;
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 's':
+			size = (size_t) atol(optarg);
+			break;
+		case 't':
+			tls_port = (uint16_t) atoi(optarg);
+			break;
+		default:
+			printf("bench usage: [-n iterations] [-s size] "
+			    "[-h host] [-p port] [-t tls port] [-c conns]\n"
+			    "             [send | batch | recv | stream | deflate | mask |\n"
+			    "              reactor | pool | tls | latency | sender | rng |\n"
+			    "              broadcast | handshake | utf8]\n");
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (argc == 0 || strcmp(argv[0], "send") == 0) {
+		if (size) {
+			bench_send(n, size);
+		} else {
+			for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+				bench_send(n, sizes[i]);
+		}
+	} else if (strcmp(argv[0], "batch") == 0) {
+		bench_batch(n, size ? size : 64);
+	} else if (strcmp(argv[0], "recv") == 0) {
+		if (size) {
+			bench_recv(n, size);
+		} else {
+			for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+				bench_recv(n, sizes[i]);
+		}
+	} else if (strcmp(argv[0], "stream") == 0) {
+		if (size) {
+			bench_stream(n, size);
+		} else {
+			for (sz = 1 << 20; sz <= (256 << 20); sz *= 16)
+				bench_stream(n, sz);
+		}
+	} else if (strcmp(argv[0], "deflate") == 0) {
+		bench_deflate(n);
+	} else if (strcmp(argv[0], "reactor") == 0) {
+		// Messages per connection, here.
+		if (n == DEFAULT_ITERATIONS)
+			n = 100;
+		bench_reactor(host, port, conns, n, size ? size : 64);
+	} else if (strcmp(argv[0], "pool") == 0) {
+		if (n == DEFAULT_ITERATIONS)
+			n = 100;
+		bench_pool(host, port, n);
+	} else if (strcmp(argv[0], "tls") == 0) {
+		// Point it at a TLS listener, like test.sh's go server on 8443.
+		if (n == DEFAULT_ITERATIONS)
+			n = 100;
+		bench_tls(host, port, n);
+	} else if (strcmp(argv[0], "latency") == 0) {
+		// Plain on -p, TLS on -t (test.sh's go servers), -t 0 for none.
+		if (n == DEFAULT_ITERATIONS)
+			n = 1000;
+		bench_latency(host, port, tls_port, n, size ? size : 64);
+	} else if (strcmp(argv[0], "sender") == 0) {
+		bench_sender(n, size ? size : 64);
+	} else if (strcmp(argv[0], "mask") == 0) {
+		if (size) {
+			bench_mask(n, size);
+		} else {
+			for (sz = 16; sz <= (16 << 20); sz *= 4)
+				bench_mask(n, sz);
+		}
+	} else if (strcmp(argv[0], "utf8") == 0) {
+		bench_utf8(n, size ? size : 65536);
+	} else if (strcmp(argv[0], "broadcast") == 0) {
+		// Messages to each connection, here.
+		if (n == DEFAULT_ITERATIONS)
+			n = 1000;
+		if (size) {
+			bench_broadcast(conns, n, size);
+		} else {
+			for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+				bench_broadcast(conns, n, sizes[i]);
+		}
+	} else if (strcmp(argv[0], "handshake") == 0) {
+		// Connections per round, here. Mind TIME_WAIT if you go big.
+		if (n == DEFAULT_ITERATIONS)
+			n = 2000;
+		bench_handshake(n);
+	} else if (strcmp(argv[0], "rng") == 0) {
+		// Masks per thread, here.
+		if (n == DEFAULT_ITERATIONS)
+			n = 10000000;
+		bench_rng(n);
+	} else {
+		printf("unknown benchmark: %s\n", argv[0]);
+		exit(1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# Run loadgen over the same matrix every time (message sizes, ping-pong vs
+# pipelined, connection counts, TLS where the server has it) against one or
+# more echo servers, one result per line:
+#
+#   ./bench.sh [-f json | csv] [-o results] [c] [go] [node] [rust]
+#
+# "c" is loadgen's own echo server, so it needs nothing else. go needs
+# `make test-service`, node an `npm install` in nodejs-test and rust a
+# cargo. Set BENCH_N for messages per connection (default 1000).
+
+FORMAT=json
+OUT=/dev/stdout
+N=${BENCH_N:-1000}
+
+SIZES="16 512 4096 65536"
+WINDOWS="1 16"
+CONNS="1 10 100"
+
+while getopts "f:o:" opt; do
+    case $opt in
+        f) FORMAT=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) echo "usage: $0 [-f json | csv] [-o results] [c go node rust]"
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- c
+
+[ "$FORMAT" = csv ] && ./loadgen -H > "$OUT"
+[ "$FORMAT" = csv ] || : > "$OUT"
+
+JOBS=""
+
+start() {
+    "$@" > /dev/null 2>&1 &
+    JOBS="$JOBS $!"
+}
+
+stop() {
+    for pid in $JOBS; do
+        kill $pid 2> /dev/null
+    done
+    wait 2> /dev/null
+    JOBS=""
+}
+
+trap stop EXIT INT TERM
+
+# run label tls port conns...
+run() {
+    label=$1; tls=$2; port=$3; shift 3
+    for conns in "$@"; do
+        for window in $WINDOWS; do
+            for size in $SIZES; do
+                args="-l $label -c $conns -w $window -s $size -n $N"
+                args="$args -f $FORMAT"
+                [ -n "$port" ] && args="$args -h localhost -p $port"
+                [ "$tls" = 1 ] && args="$args -t"
+                if ! ./loadgen $args >> "$OUT"; then
+                    echo "FAILED: loadgen $args" >&2
+                fi
+            done
+        done
+    done
+}
+
+for server in "$@"; do
+    echo "benchmarking $server..." >&2
+    case $server in
+        c)
+            run c 0 "" $CONNS
+            ;;
+        go)
+            COMMON="-e -c cert.pem -k key.pem -h localhost"
+            start ./go-test/dumb-ws ${COMMON} -p 8000
+            start ./go-test/dumb-ws -t ${COMMON} -p 8443
+            sleep 2
+            run go 0 8000 $CONNS
+            run go 1 8443 $CONNS
+            stop
+            ;;
+        node)
+            start sh -c "cd nodejs-test && exec node ws.js"
+            start sh -c "cd nodejs-test && exec node wss.js"
+            sleep 2
+            run node 0 8000 $CONNS
+            run node 1 8443 $CONNS
+            stop
+            ;;
+        rust)
+            # One connection at a time, no TLS.
+            (cd rust-test && cargo build --release -q) || exit 1
+            start ./rust-test/target/release/rust-test
+            sleep 1
+            run rust 0 8000 1
+            stop
+            ;;
+        *)
+            echo "don't know how to run $server" >&2
+            exit 1
+            ;;
+    esac
+done
@@ -5,6 +5,7 @@
 
 #ifndef _WIN32
 #include <sys/socket.h>
+#include <poll.h>
 #if defined(__X86_64__) || defined(__LP64__)
 #define SSIZE_T_PARAM "%ld"
 #else
@@ -14,6 +15,7 @@
 #include <WinSock2.h>
 #include <stdint.h>
 #define SSIZE_T_PARAM "%lld"
+#define poll WSAPoll
 #endif
 
 #include <assert.h>
@@ -33,18 +35,66 @@ static size_t LONG_MSG_LEN = sizeof(LONG_MSG) - 1;
 static char SHORT_MSG[] = "{\"msg\": \"websockets are dumb\"}";
 static size_t SHORT_MSG_LEN = sizeof(SHORT_MSG) - 1;
 
+// Big enough to need a 64 bit length.
+#define HUGE_MSG_LEN 200000
+
 static uint8_t buf[1024];
 
+// Enough of these and a server that can't keep up backs us up.
+#define FLOOD_MSG_LEN 4096
+static uint8_t flood[FLOOD_MSG_LEN + 16];
+
+static void
+on_writable(struct websocket *ws, void *arg)
+{
+	(void) ws;
+	*(int *) arg = 1;
+}
+
+/*
+ * Where dumb_send_stream() gets the huge payload from: lots of x's.
+ */
+static ssize_t
+fill_huge(void *out, size_t len, void *arg)
+{
+	(void) arg;
+	memset(out, 'x', len);
+	return (ssize_t) len;
+}
+
+/*
+ * Wait for the websocket like an event loop would.
+ */
+static void
+wait_for(struct websocket *ws)
+{
+	struct pollfd pfd;
+	int events = dumb_events(ws);
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = dumb_fd(ws);
+	if (events & DWS_POLLIN)
+		pfd.events |= POLLIN;
+	if (events & DWS_POLLOUT)
+		pfd.events |= POLLOUT;
+	assert(poll(&pfd, 1, 5000) == 1);
+}
+
 int
 main(int argc, char **argv)
 {
-	int ch;
+	int ch, ret, writable = 0;
+	long sent, echoed;
+	size_t left, total;
 	int use_tls = 0;
 	uint16_t port = 8000;
 	ssize_t len;
 	char *host = "localhost";
 	char out[1024];
 	struct websocket ws;
+	struct iovec batch[3];
+	struct dumb_msg msg;
+	struct dumb_stats stats, snap;
 
 	while ((ch = getopt(argc, argv, "th:p:")) != -1) {
 		switch (ch) {
@@ -66,6 +116,8 @@ main(int argc, char **argv)
 	printf("connecting to %s:%u\n", host, port);
 
 	memset(&ws, 0, sizeof(struct websocket));
+	memset(&stats, 0, sizeof(stats));
+	ws.stats = &stats;
 	if (use_tls)
 		assert(0 == dumb_connect_tls(&ws, host, port, 1));
 	else
@@ -77,6 +129,15 @@ main(int argc, char **argv)
 	assert(0 == dumb_ping(&ws));
 	printf("PINGed and got PONG frame!\n");
 
+	ws.ping_interval = 60000;
+	assert(0 == dumb_keepalive(&ws));
+	while (ws.ping_sent != 0) {
+		wait_for(&ws);
+		assert(dumb_recv(&ws, buf, sizeof(buf)) == DWS_WANT_POLL);
+	}
+	ws.ping_interval = 0;
+	printf("keepalive round trip took %lu us\n", (unsigned long) ws.rtt);
+
 	printf("sending small payload (%zu bytes)\n", SHORT_MSG_LEN);
 	len = dumb_send(&ws, &SHORT_MSG, SHORT_MSG_LEN);
 	assert(len == (ssize_t) SHORT_MSG_LEN + 6);
@@ -104,12 +165,185 @@ main(int argc, char **argv)
 	printf("received payload of " SSIZE_T_PARAM " bytes:\n---\n%s\n---\n",
 		len, out);
 
-	assert(DWS_OK == dumb_close(&ws));
+	printf("sending large payload in fragments\n");
+	ws.frag_size = 64;
+	len = dumb_send(&ws, &LONG_MSG, LONG_MSG_LEN);
+	assert(len == (ssize_t) LONG_MSG_LEN + 3 * 6);
+	do {
+		len = dumb_recv(&ws, buf, sizeof(buf));
+	} while (len == DWS_WANT_POLL);
+	assert(len == (ssize_t) LONG_MSG_LEN + 10);
+	printf("received payload of " SSIZE_T_PARAM " bytes\n", len);
+	ws.frag_size = 0;
+
+	printf("streaming huge payload (%d bytes)\n", HUGE_MSG_LEN);
+	len = dumb_send_stream(&ws, HUGE_MSG_LEN, fill_huge, NULL);
+	assert(len == HUGE_MSG_LEN + 14);
+	printf("sent " SSIZE_T_PARAM " bytes (header + payload)\n", len);
+
+	total = 0;
+	do {
+		while ((len = dumb_recv_chunk(&ws, buf, sizeof(buf), &left))
+		    == DWS_WANT_POLL)
+			;
+		assert(len > 0);
+		if (total == 0)
+			assert(memcmp(buf, "You said: x", 11) == 0);
+		else
+			assert(buf[len - 1] == 'x');
+		total += (size_t) len;
+	} while (left > 0);
+	assert(total == HUGE_MSG_LEN + 10);
+	printf("received payload of %zu bytes in pieces\n", total);
+
+	printf("sending a batch of 3 small payloads\n");
+	batch[0].iov_base = (void *) SHORT_MSG;
+	batch[0].iov_len = SHORT_MSG_LEN;
+	batch[1] = batch[2] = batch[0];
+	len = dumb_send_batch(&ws, batch, 3);
+	assert(len == 3 * ((ssize_t) SHORT_MSG_LEN + 6));
+	printf("sent " SSIZE_T_PARAM " bytes (3 frames)\n", len);
+
+	do {
+		len = dumb_recv(&ws, buf, sizeof(buf));
+	} while (len == DWS_WANT_POLL);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 10);
+
+	// The second is turned down for being too big, the third comes in
+	// place.
+	ws.max_msg = SHORT_MSG_LEN;
+	do {
+		len = dumb_recv_view(&ws, &msg);
+	} while (len == DWS_WANT_POLL);
+	assert(len == DWS_ERR_TOO_LARGE);
+	assert(msg.len == SHORT_MSG_LEN + 10);
+	ws.max_msg = 0;
+	do {
+		len = dumb_recv_view(&ws, &msg);
+	} while (len == DWS_WANT_POLL);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 10);
+	assert(msg.opcode == BINARY && msg.flags == 0);
+	assert(memcmp(msg.data, "You said: ", 10) == 0);
+	assert(memcmp(msg.data + 10, SHORT_MSG, SHORT_MSG_LEN) == 0);
+	printf("received two payloads, turned one down\n");
+
+	printf("sending small payload without blocking\n");
+	ws.nonblock = 1;
+	len = dumb_send(&ws, &SHORT_MSG, SHORT_MSG_LEN);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 6);
+	while ((ret = dumb_flush(&ws)) != DWS_OK) {
+		assert(ret == DWS_WANT_WRITE || ret == DWS_WANT_POLL);
+		wait_for(&ws);
+	}
+
+	memset(buf, 0, sizeof(buf));
+	while ((len = dumb_recv(&ws, buf, sizeof(buf))) == DWS_WANT_POLL
+	    || len == DWS_WANT_WRITE)
+		wait_for(&ws);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 10);
+	printf("received payload of " SSIZE_T_PARAM " bytes\n", len);
+
+	// Don't read the echoes, so the server stops reading us, so the
+	// queue backs up until the high watermark says no more.
+	printf("flooding until the high watermark pushes back\n");
+	ws.high_water = 64 * 1024;
+	ws.low_water = 16 * 1024;
+	ws.on_writable = on_writable;
+	ws.writable_arg = &writable;
+	memset(flood, 'f', sizeof(flood));
+	for (sent = 0; sent < 100000; sent++) {
+		len = dumb_send(&ws, flood, FLOOD_MSG_LEN);
+		if (len == DWS_WANT_WRITE)
+			break;
+		assert(len == FLOOD_MSG_LEN + 8);
+		assert(dumb_queued(&ws) <= ws.high_water);
+	}
+	assert(len == DWS_WANT_WRITE);
+	assert(dumb_queued(&ws) > ws.low_water);
+	printf("pushed back after %ld messages, %zu bytes queued\n", sent,
+	    dumb_queued(&ws));
+
+	// Catch up on the echoes until it says there's room again.
+	echoed = 0;
+	while (!writable) {
+		len = dumb_recv(&ws, flood, sizeof(flood));
+		if (len > 0) {
+			assert(len == FLOOD_MSG_LEN + 10);
+			echoed++;
+			continue;
+		}
+		assert(len == DWS_WANT_POLL || len == DWS_WANT_WRITE);
+		ret = dumb_flush(&ws);
+		assert(ret == DWS_OK || ret == DWS_WANT_WRITE
+		    || ret == DWS_WANT_POLL);
+		if (!writable)
+			wait_for(&ws);
+	}
+	assert(dumb_queued(&ws) <= ws.low_water);
+	assert(dumb_send(&ws, flood, FLOOD_MSG_LEN) == FLOOD_MSG_LEN + 8);
+	sent++;
+	while (echoed < sent) {
+		len = dumb_recv(&ws, flood, sizeof(flood));
+		if (len > 0) {
+			assert(len == FLOOD_MSG_LEN + 10);
+			echoed++;
+		} else {
+			assert(len == DWS_WANT_POLL || len == DWS_WANT_WRITE);
+			dumb_flush(&ws);
+			wait_for(&ws);
+		}
+	}
+	assert(dumb_queued(&ws) == 0);
+	ws.high_water = ws.low_water = 0;
+	printf("drained below the low watermark, got all %ld echoes\n",
+	    echoed);
+
+	while ((ret = dumb_close(&ws)) == DWS_WANT_POLL
+	    || ret == DWS_WANT_WRITE)
+		wait_for(&ws);
+	assert(DWS_OK == ret);
 	printf("sent a CLOSE frame!\n");
 
 	// Our socket should be closed now
 	assert(DWS_ERR_READ == dumb_recv(&ws, buf, sizeof(buf)));
 	printf("socket looks closed!\n");
 
+	ws.nonblock = 0;
+	assert(0 == dumb_reconnect(&ws));
+	assert(0 == dumb_handshake(&ws, "/", "dumb-ws"));
+	len = dumb_send(&ws, &SHORT_MSG, SHORT_MSG_LEN);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 6);
+	do {
+		len = dumb_recv(&ws, buf, sizeof(buf));
+	} while (len == DWS_WANT_POLL);
+	assert(len == (ssize_t) SHORT_MSG_LEN + 10);
+	assert(0 == dumb_close(&ws));
+	dumb_free(&ws);
+	printf("reconnected and closed again!\n");
+
+#ifndef DWS_NO_STATS
+	assert(dumb_stats_snapshot(&ws, &snap) == DWS_OK);
+	assert(snap.reconnects == 1);
+	assert(snap.frames_out[CLOSE] == 2 && snap.frames_in[CLOSE] == 2);
+	assert(snap.frames_out[PING] >= 2 && snap.frames_in[PONG] >= 2);
+	assert(snap.rtt_us.count == 2);
+	assert(snap.frames_in[BINARY] >= (uint64_t) echoed);
+	assert(snap.bytes_out[BINARY] >= (uint64_t) sent * FLOOD_MSG_LEN);
+	assert(snap.turned_away >= 1);
+	assert(snap.reads > 0 && snap.writes > 0);
+	assert(snap.send_ns.count > 0);
+	assert(dumb_hist_percentile(&snap.send_ns, 50)
+	    <= dumb_hist_percentile(&snap.send_ns, 99));
+	assert(dumb_hist_percentile(&snap.send_ns, 100) == snap.send_ns.max);
+	printf("counted %llu frames out and %llu in over %llu writes, "
+	    "send p99 %llu ns\n",
+	    (unsigned long long) snap.frames_out[BINARY],
+	    (unsigned long long) snap.frames_in[BINARY],
+	    (unsigned long long) snap.writes,
+	    (unsigned long long) dumb_hist_percentile(&snap.send_ns, 99));
+#else
+	(void) snap;
+#endif
+
 	return 0;
 }
@@ -21,10 +21,14 @@
 #define _CRT_RAND_S
 #include <WinSock2.h>
 #include <WS2tcpip.h>
+#define poll WSAPoll
+#define strncasecmp _strnicmp
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 #endif
 
 #include <fcntl.h>
@@ -32,25 +36,119 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 
+#if __GLIBC__ == 2 && __GLIBC_MINOR__ >= 25
+#include <sys/random.h>
+#endif
+
 #include <tls.h>
 
+#ifdef DWS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #include "dws.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
-// It's ludicrous to think we'd have a server handshake response larger
-#define HANDSHAKE_BUF_SIZE 1024
+#ifdef _WIN32
+#define HOW SD_BOTH
+#define CLOSE_SOCKET(s) closesocket(s)
+#define CONNECT_IN_PROGRESS() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define HOW SHUT_RDWR
+#define CLOSE_SOCKET(s) close(s)
+#define CONNECT_IN_PROGRESS() (errno == EINPROGRESS)
+#endif
+
+// BSDs call corking TCP_NOPUSH
+#if !defined(TCP_CORK) && defined(TCP_NOPUSH)
+#define TCP_CORK TCP_NOPUSH
+#endif
+
+// A peer that hung up is DWS_ERR_WRITE, not a SIGPIPE for the whole process.
+// Where there's no MSG_NOSIGNAL, ws_tune() sets SO_NOSIGPIPE instead.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Head start each address gets before we try the next (RFC 8305 sec. 5)
+#define CONNECT_ATTEMPT_DELAY 250
+
+// Nobody needs more addresses than this for one host, surely
+#define CONNECT_MAX_ADDRS 16
+
+// Servers tack on cookies, dates and banners, so leave room for those too
+#define HANDSHAKE_BUF_SIZE 8192
+
+// Browsers send cookies and all sorts, so give requests more room
+#define REQUEST_BUF_SIZE 8192
+
+// How much we try to pull off the socket at a time
+#define RECV_BUF_SIZE 16384
 
 // The largest frame header in bytes, assuming the largest payload
-#define FRAME_MAX_HEADER_SIZE 14
+#define FRAME_MAX_HEADER_SIZE DWS_FRAME_HEADROOM
+
+// How much of a streamed payload we buffer at a time.
+#define STREAM_CHUNK_SIZE 65536
+
+// Bits of the first byte of a frame besides the opcode.
+#define FRAME_FIN	0x80
+#define FRAME_RSV1	0x40	// compressed, with permessage-deflate
+
+// Counting for ws->stats, which costs a branch when it's NULL and nothing
+// at all in a DWS_NO_STATS build. Reading the clock costs more than the
+// rest put together, so only every STAT_SAMPLE'th send gets timed.
+#define STAT_SAMPLE	16
+#ifdef DWS_NO_STATS
+#define STAT_ADD(ws, field, n)		do { } while (0)
+#define STAT_FRAME(ws, dir, op, n)	do { } while (0)
+#define STAT_HIST(ws, hist, v)		do { } while (0)
+#define STAT_CLOCK(ws)			0
+#define STAT_SINCE(ws, hist, start)	do { (void) (start); } while (0)
+#else
+#define STAT_ADD(ws, field, n) do {					\
+	if ((ws)->stats)						\
+		(ws)->stats->field += (n);				\
+} while (0)
+#define STAT_FRAME(ws, dir, op, n) do {					\
+	if ((ws)->stats) {						\
+		(ws)->stats->frames_##dir[(op) & 0x0F]++;		\
+		(ws)->stats->bytes_##dir[(op) & 0x0F] += (n);		\
+	}								\
+} while (0)
+#define STAT_HIST(ws, hist, v) do {					\
+	if ((ws)->stats)						\
+		ws_hist_add(&(ws)->stats->hist, (v));			\
+} while (0)
+#define STAT_CLOCK(ws)							\
+	((ws)->stats && (ws)->stats->sends++ % STAT_SAMPLE == 0		\
+	    ? ws_now_ns() : 0)
+#define STAT_SINCE(ws, hist, start) do {				\
+	if ((start) != 0)						\
+		STAT_HIST(ws, hist, ws_now_ns() - (start));		\
+} while (0)
+#endif
+
+static const char ACCEPT_TEMPLATE[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: %s\r\n"
+    "%s%s%s\r\n";
 
-static const char server_handshake[] = "HTTP/1.1 101 Switching Protocols";
+// What the key gets glued to before hashing, per RFC 6455 sec. 1.3
+static const char ACCEPT_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 static const char HANDSHAKE_TEMPLATE[] =
     "GET %s HTTP/1.1\r\n"
@@ -58,16 +156,25 @@ static const char HANDSHAKE_TEMPLATE[] =
     "Upgrade: websocket\r\n"
     "Connection: Upgrade\r\n"
     "Sec-WebSocket-Key: %s\r\n"
-    "Sec-WebSocket-Protocol: %s\r\n"
+    "%s%s%s"
+    "%s"
     "Sec-WebSocket-Version: 13\r\n\r\n";
 
-static int rng_initialized = 0;
-
 static const char B64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static ssize_t ws_read(struct websocket *, void *, size_t);
-static ssize_t ws_read_all(struct websocket *, void *, size_t);
-static ssize_t ws_read_txt(struct websocket *, void *, size_t);
+/*
+ * A frame sitting in the receive buffer. The payload points into the buffer
+ * and has already been unmasked.
+ */
+struct ws_frame {
+	uint8_t		 flags;
+	uint8_t		 opcode;
+	uint8_t		*payload;
+	const uint8_t	*mask;	// NULL unless the server masked it
+	size_t		 len;
+	size_t		 size;	// header + payload
+};
+
 static void ws_shutdown(struct websocket *);
 
 
@@ -85,61 +192,146 @@ crap(int code, const char *fmt, ...)
 	exit(code);
 }
 
-static uint32_t
-portable_random(void)
+/*
+ * Fill the key for a websocket's keystream straight from the OS. There's no
+ * sensible way to carry on without one, so failing here is fatal.
+ */
+static void
+ws_rng_seed(uint32_t key[8])
 {
 #if _WIN32 || _WIN64
+	unsigned int r;
 	errno_t err;
-	uint32_t r = 0;
-	err = rand_s(&r);
-	if (err != 0)
-		crap(err, "%s: rand_s failed", __func__);
-	return r;
-#elif (__OpenBSD__ || __FreeBSD__ || __NetBSD__ || __APPLE__) \
-	|| (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 36)
-	return arc4random();
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		err = rand_s(&r);
+		if (err != 0)
+			crap(err, "%s: rand_s failed", __func__);
+		key[i] = r;
+	}
+#elif __OpenBSD__ || __FreeBSD__ || __NetBSD__ || __APPLE__
+	arc4random_buf(key, 8 * sizeof(key[0]));
+#else
+	uint8_t *p = (uint8_t *) key;
+	size_t off = 0, len = 8 * sizeof(key[0]);
+	ssize_t n;
+#if __GLIBC__ == 2 && __GLIBC_MINOR__ >= 25
+	while (off < len) {
+		n = getrandom(p + off, len - off, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			crap(1, "%s: getrandom: %s", __func__, strerror(errno));
+		off += (size_t) n;
+	}
 #else
-	static long r = 0;
-	uint32_t ret = 0;
+	// XXX: why doesn't every platform just have arc4random(3)?!
+	int fd;
 
-	if (r == 0) {
-		r = random();
-		ret = (uint32_t)(r & 0xFFFFFFFF);
-	} else {
-		r = r >> 32;
-		ret = (uint32_t)r;
-		r = 0;
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1)
+		crap(1, "%s: can't open /dev/urandom", __func__);
+	while (off < len) {
+		n = read(fd, p + off, len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			crap(1, "%s: failed to fill key", __func__);
+		off += (size_t) n;
 	}
-	return ret;
+	close(fd);
+#endif
 #endif
 }
+
+#define ROTL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) do {					\
+	a += b; d ^= a; d = ROTL32(d, 16);				\
+	c += d; b ^= c; b = ROTL32(b, 12);				\
+	a += b; d ^= a; d = ROTL32(d, 8);				\
+	c += d; b ^= c; b = ROTL32(b, 7);				\
+} while (0)
+
+/*
+ * One 64-byte ChaCha20 block, the original flavour with a 64-bit counter
+ * and a nonce of zero: every websocket has its own key, so there's nothing
+ * for a nonce to tell apart.
+ */
 static void
-init_rng(void)
+ws_chacha_block(const uint32_t key[8], uint64_t ctr, uint8_t out[64])
 {
-#ifndef _WIN32
-	// XXX: why doesn't every platform just have arc4random(3)?!
-	int fd;
-	ssize_t len;
-	char state[256];
+	uint32_t in[16], x[16];
+	int i;
 
-	fd = open("/dev/urandom", O_RDONLY);
-	len = read(fd, state, sizeof(state));
-	if (len < (ssize_t) sizeof(state))
-		crap(1, "%s: failed to fill state buffer", __func__);
-	close(fd);
+	in[0] = 0x61707865;	// "expand 32-byte k"
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		in[4 + i] = key[i];
+	in[12] = (uint32_t) ctr;
+	in[13] = (uint32_t) (ctr >> 32);
+	in[14] = 0;
+	in[15] = 0;
+
+	memcpy(x, in, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
 
-	initstate(time(NULL), state, sizeof(state));
-#endif
-	rng_initialized = 1;
+	// Little endian out, so every host makes the same stream.
+	for (i = 0; i < 16; i++) {
+		x[i] += in[i];
+		out[4 * i] = (uint8_t) x[i];
+		out[4 * i + 1] = (uint8_t) (x[i] >> 8);
+		out[4 * i + 2] = (uint8_t) (x[i] >> 16);
+		out[4 * i + 3] = (uint8_t) (x[i] >> 24);
+	}
 }
 
-static int
-choose(unsigned int upper_bound)
+/*
+ * Top the websocket's random bytes back up, keying it first if this is
+ * the first time it's needed any.
+ */
+static void
+ws_rng_refill(struct websocket *ws)
 {
-	if (!rng_initialized)
-		init_rng();
+	size_t i;
+
+	if (ws->rng_ctr == 0)
+		ws_rng_seed(ws->rng_key);
+	for (i = 0; i < sizeof(ws->rng_buf); i += 64)
+		ws_chacha_block(ws->rng_key, ws->rng_ctr++, ws->rng_buf + i);
+	ws->rng_left = sizeof(ws->rng_buf);
+}
 
-	return (int) portable_random() % upper_bound;
+/*
+ * Take len random bytes from the websocket's keystream.
+ */
+static void
+ws_random(struct websocket *ws, void *out, size_t len)
+{
+	uint8_t *p = out, *src;
+	size_t n;
+
+	while (len > 0) {
+		if (ws->rng_left == 0)
+			ws_rng_refill(ws);
+		n = MIN(len, ws->rng_left);
+		src = ws->rng_buf + sizeof(ws->rng_buf) - ws->rng_left;
+		memcpy(p, src, n);
+		ws->rng_left -= n;
+		p += n;
+		len -= n;
+	}
 }
 
 /*
@@ -151,630 +343,4801 @@ choose(unsigned int upper_bound)
  * to make our key?
  */
 static void
-dumb_key(char *out)
+dumb_key(struct websocket *ws, char *out)
 {
-	int i, r;
+	uint8_t r[22];
+	int i;
 
 	/* 25 because 22 for the fake b64 + == + NULL */
 	memset(out, 0, 25);
-	for (i = 0; i < 22; i++) {
-		r = choose(sizeof(B64) - 1);
-		out[i] = B64[r];
-	}
+	ws_random(ws, r, sizeof(r));
+	for (i = 0; i < 22; i++)
+		out[i] = B64[r[i] & 0x3F];
 	out[22] = '=';
 	out[23] = '=';
 	out[24] = '\0';
 }
 
 /*
- * As the name implies, it just makes a random mask for use in our frames.
+ * dumb_mask
+ *
+ * As the name implies, it just makes a random mask for use in a frame, the
+ * next four bytes of the websocket's own keystream. Handy alongside
+ * dumb_apply_mask() if you're framing things yourself.
+ *
+ * Most of the time that's a copy out of a buffer; every 64th mask costs
+ * four ChaCha20 blocks to refill it. Nothing's shared between websockets,
+ * so threads sending on different ones never wait on each other here.
+ *
+ * Parameters:
+ *  ws: a pointer to a dumb websocket
+ *  mask: where to put the mask
  */
-static void
-dumb_mask(uint8_t mask[4])
+void
+dumb_mask(struct websocket *ws, uint8_t mask[4])
 {
-	uint32_t r;
-
-	if (!rng_initialized)
-		init_rng();
-	r = portable_random();
+	uint8_t *src;
 
-	mask[0] = r >> 24;
-	mask[1] = (r & 0x00FF0000) >> 16;
-	mask[2] = (r & 0x0000FF00) >> 8;
-	mask[3] = (r & 0x000000FF);
+	if (ws->rng_left < 4) {
+		ws_random(ws, mask, 4);
+		return;
+	}
+	src = ws->rng_buf + sizeof(ws->rng_buf) - ws->rng_left;
+	memcpy(mask, src, 4);
+	ws->rng_left -= 4;
 }
 
 /*
- * Safely read at most `n` bytes into the given buffer.
+ * SHA-1 (RFC 3174), just enough of it to work out a Sec-WebSocket-Accept.
+ * It's broken for anything that matters, but that's not our call.
  */
-static ssize_t
-ws_read(struct websocket *ws, void *buf, size_t buflen)
+static void
+ws_sha1_block(uint32_t h[5], const uint8_t *p)
 {
-	ssize_t _buflen, sz, len = 0;
-	char *_buf;
-
-	if (buflen > INT_MAX)
-		crap(1, "ws_read: buflen too large");
-
-	_buf = (char*) buf;
-	_buflen = (ssize_t) buflen;
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
 
-	while (_buflen > 0) {
-		if (ws->ctx) {
-			sz = tls_read(ws->ctx, _buf, _buflen);
-			if (sz == TLS_WANT_POLLIN || sz == TLS_WANT_POLLOUT) {
-				if (len == 0)
-					return DWS_WANT_POLL;
-				break;
-			} else if (sz == -1)
-				return -1;
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16
+		    | (uint32_t) p[4 * i + 2] << 8 | (uint32_t) p[4 * i + 3];
+	for (; i < 80; i++)
+		w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
 		} else {
-			sz = recv(ws->s, _buf, _buflen, 0);
-			if (sz == -1 && errno == EAGAIN) {
-				if (len == 0)
-					return DWS_WANT_POLL;
-				break;
-			}
-			else if (sz == -1) {
-				// TODO: check some common errno's and return
-				// something better.
-				return -1;
-			} else if (sz == 0) {
-				// Disconnect/EOF?
-				// TODO!
-				return -1;
-			}
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
 		}
+		t = ROTL32(a, 5) + f + e + k + w[i];
+		e = d, d = c, c = ROTL32(b, 30), b = a, a = t;
+	}
+	h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+}
+
+static void
+ws_sha1(const uint8_t *msg, size_t len, uint8_t out[20])
+{
+	uint32_t h[5] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+	uint8_t block[64];
+	uint64_t bits = (uint64_t) len * 8;
+	int i;
+
+	for (; len >= 64; msg += 64, len -= 64)
+		ws_sha1_block(h, msg);
 
-		_buf += sz;
-		_buflen -= sz;
-		len += sz;
+	memset(block, 0, sizeof(block));
+	memcpy(block, msg, len);
+	block[len] = 0x80;
+	if (len + 1 > 56) {
+		ws_sha1_block(h, block);
+		memset(block, 0, sizeof(block));
 	}
+	for (i = 0; i < 8; i++)
+		block[63 - i] = (uint8_t) (bits >> (8 * i));
+	ws_sha1_block(h, block);
 
-	// TODO: figure out how we want to handle errors...
-	// win32 spits out a different error than posix systems, btw.
+	for (i = 0; i < 20; i++)
+		out[i] = (uint8_t) (h[i / 4] >> (24 - 8 * (i % 4)));
+}
 
-	return len;
+/*
+ * Real base64 this time, with padding. out needs 4 bytes for every 3 (or
+ * part of 3) going in, plus the NUL.
+ */
+static void
+ws_base64(const uint8_t *in, size_t len, char *out)
+{
+	uint32_t v;
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		v = (uint32_t) in[i] << 16 | (uint32_t) in[i + 1] << 8 | in[i + 2];
+		*out++ = B64[v >> 18];
+		*out++ = B64[(v >> 12) & 0x3F];
+		*out++ = B64[(v >> 6) & 0x3F];
+		*out++ = B64[v & 0x3F];
+	}
+	if (i < len) {
+		v = (uint32_t) in[i] << 16;
+		if (i + 1 < len)
+			v |= (uint32_t) in[i + 1] << 8;
+		*out++ = B64[v >> 18];
+		*out++ = B64[(v >> 12) & 0x3F];
+		*out++ = i + 1 < len ? B64[(v >> 6) & 0x3F] : '=';
+		*out++ = '=';
+	}
+	*out = '\0';
 }
 
 /*
- * Read at `buflen` bytes into the given buffer, busy polling as needed.
+ * Work out the Sec-WebSocket-Accept that goes with a Sec-WebSocket-Key:
+ * base64(SHA-1(key + GUID)), always 28 characters.
+ *
+ * Returns 0, or -1 if the key's too long to be a real one.
  */
-static ssize_t
-ws_read_all(struct websocket *ws, void *buf, size_t buflen)
+static int
+ws_accept_key(const char *key, size_t len, char out[29])
 {
-	ssize_t _buflen, sz, len = 0;
-	char *_buf;
+	char buf[64 + sizeof(ACCEPT_GUID)];
+	uint8_t digest[20];
 
-	if (buflen > INT_MAX)
-		crap(1, "%s: buflen too large", __func__);
-	if (buflen == 0)
-		crap(1, "%s: buflen == 0?!", __func__);
+	if (len > 64)
+		return -1;
+	memcpy(buf, key, len);
+	memcpy(buf + len, ACCEPT_GUID, sizeof(ACCEPT_GUID) - 1);
+	ws_sha1((const uint8_t *) buf, len + sizeof(ACCEPT_GUID) - 1, digest);
+	ws_base64(digest, sizeof(digest), out);
+	return 0;
+}
 
-	_buf = (char*) buf;
-	_buflen = (ssize_t) buflen;
+/*
+ * In blocking mode, sleep in poll(2) until the socket is ready for what the
+ * last I/O call wanted. In non-blocking mode there's nothing to do but hand
+ * the want back to the caller.
+ *
+ * Returns 0 if the caller should retry, otherwise the DWS_WANT_* code,
+ * DWS_ERR_TIMEOUT or an error.
+ */
+static int
+ws_wait(struct websocket *ws, int want)
+{
+	struct pollfd pfd;
+	int n;
 
-	while (_buflen > 0) {
-		if (ws->ctx) {
-			sz = tls_read(ws->ctx, _buf, _buflen);
-			if (sz == TLS_WANT_POLLIN || sz == TLS_WANT_POLLOUT)
-				continue;
-			else if (sz == -1)
-				return -1;
-		} else {
-			sz = recv(ws->s, _buf, _buflen, 0);
-			if (sz == -1 && errno == EAGAIN)
-				continue;
-			else if (sz == -1)
-				return -1;
-			else if (sz == 0) // TODO: disconnect!
-				return -1;
-		}
+	if (ws->nonblock)
+		return want;
 
-		_buf += sz;
-		_buflen -= sz;
-		len += sz;
-	}
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = ws->s;
+	pfd.events = (want == DWS_WANT_WRITE) ? POLLOUT : POLLIN;
 
-	// TODO: figure out how we want to handle errors...
-	// win32 spits out a different error than posix systems, btw.
+	STAT_ADD(ws, waits, 1);
+	do {
+		n = poll(&pfd, 1, ws->timeout > 0 ? ws->timeout : -1);
+	} while (n == -1 && errno == EINTR);
 
-	return len;
+	if (n == 0)
+		return DWS_ERR_TIMEOUT;
+	else if (n < 0)
+		return (want == DWS_WANT_WRITE) ? DWS_ERR_WRITE : DWS_ERR_READ;
+
+	return 0;
 }
 
 /*
- * Read up to buflen bytes into buf, looking for `\r\n` terminators.
+ * Nanoseconds on a clock that only ever goes forward.
  */
-static ssize_t
-ws_read_txt(struct websocket *ws, void *buf, size_t buflen)
+static uint64_t
+ws_now_ns(void)
 {
-	ssize_t _buflen, sz, len = 0;
-	char *_buf, *end = NULL;
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
 
-	if (buflen > INT_MAX)
-		crap(1, "ws_read: buflen too large");
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t) (now.QuadPart / freq.QuadPart * 1000000000
+	    + now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+	struct timespec ts;
 
-	_buf = (char*) buf;
-	_buflen = (ssize_t) buflen;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
 
-	while (_buflen > 0) {
-		if (ws->ctx) {
-			sz = tls_read(ws->ctx, _buf, _buflen);
-			if (sz == TLS_WANT_POLLIN || sz == TLS_WANT_POLLOUT)
-				continue;
-			else if (sz == -1)
-				return -1;
-		} else {
-			sz = recv(ws->s, _buf, _buflen, 0);
-			if (sz == -1 && errno == EAGAIN)
-				continue;
-			else if (sz == -1)
-				return -1;
-			else if (sz == 0)
-				return -1; // TODO: Disconnect!
-		}
+/*
+ * Microseconds on the same clock.
+ */
+static uint64_t
+ws_now(void)
+{
+	return ws_now_ns() / 1000;
+}
 
-		_buf += sz;
-		_buflen -= sz;
-		len += sz;
+#ifndef DWS_NO_STATS
+/*
+ * Which dumb_hist bucket a value goes in: the value itself below 16, then
+ * the power of two it's in and the next three bits below the top one.
+ */
+static size_t
+ws_hist_bucket(uint64_t v)
+{
+	int top;
 
-		if (len >= 4) {
-			// Look for terminator pattern.
-			end = _buf - 4;
-			if (memcmp(end, "\r\n\r\n", 4) == 0)
-				break;
-		}
-	}
+	if (v < 16)
+		return (size_t) v;
+	if (v >= (uint64_t) 1 << 40)
+		return DWS_HIST_BUCKETS - 1;
 
-	// TODO: figure out how we want to handle errors...
-	// win32 spits out a different error than posix systems, btw.
+	top = 63 - __builtin_clzll(v);
+	return (size_t) (top - 2) * 8 + (size_t) ((v >> (top - 3)) & 7);
+}
 
-	return len;
+static void
+ws_hist_add(struct dumb_hist *h, uint64_t v)
+{
+	h->buckets[ws_hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
 }
+#endif /* DWS_NO_STATS */
 
 /*
- * Safely write the given buf up to buflen via the socket.
+ * Pull whatever the socket has into the receive buffer with a single read,
+ * first making sure it can hold `want` bytes past roff.
  *
- * Will write the entirety of the given buffer. Does not currently use any
- * poll like functionality, so will busy poll the socket!
+ * Returns the number of bytes read, DWS_WANT_POLL or DWS_WANT_WRITE if the
+ * socket (or TLS) isn't ready, DWS_ERR_TOO_LARGE if want is more than the
+ * buffer could ever hold, or -1 on error or EOF.
  */
 static ssize_t
-ws_write(struct websocket *ws, const void *buf, size_t buflen)
+ws_fill(struct websocket *ws, size_t want)
 {
-	ssize_t _buflen, sz, len = 0;
-	char *_buf;
+	uint8_t *buf;
+	size_t cap, avail, need;
+	ssize_t sz;
+
+	avail = ws->rlen - ws->roff;
+	need = want > avail ? want - avail : 1;
+
+	// Slide any leftovers back to the front if we've run out of room.
+	if (ws->rcap - ws->rlen < need && ws->roff > 0) {
+		memmove(ws->rbuf, ws->rbuf + ws->roff, avail);
+		ws->roff = 0;
+		ws->rlen = avail;
+	}
 
-	if (buflen > INT_MAX)
-		return -1;
-	if (buflen == 0)
-		return 0;
+	if (ws->rcap - ws->rlen < need) {
+		if (need > SIZE_MAX / 2 - ws->rlen)
+			return DWS_ERR_TOO_LARGE;
+		cap = ws->rcap ? ws->rcap : RECV_BUF_SIZE;
+		while (cap - ws->rlen < need) {
+			if (cap > SIZE_MAX / 2)
+				return DWS_ERR_TOO_LARGE;
+			cap *= 2;
+		}
+		buf = realloc(ws->rbuf, cap);
+		if (buf == NULL)
+			return -1;
+		ws->rbuf = buf;
+		ws->rcap = cap;
+	}
 
-	_buf = (char *)buf;
-	_buflen = (ssize_t) buflen;
+	ws->want = 0;
+	STAT_ADD(ws, reads, 1);
+	if (ws->ctx) {
+		sz = tls_read(ws->ctx, ws->rbuf + ws->rlen, ws->rcap - ws->rlen);
+		if (sz == TLS_WANT_POLLIN) {
+			STAT_ADD(ws, tls_retries, 1);
+			return DWS_WANT_POLL;
+		} else if (sz == TLS_WANT_POLLOUT) {
+			// Renegotiation and friends: a read that needs a write.
+			STAT_ADD(ws, tls_retries, 1);
+			ws->want = DWS_POLLOUT;
+			return DWS_WANT_WRITE;
+		} else if (sz == -1)
+			return -1;
+		else if (sz == 0)
+			return -1; // TODO: Disconnect!
+	} else {
+		sz = recv(ws->s, ws->rbuf + ws->rlen, ws->rcap - ws->rlen, 0);
+		if (sz == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			STAT_ADD(ws, would_block, 1);
+			return DWS_WANT_POLL;
+		} else if (sz == -1)
+			return -1;
+		else if (sz == 0)
+			return -1; // TODO: Disconnect!
+	}
 
-	while (_buflen > 0) {
-		if (ws->ctx) {
-			sz = tls_write(ws->ctx, _buf, (size_t) _buflen);
-			if (sz == TLS_WANT_POLLOUT || sz == TLS_WANT_POLLIN)
-				continue;
-			else if (sz == -1)
-				return -1;
-		} else {
-			sz = send(ws->s, _buf, (size_t) _buflen, 0);
-			if (sz == -1 && errno == EAGAIN)
-				continue;
-			else if (sz == -1)
-				return -1;
-		}
+	// TODO: figure out how we want to handle errors...
+	// win32 spits out a different error than posix systems, btw.
 
-		_buf += sz;
-		_buflen -= sz;
-		len += sz;
+#ifdef TCP_QUICKACK
+	// Linux turns this back off whenever it feels like it.
+	if (ws->sockopts.quickack) {
+		int on = 1;
+		setsockopt(ws->s, IPPROTO_TCP, TCP_QUICKACK, (const void *) &on,
+		    sizeof(on));
 	}
+#endif
 
-	return len;
+	ws->rlen += (size_t) sz;
+	return sz;
 }
 
 /*
- * Initialize a frame buffer, returning the current size of the frame in bytes.
+ * Parse just the header of the frame at the front of the receive buffer.
  *
- * For reference, this is what frames look like per RFC6455 sec. 5.2:
- *
- *     0                   1                   2                   3
- *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
- *    +-+-+-+-+-------+-+-------------+-------------------------------+
- *    |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
- *    |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
- *    |N|V|V|V|       |S|             |   (if payload len==126/127)   |
- *    | |1|2|3|       |K|             |                               |
- *    +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
- *    |     Extended payload length continued, if payload len == 127  |
- *    + - - - - - - - - - - - - - - - +-------------------------------+
- *    |                               |Masking-key, if MASK set to 1  |
- *    +-------------------------------+-------------------------------+
- *    | Masking-key (continued)       |          Payload Data         |
- *    +-------------------------------- - - - - - - - - - - - - - - - +
- *    :                     Payload Data continued ...                :
- *    + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
- *    |                     Payload Data continued ...                |
- *    +---------------------------------------------------------------+
+ * Returns 1 and fills in `f` (with `f->size` being the header length) if
+ * the whole header is buffered, 0 if we need more bytes, in which case
+ * `f->size` is how many we need in total, or DWS_ERR_* if it's bogus.
  */
-static ssize_t
-init_frame(uint8_t *frame, enum ws_opcode opcode, uint8_t mask[4], size_t len)
+static int
+ws_parse_header(struct websocket *ws, struct ws_frame *f)
 {
-	int idx = 0;
-	uint16_t payload;
+	uint8_t *p;
+	uint64_t len;
+	size_t avail, header_len = 2;
+	int i;
 
-	// Just a quick safety check: we don't do large payloads
-	if (len > (1 << 24))
-		return -1;
+	memset(f, 0, sizeof(*f));
+	p = ws->rbuf + ws->roff;
+	avail = ws->rlen - ws->roff;
 
-	frame[0] = (uint8_t) (0x80 + opcode);
-	if (len < 126) {
-		// The trivial "7 bit" payload case
-		frame[1] = 0x80 + (uint8_t) len;
-		idx = 1;
-	} else {
-		// The "7+16 bits" payload len case
-		frame[1] = 0x80 + 126;
+	f->size = header_len;
+	if (avail < header_len)
+		return 0;
 
-		// Payload length in network byte order
-		payload = htons(len);
-		frame[2] = payload & 0xFF;
-		frame[3] = payload >> 8;
-		idx = 3;
-	}
-	// And that's it, because 2^24 bytes should be enough for anyone!
+	f->flags = p[0];
+	f->opcode = p[0] & 0x0F;
+	f->len = p[1] & 0x7F;
 
-	// Gotta send a copy of the mask
-	frame[++idx] = mask[0];
-	frame[++idx] = mask[1];
-	frame[++idx] = mask[2];
-	frame[++idx] = mask[3];
+	// RSV2 and RSV3 mean extensions nobody negotiated.
+	if (p[0] & 0x30)
+		return DWS_ERR_INVALID;
 
-	// XXX: remember, we return the true size...not the offset
-	return idx + 1;
-}
+	if (f->len == 126)
+		header_len += 2;
+	else if (f->len == 127)
+		header_len += 8;
+	if (p[1] & 0x80)
+		header_len += 4;
 
-#ifdef DEBUG
-static void
-dump_frame(uint8_t *frame, size_t len)
-{
-	size_t i;
-	int first = 1;
+	f->size = header_len;
+	if (avail < header_len)
+		return 0;
 
-	for (i = 0; i < len; i++) {
-		printf("0x%02x ", frame[i]);
-		if (!first && (i+1) % 4 == 0)
-			printf("\n");
-		first = 0;
+	// Payload size arrives in network byte order.
+	if (f->len == 126) {
+		f->len = (size_t) p[2] << 8;
+		f->len += p[3];
+	} else if (f->len == 127) {
+		// The most significant bit has to be 0, says RFC 6455.
+		if (p[2] & 0x80)
+			return DWS_ERR_INVALID;
+		for (i = 0, len = 0; i < 8; i++)
+			len = (len << 8) + p[2 + i];
+		if (len > SIZE_MAX - header_len)
+			return DWS_ERR_TOO_LARGE;
+		f->len = (size_t) len;
 	}
-	printf("\n");
+
+	f->payload = p + header_len;
+	if (p[1] & 0x80)
+		f->mask = p + header_len - 4;
+
+	// Clients have to mask every frame (RFC 6455 sec. 5.1).
+	if (ws->server && f->mask == NULL)
+		return DWS_ERR_INVALID;
+
+	return 1;
 }
-#endif
 
 /*
- * dumb_frame
- *
- * Construct a Binary frame containing a given payload
- *
- * Parameters:
- *  (out) frame: pointer to a buffer to write the frame data to
- *  data: pointer to the binary data payload to frame
- *  len: length of the binary payload to frame
- *
- * Assumptions:
- *  - you've properly sized the destination buffer (*out)
- *
- * Returns:
- *  size of the frame in bytes,
- * -1 when len is too large
+ * Try to parse a complete frame out of the receive buffer without copying.
  *
+ * Returns 1 and fills in `f` if a whole frame is buffered, or 0 if we need
+ * more bytes, in which case `f->size` is how many we need in total. Bogus
+ * headers get a DWS_ERR_* code.
  */
-static ssize_t
-dumb_frame(uint8_t *frame, const uint8_t *data, size_t len)
+static int
+ws_parse_frame(struct websocket *ws, struct ws_frame *f)
 {
-	int i;
-	ssize_t header_len;
-	uint8_t mask[4] = { 0, 0, 0, 0 };
-
-	// Just a quick safety check: we don't do large payloads
-	if (len > (1 << 24))
-		return DWS_ERR_TOO_LARGE;
+	int ret;
 
-	// Pretend we're in Eyes Wide Shut
-	dumb_mask(mask);
+	ret = ws_parse_header(ws, f);
+	if (ret != 1)
+		return ret;
 
-	header_len = init_frame(frame, BINARY, mask, len);
-	if (header_len < 0)
-		crap(1, "init_frame: bad frame length");
+	// The whole frame has to fit in the receive buffer.
+	if (f->len > SIZE_MAX / 2 - f->size)
+		return DWS_ERR_TOO_LARGE;
+	f->size += f->len;
+	if (ws->rlen - ws->roff < f->size)
+		return 0;
 
-	for (i = 0; i < (int) len; i++) {
-		// We just transmit in host byte order, someone else's problem
-		frame[header_len + i] = data[i] ^ mask[i % 4];
+	// Clients always mask. Servers aren't supposed to, but if one does we
+	// can cope. The key is zeroed once used so parsing the frame again is
+	// harmless.
+	if (f->mask) {
+		dumb_apply_mask(f->payload, f->payload, f->len, f->mask, 0);
+		memset(f->payload - 4, 0, 4);
 	}
 
-	return header_len + i;
+	return 1;
 }
 
 /*
- * dumb_handshake
+ * Get the next complete frame, reading from the socket only when the
+ * receive buffer runs dry. The frame points into the receive buffer and
+ * stays there until it's handed to ws_consume().
+ *
+ * If nothing at all has arrived and `wait` isn't set we return DWS_WANT_POLL
+ * straight away, like we always have. Otherwise we wait for the rest of the
+ * frame via ws_wait(), which means handing back a DWS_WANT_* code in
+ * non-blocking mode. Partial frames just sit in the buffer until next time.
+ *
+ * Nothing is read while dumb_recv_chunk() is partway through a payload.
+ */
+static int
+ws_next(struct websocket *ws, struct ws_frame *f, int wait,
+    int (*parse)(struct websocket *, struct ws_frame *))
+{
+	ssize_t n;
+	int ret;
+
+	// The front of the buffer is the middle of a streamed payload.
+	if (ws->rx_left > 0)
+		return DWS_ERR_INVALID;
+
+	// Whatever dumb_recv_view() last handed out is fair game now.
+	if (ws->rx_hold > 0) {
+		ws->roff += ws->rx_hold;
+		if (ws->roff == ws->rlen)
+			ws->roff = ws->rlen = 0;
+		ws->rx_hold = 0;
+	}
+
+	while ((ret = parse(ws, f)) != 1) {
+		if (ret < 0)
+			return ret;
+		n = ws_fill(ws, f->size);
+		if (n == DWS_WANT_POLL || n == DWS_WANT_WRITE) {
+			if (!wait && ws->rlen == ws->roff)
+				return ws->nonblock ? (int) n : DWS_WANT_POLL;
+			ret = ws_wait(ws, (int) n);
+			if (ret)
+				return ret;
+		} else if (n == DWS_ERR_TOO_LARGE)
+			return DWS_ERR_TOO_LARGE;
+		else if (n < 0)
+			return DWS_ERR_READ;
+	}
+
+	return 0;
+}
+
+static int
+ws_next_frame(struct websocket *ws, struct ws_frame *f, int wait)
+{
+	int ret;
+
+	ret = ws_next(ws, f, wait, ws_parse_frame);
+	if (ret == 0)
+		STAT_FRAME(ws, in, f->opcode, f->len);
+	return ret;
+}
+
+static void
+ws_consume(struct websocket *ws, struct ws_frame *f)
+{
+	ws->roff += f->size;
+	if (ws->roff == ws->rlen)
+		ws->roff = ws->rlen = 0;
+}
+
+/*
+ * Read the other end's handshake headers (the server's response, or the
+ * client's request if we're serving) into buf, up to and including the
+ * blank line. Anything sent after the headers (like the first frames)
+ * stays put in the receive buffer.
+ *
+ * In non-blocking mode this can return a DWS_WANT_* code, in which case
+ * whatever we got so far stays buffered until we're called again.
+ */
+static ssize_t
+ws_read_headers(struct websocket *ws, void *buf, size_t buflen)
+{
+	uint8_t *p, *end, *cr;
+	size_t len, scanned = 0;
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		p = ws->rbuf + ws->roff;
+		end = ws->rbuf + ws->rlen;
+
+		// Look for the terminator, picking up where we left off.
+		cr = p + (scanned > 3 ? scanned - 3 : 0);
+		while (ws->rbuf != NULL && cr < end
+		    && (cr = memchr(cr, '\r', (size_t) (end - cr))) != NULL) {
+			if (end - cr >= 4 && memcmp(cr, "\r\n\r\n", 4) == 0) {
+				len = (size_t) (cr + 4 - p);
+				if (len > buflen)
+					return -1;
+				memcpy(buf, p, len);
+				ws->roff += len;
+				if (ws->roff == ws->rlen)
+					ws->roff = ws->rlen = 0;
+				return (ssize_t) len;
+			}
+			cr++;
+		}
+		scanned = ws->rlen - ws->roff;
+
+		if (scanned >= buflen)
+			return -1;
+
+		n = ws_fill(ws, 0);
+		if (n == DWS_WANT_POLL || n == DWS_WANT_WRITE) {
+			ret = ws_wait(ws, (int) n);
+			if (ret)
+				return ret;
+		} else if (n < 0)
+			return -1;
+	}
+}
+
+/*
+ * Write as much of the given buffer as the socket will take right now.
+ *
+ * Returns the number of bytes written, DWS_WANT_WRITE or DWS_WANT_POLL if
+ * the socket (or TLS) isn't ready, or DWS_ERR_WRITE.
+ */
+static ssize_t
+ws_write(struct websocket *ws, const void *buf, size_t buflen)
+{
+	ssize_t sz;
+
+	if (buflen > INT_MAX)
+		buflen = INT_MAX;
+
+	ws->want = 0;
+	STAT_ADD(ws, writes, 1);
+	if (ws->ctx) {
+		sz = tls_write(ws->ctx, buf, buflen);
+		if (sz == TLS_WANT_POLLOUT || sz == TLS_WANT_POLLIN)
+			STAT_ADD(ws, tls_retries, 1);
+		if (sz == TLS_WANT_POLLOUT)
+			return DWS_WANT_WRITE;
+		else if (sz == TLS_WANT_POLLIN)
+			return DWS_WANT_POLL;
+		else if (sz == -1)
+			return DWS_ERR_WRITE;
+	} else {
+		sz = send(ws->s, buf, buflen, SEND_FLAGS);
+		// EINPROGRESS is a Fast Open connect that's still going.
+		if (sz == -1 && (errno == EAGAIN || errno == EWOULDBLOCK
+		    || errno == EINPROGRESS)) {
+			STAT_ADD(ws, would_block, 1);
+			return DWS_WANT_WRITE;
+		} else if (sz == -1)
+			return DWS_ERR_WRITE;
+	}
+
+	return sz;
+}
+
+/*
+ * Size of the frame header for a payload of len bytes, mask included.
+ */
+static size_t
+ws_header_len(size_t len)
+{
+	if (len < 126)
+		return 6;
+	else if (len <= 0xFFFF)
+		return 8;
+	return 14;
+}
+
+/*
+ * Total size of one of our own frames from its header, masked or not.
+ */
+static size_t
+ws_frame_size(const uint8_t *p)
+{
+	uint64_t len;
+	size_t header_len = 2;
+	int i;
+
+	len = p[1] & 0x7F;
+	if (len == 126) {
+		len = ((uint64_t) p[2] << 8) + p[3];
+		header_len += 2;
+	} else if (len == 127) {
+		for (i = 0, len = 0; i < 8; i++)
+			len = (len << 8) + p[2 + i];
+		header_len += 8;
+	}
+	if (p[1] & 0x80)
+		header_len += 4;
+
+	return header_len + (size_t) len;
+}
+
+/*
+ * Put the cork in once the websocket's open, if asked to. Not before, since
+ * the handshake is nothing but small writes, TLS's included, and those go
+ * out inside tls_write() where we'd never get to pull the cork after them.
+ */
+static void
+ws_cork(struct websocket *ws)
+{
+#ifdef TCP_CORK
+	int on = 1;
+
+	if (ws->sockopts.cork)
+		setsockopt(ws->s, IPPROTO_TCP, TCP_CORK, (const void *) &on,
+		    sizeof(on));
+#else
+	(void) ws;
+#endif
+}
+
+/*
+ * With the socket corked, nothing short of a full packet goes out until
+ * we pull the cork, so do that (and put it back) once the queue's empty.
+ */
+static void
+ws_uncork(struct websocket *ws)
+{
+#ifdef TCP_CORK
+	int off = 0, on = 1;
+
+	setsockopt(ws->s, IPPROTO_TCP, TCP_CORK, (const void *) &off,
+	    sizeof(off));
+	setsockopt(ws->s, IPPROTO_TCP, TCP_CORK, (const void *) &on,
+	    sizeof(on));
+#else
+	(void) ws;
+#endif
+}
+
+/*
+ * Account for sz bytes of the frame queue having been written, keeping
+ * track of where the frame at the front ends.
+ */
+static void
+ws_advance(struct websocket *ws, size_t sz)
+{
+	size_t step;
+
+	while (sz > 0) {
+		if (ws->wfrm == 0)
+			ws->wfrm = ws_frame_size(ws->wbuf + ws->woff);
+		step = MIN(sz, ws->wfrm);
+		ws->woff += step;
+		ws->wfrm -= step;
+		sz -= step;
+	}
+}
+
+/*
+ * Bytes queued to go out, control frames included.
+ */
+static size_t
+ws_queued(const struct websocket *ws)
+{
+	return (ws->wlen - ws->woff) + (ws->clen - ws->coff);
+}
+
+/*
+ * Frames sent before the server's 101 is in have to wait for it, behind the
+ * upgrade request (RFC 6455 sec. 4.1). dumb_handshake() lets them go, or
+ * throws them out if the upgrade fails.
+ */
+static int
+ws_held(const struct websocket *ws)
+{
+	return !ws->server && ws->wfrm == 0
+	    && (ws->state == DWS_ST_CONNECTED || ws->state == DWS_ST_HANDSHAKE);
+}
+
+/*
+ * If a send got turned away for being over the high watermark and we've
+ * since drained down to the low one, say so. Clear the flag first, since
+ * on_writable is likely to send something.
+ */
+static void
+ws_writable(struct websocket *ws)
+{
+	if (!ws->wblocked || ws_queued(ws) > ws->low_water)
+		return;
+	ws->wblocked = 0;
+	if (ws->on_writable)
+		ws->on_writable(ws, ws->writable_arg);
+}
+
+/*
+ * Push out whatever is queued in the frame buffer, waiting on the socket in
+ * blocking mode or handing back a DWS_WANT_* code in non-blocking mode. Any
+ * unsent bytes stay queued, so it's always safe to just call this again.
+ *
+ * Control frames queued with ws_queue_control() go out ahead of everything
+ * else as soon as the frame currently being written is done, so a PING
+ * doesn't have to wait behind a big fragmented message.
+ *
+ * Returns 0 once the queue is empty, or all that's left is held for the 101.
+ */
+static int
+ws_drain(struct websocket *ws)
+{
+	const uint8_t *buf;
+	size_t len;
+	ssize_t sz;
+	int ctrl, ret, wrote = 0;
+
+	for (;;) {
+		if (ws->wretry) {
+			// TLS wants the exact same write again.
+			ctrl = ws->wretry_ctrl;
+			len = ws->wretry;
+		} else if (ws_held(ws)) {
+			break;
+		} else if (ws->clen > ws->coff && ws->wfrm == 0) {
+			ctrl = 1;
+			len = ws->clen - ws->coff;
+		} else if (ws->wlen > ws->woff) {
+			ctrl = 0;
+			len = ws->wlen - ws->woff;
+			if (ws->wfrm == 0)
+				ws->wfrm = ws_frame_size(ws->wbuf + ws->woff);
+			// Stop at the end of this frame if a control frame's waiting,
+			// or if it's the upgrade and what's behind it waits for a 101.
+			if (ws->clen > ws->coff || ws->state < DWS_ST_OPEN)
+				len = MIN(len, ws->wfrm);
+		} else
+			break;
+
+		buf = ctrl ? ws->cbuf + ws->coff : ws->wbuf + ws->woff;
+		sz = ws_write(ws, buf, len);
+		if (sz == DWS_WANT_WRITE || sz == DWS_WANT_POLL) {
+			if (ws->ctx) {
+				ws->wretry = len;
+				ws->wretry_ctrl = ctrl;
+			}
+			ret = ws_wait(ws, (int) sz);
+			if (ret) {
+				ws_writable(ws);
+				return ret;
+			}
+			continue;
+		} else if (sz < 0)
+			return (int) sz;
+
+		ws->wretry = 0;
+		wrote = 1;
+		if (ctrl) {
+			ws->coff += (size_t) sz;
+			if (ws->coff == ws->clen)
+				ws->coff = ws->clen = 0;
+		} else
+			ws_advance(ws, (size_t) sz);
+	}
+
+	if (ws->woff == ws->wlen)
+		ws->woff = ws->wlen = 0;
+	if (wrote && ws->sockopts.cork && ws->state >= DWS_ST_OPEN)
+		ws_uncork(ws);
+	ws_writable(ws);
+	return 0;
+}
+
+/*
+ * Would another len bytes keep the queue under the high watermark? An
+ * empty queue always has room, or a message bigger than the watermark
+ * could never go out.
+ */
+static int
+ws_fits(const struct websocket *ws, size_t len)
+{
+	size_t queued = ws_queued(ws);
+
+	return queued == 0
+	    || (len <= ws->high_water && queued <= ws->high_water - len);
+}
+
+/*
+ * Check there's a connection to send on at all. Anything queued once it's
+ * closing or closed would never go anywhere.
+ *
+ * Returns 0 if there is, DWS_ERR_INVALID if not.
+ */
+static int
+ws_sendable(const struct websocket *ws)
+{
+	if (ws->state != DWS_ST_CONNECTED && ws->state != DWS_ST_HANDSHAKE
+	    && ws->state != DWS_ST_OPEN)
+		return DWS_ERR_INVALID;
+	return 0;
+}
+
+/*
+ * In non-blocking mode with a high watermark set, check there's room to
+ * queue another len bytes, trying the socket first if there isn't.
+ *
+ * Returns 0 if there's room, DWS_WANT_WRITE if not (on_writable fires once
+ * we're back down to the low watermark) or a write error.
+ */
+static int
+ws_room(struct websocket *ws, size_t len)
+{
+	int ret;
+
+	if (!ws->nonblock || ws->high_water == 0 || ws_fits(ws, len))
+		return 0;
+
+	ret = ws_drain(ws);
+	if (ret && ret != DWS_WANT_WRITE && ret != DWS_WANT_POLL)
+		return ret;
+	if (ws_fits(ws, len))
+		return 0;
+
+	ws->wblocked = 1;
+	STAT_ADD(ws, turned_away, 1);
+	return DWS_WANT_WRITE;
+}
+
+/*
+ * Initialize a frame buffer, returning the current size of the frame in bytes.
+ *
+ * For reference, this is what frames look like per RFC6455 sec. 5.2:
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *    +-+-+-+-+-------+-+-------------+-------------------------------+
+ *    |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+ *    |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+ *    |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+ *    | |1|2|3|       |K|             |                               |
+ *    +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+ *    |     Extended payload length continued, if payload len == 127  |
+ *    + - - - - - - - - - - - - - - - +-------------------------------+
+ *    |                               |Masking-key, if MASK set to 1  |
+ *    +-------------------------------+-------------------------------+
+ *    | Masking-key (continued)       |          Payload Data         |
+ *    +-------------------------------- - - - - - - - - - - - - - - - +
+ *    :                     Payload Data continued ...                :
+ *    + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+ *    |                     Payload Data continued ...                |
+ *    +---------------------------------------------------------------+
+ */
+static ssize_t
+init_frame(uint8_t *frame, enum ws_opcode opcode, uint8_t flags,
+    const uint8_t *mask, size_t len)
+{
+	int idx = 0, i;
+	uint8_t masked = mask ? 0x80 : 0;
+
+	// The top bit of a 64 bit length has to be 0.
+	if ((uint64_t) len > INT64_MAX)
+		return -1;
+
+	frame[0] = (uint8_t) (flags | opcode);
+	if (len < 126) {
+		// The trivial "7 bit" payload case
+		frame[1] = masked + (uint8_t) len;
+		idx = 1;
+	} else if (len <= 0xFFFF) {
+		// The "7+16 bits" payload len case, in network byte order
+		frame[1] = masked + 126;
+		frame[2] = (uint8_t) (len >> 8);
+		frame[3] = (uint8_t) len;
+		idx = 3;
+	} else {
+		// The "7+64 bits" payload len case, same deal
+		frame[1] = masked + 127;
+		for (i = 0; i < 8; i++)
+			frame[2 + i] = (uint8_t) ((uint64_t) len >> (56 - 8 * i));
+		idx = 9;
+	}
+
+	// Servers don't mask, so there's no key to send.
+	if (mask == NULL)
+		return idx + 1;
+
+	// Gotta send a copy of the mask
+	frame[++idx] = mask[0];
+	frame[++idx] = mask[1];
+	frame[++idx] = mask[2];
+	frame[++idx] = mask[3];
+
+	// XXX: remember, we return the true size...not the offset
+	return idx + 1;
+}
+
+#ifdef DEBUG
+static void
+dump_frame(uint8_t *frame, size_t len)
+{
+	size_t i;
+	int first = 1;
+
+	for (i = 0; i < len; i++) {
+		printf("0x%02x ", frame[i]);
+		if (!first && (i+1) % 4 == 0)
+			printf("\n");
+		first = 0;
+	}
+	printf("\n");
+}
+#endif
+
+/*
+ * Masking kernels.
+ *
+ * RFC6455 masking is just XOR with a repeating 4-byte key, so we can do it a
+ * vector at a time as long as the key is pre-rotated to the right phase. Each
+ * kernel takes a 32-byte key pattern already in phase with `dst` and returns
+ * how many bytes it handled (always a multiple of 4, so the phase survives).
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DWS_MASK_X86
+
+#include <immintrin.h>
+
+static size_t
+mask_sse2(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *key)
+{
+	size_t i = 0;
+	__m128i k, v;
+
+	k = _mm_loadu_si128((const __m128i *) key);
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(v, k));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+mask_avx2(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *key)
+{
+	size_t i = 0;
+	__m256i k, v;
+
+	k = _mm256_loadu_si256((const __m256i *) key);
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(v, k));
+	}
+	return i;
+}
+
+static size_t
+mask_simd(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *key)
+{
+	static int have_avx2 = -1;
+
+	if (have_avx2 < 0)
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if (have_avx2)
+		return mask_avx2(dst, src, len, key);
+	return mask_sse2(dst, src, len, key);
+}
+#elif defined(__ARM_NEON)
+#define DWS_MASK_NEON
+
+#include <arm_neon.h>
+
+static size_t
+mask_simd(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *key)
+{
+	size_t i = 0;
+	uint8x16_t k;
+
+	k = vld1q_u8(key);
+	for (; i + 16 <= len; i += 16)
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k));
+	return i;
+}
+#endif
+
+/*
+ * dumb_apply_mask
+ *
+ * XOR `len` bytes of `src` into `dst` with the given frame mask. Works in
+ * place (dst == src) and for masking and unmasking alike, since XOR.
+ *
+ * Parameters:
+ *  (out) dst: where the (un)masked bytes go
+ *  src: the bytes to (un)mask
+ *  len: how many bytes
+ *  mask: the 4-byte masking key from the frame header
+ *  offset: position of src[0] within the frame payload, so a payload can be
+ *          masked in chunks
+ */
+void
+dumb_apply_mask(void *dst, const void *src, size_t len, const uint8_t mask[4],
+    size_t offset)
+{
+	uint8_t *d = (uint8_t *) dst;
+	const uint8_t *s = (const uint8_t *) src;
+	uint8_t key[32 + 4];
+	uint64_t k, w;
+	size_t i = 0, j;
+
+	for (j = 0; j < 4; j++)
+		key[j] = mask[(offset + j) & 3];
+
+	// Tiny payloads aren't worth the setup.
+	if (len < 32) {
+		for (; i < len; i++)
+			d[i] = s[i] ^ key[i & 3];
+		return;
+	}
+
+	for (j = 4; j < sizeof(key); j += 4)
+		memcpy(key + j, key, 4);
+
+	// Line up with the destination a byte at a time so the wide stores
+	// below don't straddle cache lines.
+	while (i < len && ((uintptr_t) (d + i) & 15) != 0) {
+		d[i] = s[i] ^ key[i & 3];
+		i++;
+	}
+
+#if defined(DWS_MASK_X86) || defined(DWS_MASK_NEON)
+	i += mask_simd(d + i, s + i, len - i, key + (i & 3));
+#endif
+
+	// Whatever's left, a word at a time, then the ragged tail.
+	memcpy(&k, key + (i & 3), sizeof(k));
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, sizeof(w));
+		w ^= k;
+		memcpy(d + i, &w, sizeof(w));
+	}
+	for (; i < len; i++)
+		d[i] = s[i] ^ key[i & 3];
+}
+
+/*
+ * UTF-8 validation, for TEXT frames (RFC 6455 sec. 8.1 says fail anything
+ * that isn't, RFC 3629 says what is).
+ *
+ * The scalar version is a byte at a time state machine that can stop and
+ * pick up again anywhere, which fragments and dumb_recv_chunk() need. The
+ * state is 0 between characters, otherwise how many continuation bytes are
+ * still to come and the range the next one has to be in (only the first
+ * one after E0, ED, F0 and F4 is any narrower than 80..BF).
+ */
+#define UTF8_STATE(need, lo, hi)	((uint32_t) (need) << 16 | (lo) << 8 | (hi))
+
+static int
+utf8_scalar(uint32_t *state, const uint8_t *s, size_t len)
+{
+	uint32_t st = *state;
+	uint64_t w;
+	size_t i = 0;
+	uint8_t c;
+
+	while (i < len) {
+		c = s[i];
+		if (st != 0) {
+			if (c < ((st >> 8) & 0xFF) || c > (st & 0xFF))
+				return DWS_ERR_INVALID;
+			st = (st >> 16) == 1 ? 0
+			    : UTF8_STATE((st >> 16) - 1, 0x80, 0xBF);
+		} else if (c < 0x80) {
+			// A word at a time through runs of ASCII.
+			for (i++; i + 8 <= len; i += 8) {
+				memcpy(&w, s + i, sizeof(w));
+				if (w & 0x8080808080808080ULL)
+					break;
+			}
+			continue;
+		} else if (c < 0xC2 || c > 0xF4)
+			return DWS_ERR_INVALID;
+		else if (c < 0xE0)
+			st = UTF8_STATE(1, 0x80, 0xBF);
+		else if (c == 0xE0)
+			st = UTF8_STATE(2, 0xA0, 0xBF);	// no overlongs
+		else if (c == 0xED)
+			st = UTF8_STATE(2, 0x80, 0x9F);	// no surrogates
+		else if (c < 0xF0)
+			st = UTF8_STATE(2, 0x80, 0xBF);
+		else if (c == 0xF0)
+			st = UTF8_STATE(3, 0x90, 0xBF);	// no overlongs
+		else if (c < 0xF4)
+			st = UTF8_STATE(3, 0x80, 0xBF);
+		else
+			st = UTF8_STATE(3, 0x80, 0x8F);	// nothing past U+10FFFF
+		i++;
+	}
+
+	*state = st;
+	return 0;
+}
+
+/*
+ * The vector versions check a block at a time for every way a byte can be
+ * wrong given the one before it, using three 16 entry tables indexed by the
+ * high and low nibbles of the previous byte and the high nibble of this one
+ * (Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per
+ * Byte"). Each table entry is a set of the errors below that it allows;
+ * a byte is bad if all three agree on one. Whether a continuation is the
+ * 2nd or 3rd of a longer character is checked separately, 2 and 3 bytes
+ * back. They want whole characters, so dumb_utf8_check() takes care of
+ * ends that aren't.
+ */
+#define UTF8_TOO_SHORT		0x01	// lead not followed by continuation
+#define UTF8_TOO_LONG		0x02	// continuation after ASCII
+#define UTF8_OVERLONG_3		0x04	// E0 80..9F
+#define UTF8_TOO_LARGE		0x08	// F4 90..BF, F5.. anything
+#define UTF8_SURROGATE		0x10	// ED A0..BF
+#define UTF8_OVERLONG_2		0x20	// C0, C1
+#define UTF8_TOO_LARGE_1000	0x40	// F5.. 80..8F
+#define UTF8_OVERLONG_4		0x40	// F0 80..8F
+#define UTF8_TWO_CONTS		0x80	// continuation after continuation
+#define UTF8_CARRY	(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH						\
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,	\
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,	\
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,	\
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,				\
+	UTF8_TOO_SHORT,							\
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,		\
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000		\
+	    | UTF8_OVERLONG_4
+
+#define UTF8_BYTE_1_LOW							\
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,	\
+	UTF8_CARRY | UTF8_OVERLONG_2,					\
+	UTF8_CARRY,							\
+	UTF8_CARRY,							\
+	UTF8_CARRY | UTF8_TOO_LARGE,					\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,	\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,		\
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH						\
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,	\
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,	\
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3	\
+	    | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,			\
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3	\
+	    | UTF8_TOO_LARGE,						\
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE	\
+	    | UTF8_TOO_LARGE,						\
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE	\
+	    | UTF8_TOO_LARGE,						\
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+/*
+ * The last 3 bytes of a block can't be the start of something longer than
+ * what's left: anything above these is.
+ */
+#define UTF8_MAX_TAIL	0xEF, 0xDF, 0xBF
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DWS_UTF8_X86
+
+__attribute__((target("sse4.1")))
+static int
+utf8_sse4(const uint8_t *s, size_t len)
+{
+	const __m128i t1h = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+	const __m128i t1l = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+	const __m128i t2h = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+	const __m128i tail = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+	    -1, -1, -1, -1, -1, UTF8_MAX_TAIL);
+	const __m128i nib = _mm_set1_epi8(0x0F);
+	__m128i in, prev, prev1, sc, must, err, incomplete;
+	uint8_t buf[16];
+	size_t i;
+
+	prev = err = incomplete = _mm_setzero_si128();
+	for (i = 0; i < len; i += 16) {
+		if (len - i >= 16)
+			in = _mm_loadu_si128((const __m128i *) (s + i));
+		else {
+			// Pad the end with ASCII, which can't hurt.
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, s + i, len - i);
+			in = _mm_loadu_si128((const __m128i *) buf);
+		}
+
+		if (_mm_movemask_epi8(in) == 0) {
+			err = _mm_or_si128(err, incomplete);
+			incomplete = _mm_setzero_si128();
+			prev = in;
+			continue;
+		}
+
+		prev1 = _mm_alignr_epi8(in, prev, 15);
+		sc = _mm_and_si128(_mm_and_si128(
+		    _mm_shuffle_epi8(t1h,
+		    _mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+		    _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nib))),
+		    _mm_shuffle_epi8(t2h,
+		    _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+		must = _mm_or_si128(
+		    _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14),
+		    _mm_set1_epi8((char) (0xE0 - 0x80))),
+		    _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13),
+		    _mm_set1_epi8((char) (0xF0 - 0x80))));
+		must = _mm_and_si128(must, _mm_set1_epi8((char) 0x80));
+		err = _mm_or_si128(err, _mm_xor_si128(must, sc));
+
+		incomplete = _mm_subs_epu8(in, tail);
+		prev = in;
+	}
+	err = _mm_or_si128(err, incomplete);
+
+	return _mm_testz_si128(err, err) ? 0 : DWS_ERR_INVALID;
+}
+
+__attribute__((target("avx2")))
+static int
+utf8_avx2(const uint8_t *s, size_t len)
+{
+	const __m256i t1h = _mm256_setr_epi8(UTF8_BYTE_1_HIGH,
+	    UTF8_BYTE_1_HIGH);
+	const __m256i t1l = _mm256_setr_epi8(UTF8_BYTE_1_LOW, UTF8_BYTE_1_LOW);
+	const __m256i t2h = _mm256_setr_epi8(UTF8_BYTE_2_HIGH,
+	    UTF8_BYTE_2_HIGH);
+	const __m256i tail = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+	    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	    -1, -1, -1, -1, -1, UTF8_MAX_TAIL);
+	const __m256i nib = _mm256_set1_epi8(0x0F);
+	__m256i in, prev, prev1, span, sc, must, err, incomplete;
+	uint8_t buf[32];
+	size_t i;
+
+	prev = err = incomplete = _mm256_setzero_si256();
+	for (i = 0; i < len; i += 32) {
+		if (len - i >= 32)
+			in = _mm256_loadu_si256((const __m256i *) (s + i));
+		else {
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, s + i, len - i);
+			in = _mm256_loadu_si256((const __m256i *) buf);
+		}
+
+		if (_mm256_movemask_epi8(in) == 0) {
+			err = _mm256_or_si256(err, incomplete);
+			incomplete = _mm256_setzero_si256();
+			prev = in;
+			continue;
+		}
+
+		// alignr only works within 128 bit lanes, so line them up.
+		span = _mm256_permute2x128_si256(prev, in, 0x21);
+		prev1 = _mm256_alignr_epi8(in, span, 15);
+		sc = _mm256_and_si256(_mm256_and_si256(
+		    _mm256_shuffle_epi8(t1h,
+		    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+		    _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, nib))),
+		    _mm256_shuffle_epi8(t2h,
+		    _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+		must = _mm256_or_si256(
+		    _mm256_subs_epu8(_mm256_alignr_epi8(in, span, 14),
+		    _mm256_set1_epi8((char) (0xE0 - 0x80))),
+		    _mm256_subs_epu8(_mm256_alignr_epi8(in, span, 13),
+		    _mm256_set1_epi8((char) (0xF0 - 0x80))));
+		must = _mm256_and_si256(must, _mm256_set1_epi8((char) 0x80));
+		err = _mm256_or_si256(err, _mm256_xor_si256(must, sc));
+
+		incomplete = _mm256_subs_epu8(in, tail);
+		prev = in;
+	}
+	err = _mm256_or_si256(err, incomplete);
+
+	return _mm256_testz_si256(err, err) ? 0 : DWS_ERR_INVALID;
+}
+
+/*
+ * Returns 0 if all of s is valid UTF-8 made of whole characters.
+ */
+static int
+utf8_simd(const uint8_t *s, size_t len)
+{
+	static int level = -1;
+	uint32_t st = 0;
+
+	if (level < 0)
+		level = __builtin_cpu_supports("avx2") ? 2
+		    : __builtin_cpu_supports("sse4.1") ? 1 : 0;
+	if (level == 2)
+		return utf8_avx2(s, len);
+	if (level == 1)
+		return utf8_sse4(s, len);
+	if (utf8_scalar(&st, s, len) || st != 0)
+		return DWS_ERR_INVALID;
+	return 0;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define DWS_UTF8_NEON
+
+static int
+utf8_simd(const uint8_t *s, size_t len)
+{
+	static const uint8_t t1h_[16] = { UTF8_BYTE_1_HIGH };
+	static const uint8_t t1l_[16] = { UTF8_BYTE_1_LOW };
+	static const uint8_t t2h_[16] = { UTF8_BYTE_2_HIGH };
+	static const uint8_t tail_[16] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, UTF8_MAX_TAIL };
+	uint8x16_t t1h, t1l, t2h, tail, in, prev, prev1, sc, must, err;
+	uint8x16_t incomplete;
+	uint8_t buf[16];
+	size_t i;
+
+	t1h = vld1q_u8(t1h_);
+	t1l = vld1q_u8(t1l_);
+	t2h = vld1q_u8(t2h_);
+	tail = vld1q_u8(tail_);
+	prev = err = incomplete = vdupq_n_u8(0);
+	for (i = 0; i < len; i += 16) {
+		if (len - i >= 16)
+			in = vld1q_u8(s + i);
+		else {
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, s + i, len - i);
+			in = vld1q_u8(buf);
+		}
+
+		if (vmaxvq_u8(in) < 0x80) {
+			err = vorrq_u8(err, incomplete);
+			incomplete = vdupq_n_u8(0);
+			prev = in;
+			continue;
+		}
+
+		prev1 = vextq_u8(prev, in, 15);
+		sc = vandq_u8(vandq_u8(
+		    vqtbl1q_u8(t1h, vshrq_n_u8(prev1, 4)),
+		    vqtbl1q_u8(t1l, vandq_u8(prev1, vdupq_n_u8(0x0F)))),
+		    vqtbl1q_u8(t2h, vshrq_n_u8(in, 4)));
+		must = vorrq_u8(
+		    vqsubq_u8(vextq_u8(prev, in, 14), vdupq_n_u8(0xE0 - 0x80)),
+		    vqsubq_u8(vextq_u8(prev, in, 13), vdupq_n_u8(0xF0 - 0x80)));
+		must = vandq_u8(must, vdupq_n_u8(0x80));
+		err = vorrq_u8(err, veorq_u8(must, sc));
+
+		incomplete = vqsubq_u8(in, tail);
+		prev = in;
+	}
+	err = vorrq_u8(err, incomplete);
+
+	return vmaxvq_u8(err) == 0 ? 0 : DWS_ERR_INVALID;
+}
+#endif
+
+/*
+ * dumb_utf8_check
+ *
+ * Check that buf is valid UTF-8, the same way TEXT frames are checked. A
+ * message can be checked in as many pieces as you like, split wherever:
+ * start *state at 0 and pass it along from one piece to the next. It's
+ * only whole characters once *state is back to 0 at the end.
+ *
+ * Parameters:
+ *  (in/out) state: 0 to start, where the last piece left off after that
+ *  buf: the next piece
+ *  len: how long it is
+ *
+ * Returns:
+ *  0 if it's good so far, DWS_ERR_INVALID as soon as it isn't.
+ */
+int
+dumb_utf8_check(uint32_t *state, const void *buf, size_t len)
+{
+	const uint8_t *s = (const uint8_t *) buf;
+	size_t i = 0;
+#if defined(DWS_UTF8_X86) || defined(DWS_UTF8_NEON)
+	size_t end = len, back;
+#endif
+	int ret;
+
+	// Finish off whatever character the last piece left hanging.
+	while (*state != 0 && i < len) {
+		ret = utf8_scalar(state, s + i, 1);
+		if (ret)
+			return ret;
+		i++;
+	}
+
+#if defined(DWS_UTF8_X86) || defined(DWS_UTF8_NEON)
+	/*
+	 * The vector check wants whole characters, so back up to where the
+	 * last one starts (a lead byte, at most 3 back) and leave it for the
+	 * scalar one, which doesn't mind if it's not all there.
+	 */
+	for (back = 0; back < 3 && end > i && (s[end - 1] & 0xC0) == 0x80;
+	    back++)
+		end--;
+	if (end > i && s[end - 1] >= 0xC0)
+		end--;
+
+	if (end - i >= 16) {
+		ret = utf8_simd(s + i, end - i);
+		if (ret)
+			return ret;
+		i = end;
+	}
+#endif
+
+	return utf8_scalar(state, s + i, len - i);
+}
+
+/*
+ * Pick the mask for the next frame we send: a fresh one if we're the
+ * client, and none at all if we're the server, per RFC 6455 sec. 5.1.
+ */
+static const uint8_t *
+ws_next_mask(struct websocket *ws, uint8_t mask[4])
+{
+	if (ws->server)
+		return NULL;
+	dumb_mask(ws, mask);
+	return mask;
+}
+
+/*
+ * Copy a payload into a frame, masking it on the way if there's a mask.
+ * Like dumb_apply_mask(), dst == src is fine.
+ */
+static void
+ws_mask_copy(void *dst, const void *src, size_t len, const uint8_t *mask,
+    size_t offset)
+{
+	if (mask)
+		dumb_apply_mask(dst, src, len, mask, offset);
+	else if (dst != src && len > 0)
+		memcpy(dst, src, len);
+}
+
+/*
+ * dumb_frame
+ *
+ * Construct a frame of the given type containing a given payload
+ *
+ * Parameters:
+ *  ws: the websocket whose keystream masks it
+ *  (out) frame: pointer to a buffer to write the frame data to
+ *  opcode: the type of frame, usually BINARY
+ *  data: pointer to the binary data payload to frame
+ *  len: length of the binary payload to frame
+ *
+ * Assumptions:
+ *  - you've properly sized the destination buffer (*out)
+ *
+ * Returns:
+ *  size of the frame in bytes,
+ * DWS_ERR_TOO_LARGE when len is too large
+ *
+ */
+static ssize_t
+dumb_frame(struct websocket *ws, uint8_t *frame, enum ws_opcode opcode,
+    const uint8_t *data, size_t len)
+{
+	ssize_t header_len;
+	uint8_t key[4] = { 0, 0, 0, 0 };
+	const uint8_t *mask;
+
+	// Pretend we're in Eyes Wide Shut
+	mask = ws_next_mask(ws, key);
+
+	header_len = init_frame(frame, opcode, FRAME_FIN, mask, len);
+	if (header_len < 0)
+		return DWS_ERR_TOO_LARGE;
+
+	// Mask while we copy so we only make one pass over the payload.
+	// We just transmit in host byte order, someone else's problem
+	ws_mask_copy(frame + header_len, data, len, mask, 0);
+
+	return header_len + (ssize_t) len;
+}
+
+/*
+ * Make sure the websocket's frame buffer has room to queue `len` more bytes
+ * behind whatever is still waiting to go out. It only ever grows, so once
+ * warmed up dumb_send() never touches the allocator.
+ */
+static int
+ws_reserve(struct websocket *ws, size_t len)
+{
+	uint8_t *buf;
+	size_t cap, queued;
+
+	if (ws->wcap - ws->wlen >= len)
+		return 0;
+
+	// Slide the unsent bytes to the front first; that may be enough.
+	queued = ws->wlen - ws->woff;
+	if (ws->woff > 0) {
+		memmove(ws->wbuf, ws->wbuf + ws->woff, queued);
+		ws->woff = 0;
+		ws->wlen = queued;
+		if (ws->wcap - ws->wlen >= len)
+			return 0;
+	}
+
+	if (len > SIZE_MAX - queued)
+		return DWS_ERR_TOO_LARGE;
+
+	cap = ws->wcap ? ws->wcap : 256;
+	while (cap < queued + len) {
+		if (cap > SIZE_MAX / 2)
+			return DWS_ERR_TOO_LARGE;
+		cap *= 2;
+	}
+
+	buf = realloc(ws->wbuf, cap);
+	if (buf == NULL)
+		return DWS_ERR_MALLOC;
+
+	ws->wbuf = buf;
+	ws->wcap = cap;
+	return 0;
+}
+
+#ifdef DWS_WITH_ZLIB
+/*
+ * permessage-deflate (RFC 7692) state, once the server agrees to it. Both
+ * streams live as long as the connection (context takeover) unless the
+ * server tells us to start our side afresh with every message.
+ */
+struct ws_deflate {
+	z_stream	 tx;
+	z_stream	 rx;
+	int		 tx_on;		// we may compress
+	int		 tx_reset;	// client_no_context_takeover
+	int		 rx_msg;	// the message coming in is compressed
+	size_t		 rx_tail;	// how much of the 00 00 ff ff tail it got
+	uint8_t		*buf;		// compressed output, only ever grows
+	size_t		 cap;
+	uint8_t		*out;		// inflated dumb_recv_view() messages
+	size_t		 ocap;
+};
+
+static const uint8_t deflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+static char *
+ws_trim(char *s)
+{
+	char *e;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+		*--e = '\0';
+	return s;
+}
+
+/*
+ * Take the server up on permessage-deflate, given the value of its
+ * Sec-WebSocket-Extensions header. Anything we didn't ask for or don't
+ * understand fails the handshake, like RFC 7692 says it should.
+ */
+static int
+ws_deflate_start(struct websocket *ws, const char *ext, size_t len)
+{
+	struct ws_deflate *z;
+	char buf[256], *p, *param, *val;
+	int bits, tx_bits, tx_reset = 0, first = 1;
+
+	tx_bits = ws->deflate_bits ? ws->deflate_bits : 15;
+
+	// We only offered the one, so a list of them is already wrong.
+	if (len >= sizeof(buf) || memchr(ext, ',', len) != NULL)
+		return DWS_ERR_HANDSHAKE_RES;
+	memcpy(buf, ext, len);
+	buf[len] = '\0';
+
+	for (p = buf; p != NULL; first = 0) {
+		param = p;
+		p = strchr(p, ';');
+		if (p != NULL)
+			*p++ = '\0';
+
+		val = strchr(param, '=');
+		if (val != NULL) {
+			*val++ = '\0';
+			val = ws_trim(val);
+			if (*val == '"' && strlen(val) > 1
+			    && val[strlen(val) - 1] == '"') {
+				val[strlen(val) - 1] = '\0';
+				val++;
+			}
+		}
+		param = ws_trim(param);
+		bits = val ? atoi(val) : 0;
+
+		if (first) {
+			if (strcmp(param, "permessage-deflate") || val)
+				return DWS_ERR_HANDSHAKE_RES;
+		} else if (strcmp(param, "client_no_context_takeover") == 0
+		    && !val)
+			tx_reset = 1;
+		else if (strcmp(param, "server_no_context_takeover") == 0
+		    && !val)
+			continue;
+		else if (strcmp(param, "server_max_window_bits") == 0
+		    && bits >= 8 && bits <= 15)
+			continue;	// we always inflate with a full window
+		else if (strcmp(param, "client_max_window_bits") == 0
+		    && bits >= 8 && bits <= 15)
+			tx_bits = MIN(tx_bits, bits);
+		else
+			return DWS_ERR_HANDSHAKE_RES;
+	}
+
+	z = calloc(1, sizeof(*z));
+	if (z == NULL)
+		return DWS_ERR_MALLOC;
+
+	// zlib can't do a 256 byte window, so then we just never compress.
+	z->tx_reset = tx_reset;
+	z->tx_on = tx_bits >= 9;
+	if (z->tx_on && deflateInit2(&z->tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	    -tx_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(z);
+		return DWS_ERR_MALLOC;
+	}
+	if (inflateInit2(&z->rx, -15) != Z_OK) {
+		if (z->tx_on)
+			deflateEnd(&z->tx);
+		free(z);
+		return DWS_ERR_MALLOC;
+	}
+
+	ws->z = z;
+	return 0;
+}
+
+static void
+ws_deflate_free(struct websocket *ws)
+{
+	if (ws->z == NULL)
+		return;
+	if (ws->z->tx_on)
+		deflateEnd(&ws->z->tx);
+	inflateEnd(&ws->z->rx);
+	free(ws->z->buf);
+	free(ws->z->out);
+	free(ws->z);
+	ws->z = NULL;
+}
+
+static int
+ws_compressing(struct websocket *ws, enum ws_opcode opcode, size_t len)
+{
+	return ws->z != NULL && ws->z->tx_on && !(opcode & 0x08) && len > 0
+	    && len >= ws->deflate_min && len <= UINT_MAX;
+}
+
+/*
+ * Compress a message gathered from an iovec into ws->z->buf, minus the
+ * 00 00 ff ff tail every sync flush ends with, which RFC 7692 has us drop.
+ */
+static int
+ws_compress(struct websocket *ws, const struct iovec *iov, int iovcnt,
+    size_t len, struct iovec *out)
+{
+	struct ws_deflate *z = ws->z;
+	uint8_t *buf;
+	size_t cap, used;
+	int i, ret;
+
+	cap = (size_t) deflateBound(&z->tx, (uLong) len) + 16;
+	if (z->cap < cap) {
+		buf = realloc(z->buf, cap);
+		if (buf == NULL)
+			return DWS_ERR_MALLOC;
+		z->buf = buf;
+		z->cap = cap;
+	}
+
+	z->tx.next_out = z->buf;
+	z->tx.avail_out = (uInt) MIN(z->cap, UINT_MAX);
+	for (i = 0; i < iovcnt; i++) {
+		z->tx.next_in = iov[i].iov_base;
+		z->tx.avail_in = (uInt) iov[i].iov_len;
+		do {
+			if (z->tx.avail_out == 0) {
+				// Shouldn't happen given deflateBound(), but...
+				used = (size_t) (z->tx.next_out - z->buf);
+				buf = realloc(z->buf, z->cap * 2);
+				if (buf == NULL)
+					return DWS_ERR_MALLOC;
+				z->buf = buf;
+				z->cap *= 2;
+				z->tx.next_out = z->buf + used;
+				z->tx.avail_out = (uInt) MIN(z->cap - used,
+				    UINT_MAX);
+			}
+			ret = deflate(&z->tx,
+			    i == iovcnt - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				return DWS_ERR_INVALID;
+		} while (z->tx.avail_in > 0 || z->tx.avail_out == 0);
+	}
+
+	used = (size_t) (z->tx.next_out - z->buf);
+	if (used < 4 || memcmp(z->buf + used - 4, deflate_tail, 4))
+		return DWS_ERR_INVALID;
+
+	if (z->tx_reset)
+		deflateReset(&z->tx);
+
+	out->iov_base = z->buf;
+	out->iov_len = used - 4;
+	return 0;
+}
+
+/*
+ * Inflate from in to out. With discard set, whatever doesn't fit in out is
+ * thrown away (the stream still has to see it to stay in sync), otherwise
+ * we stop once out is full. *inlen and *outlen go in as the sizes of the
+ * buffers and come back as how much of each got used.
+ */
+static int
+ws_inflate(struct websocket *ws, const uint8_t *in, size_t *inlen,
+    uint8_t *out, size_t *outlen, int discard)
+{
+	z_stream *zs = &ws->z->rx;
+	uint8_t scrap[1024];
+	size_t cap = *outlen, got = 0;
+	uInt before;
+	int ret;
+
+	if (*inlen > UINT_MAX)
+		return DWS_ERR_TOO_LARGE;
+
+	zs->next_in = (Bytef *) in;
+	zs->avail_in = (uInt) *inlen;
+	for (;;) {
+		if (got < cap) {
+			zs->next_out = out + got;
+			zs->avail_out = (uInt) MIN(cap - got, UINT_MAX);
+		} else if (discard) {
+			zs->next_out = scrap;
+			zs->avail_out = sizeof(scrap);
+		} else
+			break;
+
+		before = zs->avail_out;
+		ret = inflate(zs, Z_SYNC_FLUSH);
+		if (got < cap)
+			got += before - zs->avail_out;
+
+		// A final block just means the next message starts afresh.
+		if (ret == Z_STREAM_END)
+			inflateReset(zs);
+		else if (ret == Z_BUF_ERROR)
+			break;
+		else if (ret != Z_OK)
+			return DWS_ERR_INVALID;
+
+		if (zs->avail_in == 0 && zs->avail_out > 0)
+			break;
+	}
+
+	*inlen -= zs->avail_in;
+	*outlen = got;
+	return 0;
+}
+
+/*
+ * Inflate a whole compressed message into z->out, growing it as needed.
+ * Past limit we stop growing and just count, so *total is always the real
+ * size.
+ */
+static int
+ws_inflate_all(struct websocket *ws, const uint8_t *in, size_t len,
+    size_t limit, size_t *total)
+{
+	struct ws_deflate *z = ws->z;
+	uint8_t *buf;
+	size_t n, got, off = 0, cap;
+	int ret, tail = 0;
+
+	*total = 0;
+	for (;;) {
+		if (off == z->ocap) {
+			if (*total > limit)
+				off = 0;
+			else {
+				cap = z->ocap ? z->ocap * 2 : RECV_BUF_SIZE;
+				buf = realloc(z->out, cap);
+				if (buf == NULL)
+					return DWS_ERR_MALLOC;
+				z->out = buf;
+				z->ocap = cap;
+			}
+		}
+
+		n = len;
+		got = z->ocap - off;
+		ret = ws_inflate(ws, in, &n, z->out + off, &got, 0);
+		if (ret)
+			return ret;
+		in += n;
+		len -= n;
+		off += got;
+		*total += got;
+
+		// Out of input with room to spare means it's all out.
+		if (len == 0 && off < z->ocap) {
+			if (tail)
+				break;
+			in = deflate_tail;
+			len = sizeof(deflate_tail);
+			tail = 1;
+		}
+	}
+
+	if (*total > limit)
+		return DWS_ERR_TOO_LARGE;
+	return 0;
+}
+
+/*
+ * A message that went through deflate isn't getting sent after all. The
+ * other end will never see it, so start our side over rather than refer
+ * back to it later, which it couldn't make sense of.
+ */
+static int
+ws_deflate_abort(struct websocket *ws, int err)
+{
+	if (ws->z != NULL)
+		deflateReset(&ws->z->tx);
+	return err;
+}
+
+#define RX_INFLATING(ws)	((ws)->z != NULL && (ws)->z->rx_msg)
+#else
+#define RX_INFLATING(ws)	0
+#define ws_deflate_abort(ws, err)	(err)
+#endif /* DWS_WITH_ZLIB */
+
+/*
+ * How big the fragments of a len byte message get.
+ */
+static size_t
+ws_frag_size(const struct websocket *ws, enum ws_opcode opcode, size_t len)
+{
+	// Control frames never get fragmented.
+	if (ws->frag_size > 0 && ws->frag_size < len && !(opcode & 0x08))
+		return ws->frag_size;
+	return len;
+}
+
+/*
+ * Make room in wbuf for a len byte message, headers and all, however many
+ * fragments it takes.
+ */
+static int
+ws_reserve_message(struct websocket *ws, enum ws_opcode opcode, size_t len)
+{
+	size_t frag, nfrags;
+
+	frag = ws_frag_size(ws, opcode, len);
+	nfrags = frag ? (len + frag - 1) / frag : 1;
+	if (nfrags > (SIZE_MAX - len) / FRAME_MAX_HEADER_SIZE)
+		return DWS_ERR_TOO_LARGE;
+
+	return ws_reserve(ws, len + nfrags * FRAME_MAX_HEADER_SIZE);
+}
+
+/*
+ * Frame a message gathered from an iovec onto the back of the outbound
+ * queue, compressed if permessage-deflate is on and split into fragments of
+ * at most ws->frag_size bytes if that's set. Pieces are masked as they're
+ * copied in, so it's still one pass over the data. Nothing is written until
+ * the next ws_drain().
+ *
+ * Returns the size of the frame(s) in bytes or a DWS_ERR_* code.
+ */
+static ssize_t
+ws_queue_message(struct websocket *ws, enum ws_opcode opcode,
+    const struct iovec *iov, int iovcnt)
+{
+	ssize_t header_len;
+	uint8_t key[4] = { 0, 0, 0, 0 };
+	const uint8_t *mask;
+	uint8_t *frame;
+	size_t len = 0, frag, off, n, done, step, base, total, wlen;
+	uint8_t rsv = 0;
+	int i, ret;
+#ifdef DWS_WITH_ZLIB
+	struct iovec z;
+#endif
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > SIZE_MAX - FRAME_MAX_HEADER_SIZE - len)
+			return DWS_ERR_TOO_LARGE;
+		len += iov[i].iov_len;
+	}
+
+#ifdef DWS_WITH_ZLIB
+	if (ws_compressing(ws, opcode, len)) {
+		// Make room first: once deflate has seen it, it has to go out
+		// or our window and theirs don't match anymore.
+		ret = ws_reserve_message(ws, opcode,
+		    (size_t) deflateBound(&ws->z->tx, (uLong) len) + 16);
+		if (ret)
+			return ret;
+		ret = ws_compress(ws, iov, iovcnt, len, &z);
+		if (ret)
+			return ws_deflate_abort(ws, ret);
+		iov = &z;
+		iovcnt = 1;
+		len = z.iov_len;
+		rsv = FRAME_RSV1;
+	}
+#endif
+
+	// Already done for a compressed one, unless deflateBound() was off.
+	ret = ws_reserve_message(ws, opcode, len);
+	if (ret)
+		return rsv ? ws_deflate_abort(ws, ret) : ret;
+
+	frag = ws_frag_size(ws, opcode, len);
+	wlen = ws->wlen;
+
+	i = 0;
+	base = total = 0;
+	off = 0;
+	do {
+		n = MIN(frag, len - off);
+
+		mask = ws_next_mask(ws, key);
+		frame = ws->wbuf + ws->wlen;
+		header_len = init_frame(frame, off ? CONTINUATION : opcode,
+		    (off ? 0 : rsv) | (off + n == len ? FRAME_FIN : 0), mask, n);
+		if (header_len < 0) {
+			ws->wlen = wlen;
+			return rsv ? ws_deflate_abort(ws, DWS_ERR_TOO_LARGE)
+			    : DWS_ERR_TOO_LARGE;
+		}
+
+		// Copy in this fragment's share of the iovec.
+		for (done = 0; done < n; done += step) {
+			while (base == iov[i].iov_len) {
+				i++;
+				base = 0;
+			}
+			step = MIN(n - done, iov[i].iov_len - base);
+			ws_mask_copy(frame + header_len + done,
+			    (const uint8_t *) iov[i].iov_base + base, step, mask,
+			    done);
+			base += step;
+		}
+
+		STAT_FRAME(ws, out, off ? CONTINUATION : opcode, n);
+		ws->wlen += (size_t) header_len + n;
+		total += (size_t) header_len + n;
+		off += n;
+	} while (off < len);
+
+	return (ssize_t) total;
+}
+
+static ssize_t
+ws_queue_frame(struct websocket *ws, enum ws_opcode opcode, const void *data,
+    size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) data;
+	iov.iov_len = len;
+	return ws_queue_message(ws, opcode, &iov, 1);
+}
+
+/*
+ * Queue a control frame so it cuts in line ahead of any data still waiting
+ * to go out (see ws_drain()). If there's no room for it up front, it just
+ * waits its turn like everything else.
+ */
+static ssize_t
+ws_queue_control(struct websocket *ws, enum ws_opcode opcode,
+    const void *data, size_t len)
+{
+	if (len > 125)
+		return DWS_ERR_TOO_LARGE;
+
+	if (ws->coff > 0 && ws->clen == ws->coff)
+		ws->coff = ws->clen = 0;
+	if (sizeof(ws->cbuf) - ws->clen < len + FRAME_MAX_HEADER_SIZE)
+		return ws_queue_frame(ws, opcode, data, len);
+
+	STAT_FRAME(ws, out, opcode, len);
+	len = (size_t) dumb_frame(ws, ws->cbuf + ws->clen, opcode,
+	    data, len);
+	ws->clen += len;
+	return (ssize_t) len;
+}
+
+/*
+ * Find a header in a NUL terminated HTTP response, skipping the status
+ * line. Returns NULL if it isn't there, otherwise its value with *len set
+ * to its length, minus the whitespace around it. Passing a value it
+ * returned as headers finds the next one by that name.
+ */
+static const char *
+ws_header(const char *headers, const char *name, size_t *len)
+{
+	const char *line, *eol, *v, *e;
+	size_t n = strlen(name);
+
+	for (line = strstr(headers, "\r\n"); line != NULL; line = eol) {
+		line += 2;
+		eol = strstr(line, "\r\n");
+		if (eol == NULL || eol == line)
+			break;
+		if ((size_t) (eol - line) <= n || line[n] != ':'
+		    || strncasecmp(line, name, n) != 0)
+			continue;
+
+		v = line + n + 1;
+		while (v < eol && (*v == ' ' || *v == '\t'))
+			v++;
+		e = eol;
+		while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+			e--;
+		*len = (size_t) (e - v);
+		return v;
+	}
+
+	return NULL;
+}
+
+/*
+ * Is token one of the comma separated tokens in a header value? Case
+ * doesn't matter, for Connection: keep-alive, Upgrade and friends.
+ */
+static int
+ws_has_token(const char *val, size_t len, const char *token)
+{
+	const char *end = val + len, *e;
+	size_t n = strlen(token);
+
+	while (val < end) {
+		while (val < end && (*val == ' ' || *val == '\t' || *val == ','))
+			val++;
+		e = val;
+		while (e < end && *e != ',')
+			e++;
+		len = (size_t) (e - val);
+		while (len > 0 && (val[len - 1] == ' ' || val[len - 1] == '\t'))
+			len--;
+		if (len == n && strncasecmp(val, token, n) == 0)
+			return 1;
+		val = e;
+	}
+	return 0;
+}
+
+/*
+ * The status code from an HTTP/1.1 status line, or -1 if it isn't one. The
+ * reason phrase can be anything, so it isn't looked at.
+ */
+static int
+ws_status(const char *line)
+{
+	int i, code = 0;
+
+	if (strncmp(line, "HTTP/1.1 ", 9) != 0)
+		return -1;
+	for (i = 9; i < 12; i++) {
+		if (line[i] < '0' || line[i] > '9')
+			return -1;
+		code = code * 10 + (line[i] - '0');
+	}
+	if (line[12] != ' ' && line[12] != '\r')
+		return -1;
+	return code;
+}
+
+/*
+ * strndup(3), which Windows doesn't have.
+ */
+static char *
+ws_strndup(const char *s, size_t len)
+{
+	char *p;
+
+	p = malloc(len + 1);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+/*
+ * Check the server's response is a 101 that holds up its end of RFC 6455
+ * sec. 4.1: the right Upgrade and Connection, the accept key that goes with
+ * the key we sent, and a subprotocol only if it's one we offered. Keeps the
+ * subprotocol and extensions it agreed to in ws->proto and ws->extensions.
+ *
+ * Returns 0 if it's good, DWS_ERR_HANDSHAKE_RES if not, DWS_ERR_MALLOC if
+ * there's no memory to keep what it said.
+ */
+static int
+ws_check_upgrade(struct websocket *ws, const char *res)
+{
+	const char *val;
+	char *picked = NULL, *more;
+	size_t len, n;
+
+	if (ws_status(res) != 101)
+		return DWS_ERR_HANDSHAKE_RES;
+
+	val = ws_header(res, "Upgrade", &len);
+	if (val == NULL || !ws_has_token(val, len, "websocket"))
+		return DWS_ERR_HANDSHAKE_RES;
+	val = ws_header(res, "Connection", &len);
+	if (val == NULL || !ws_has_token(val, len, "upgrade"))
+		return DWS_ERR_HANDSHAKE_RES;
+	val = ws_header(res, "Sec-WebSocket-Accept", &len);
+	if (val == NULL || len != sizeof(ws->accept) - 1
+	    || memcmp(val, ws->accept, len) != 0)
+		return DWS_ERR_HANDSHAKE_RES;
+
+	// Until now, ws->proto has been what we offered.
+	val = ws_header(res, "Sec-WebSocket-Protocol", &len);
+	if (val != NULL) {
+		picked = ws_strndup(val, len);
+		if (picked == NULL)
+			return DWS_ERR_MALLOC;
+		if (ws->proto == NULL || len == 0
+		    || !ws_has_token(ws->proto, strlen(ws->proto), picked)) {
+			free(picked);
+			return DWS_ERR_HANDSHAKE_RES;
+		}
+	}
+	free(ws->proto);
+	ws->proto = picked;
+
+	// Extensions can be spread over several lines; they add up to one
+	// comma separated list (RFC 7230 sec. 3.2.2).
+	for (val = ws_header(res, "Sec-WebSocket-Extensions", &len);
+	    val != NULL; val = ws_header(val, "Sec-WebSocket-Extensions", &len)) {
+		if (len == 0)
+			continue;
+		if (ws->extensions == NULL) {
+			ws->extensions = ws_strndup(val, len);
+			if (ws->extensions == NULL)
+				return DWS_ERR_MALLOC;
+			continue;
+		}
+		n = strlen(ws->extensions);
+		more = realloc(ws->extensions, n + 2 + len + 1);
+		if (more == NULL)
+			return DWS_ERR_MALLOC;
+		memcpy(more + n, ", ", 2);
+		memcpy(more + n + 2, val, len);
+		more[n + 2 + len] = '\0';
+		ws->extensions = more;
+	}
+
+	return 0;
+}
+
+/*
+ * The upgrade didn't happen, so whatever was queued for after it never
+ * will. Throw it out and pass err along.
+ */
+static int
+ws_unqueue(struct websocket *ws, int err)
+{
+	ws->woff = ws->wlen = ws->wfrm = 0;
+	ws->coff = ws->clen = 0;
+	ws->wretry = 0;
+	return err;
+}
+
+/*
+ * dumb_handshake
  *
  * Take an existing, connected socket and do the secret websocket fraternity
  * handshake to prove we are a dumb websocket client.
  *
+ * In non-blocking mode this may return DWS_WANT_POLL or DWS_WANT_WRITE. Just
+ * call it again once the socket is ready; it picks up where it left off and
+ * ignores path and proto the second time around.
+ *
+ * The server's 101 has to check out per RFC 6455 sec. 4.1, accept key and
+ * all. Once it does, ws->proto has the subprotocol it picked out of proto
+ * (which can be a comma separated list, or NULL to not ask for one) and
+ * ws->extensions whatever extensions it agreed to.
+ *
+ * Anything sent between dumb_connect() and here gets queued behind the
+ * upgrade request and goes out the moment the 101 is in, a round trip
+ * sooner than waiting to send it. If the upgrade fails, it's thrown out
+ * without ever touching the wire.
+ *
+ * Once the server has answered and we don't like the answer, the
+ * connection is done for: it's shut down and dumb_reconnect() is the way
+ * to try again.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected websocket
+ *  host: string representing the hostname
+ *  path: the uri path, like "/" or "/dumb"
+ *
+ * Returns:
+ *  0 on success,
+ *  DWS_WANT_POLL or DWS_WANT_WRITE in non-blocking mode,
+ *  DWS_ERR_TIMEOUT if the server took too long in blocking mode,
+ *  DWS_ERR_HANDSHAKE_BUF if it failed to generate the handshake buffer,
+ *  DWS_ERR_HANDSHAKE_RES if it received an invalid handshake response,
+ *  fatal error otherwise.
+ */
+int
+dumb_handshake(struct websocket *ws, const char *path, const char *proto)
+{
+	int len, ret = 0;
+	char key[25], buf[HANDSHAKE_BUF_SIZE], ext[96] = "";
+	size_t early;
+
+	if (ws->state < DWS_ST_HANDSHAKE) {
+		memset(key, 0, sizeof(key));
+		dumb_key(ws, key);
+		ws_accept_key(key, strlen(key), ws->accept);
+
+		// Forget the last connection's, and hang on to what we offer.
+		free(ws->extensions);
+		ws->extensions = NULL;
+		free(ws->proto);
+		ws->proto = NULL;
+		if (proto != NULL && (ws->proto = strdup(proto)) == NULL)
+			return DWS_ERR_MALLOC;
+
+#ifdef DWS_WITH_ZLIB
+		if (ws->deflate) {
+			if (ws->deflate_bits != 0
+			    && (ws->deflate_bits < 9 || ws->deflate_bits > 15))
+				return DWS_ERR_INVALID;
+			// A bare client_max_window_bits lets the server pick.
+			if (ws->deflate_bits)
+				snprintf(ext, sizeof(ext), "Sec-WebSocket-Extensions: "
+				    "permessage-deflate; client_max_window_bits=%d\r\n",
+				    ws->deflate_bits);
+			else
+				snprintf(ext, sizeof(ext), "Sec-WebSocket-Extensions: "
+				    "permessage-deflate; client_max_window_bits\r\n");
+		}
+#endif
+
+		len = snprintf(buf, sizeof(buf), HANDSHAKE_TEMPLATE,
+		    path, ws->host, ws->port, key,
+		    proto ? "Sec-WebSocket-Protocol: " : "", proto ? proto : "",
+		    proto ? "\r\n" : "", ext);
+		if (len < 1 || len >= (int) sizeof(buf))
+			return DWS_ERR_HANDSHAKE_BUF;
+
+		// Queue up our upgrade request, ahead of anything sent early.
+		ret = ws_reserve(ws, (size_t) len);
+		if (ret)
+			return ret;
+		early = ws->wlen - ws->woff;
+		memmove(ws->wbuf + ws->woff + len, ws->wbuf + ws->woff, early);
+		memcpy(ws->wbuf + ws->woff, buf, (size_t) len);
+		ws->wlen += (size_t) len;
+		// Not a frame, so don't let ws_drain() go looking for headers.
+		ws->wfrm = (size_t) len;
+		ws->state = DWS_ST_HANDSHAKE;
+	} else if (ws->state != DWS_ST_HANDSHAKE)
+		return DWS_ERR_INVALID;
+
+	ret = ws_drain(ws);
+	if (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE
+	    || ret == DWS_ERR_TIMEOUT)
+		return ret;
+	else if (ret)
+		return ws_unqueue(ws, ret);
+
+	memset(buf, 0, sizeof(buf));
+	len = ws_read_headers(ws, buf, sizeof(buf) - 1);
+	if (len == DWS_WANT_POLL || len == DWS_WANT_WRITE
+	    || len == DWS_ERR_TIMEOUT)
+		return len;
+	else if (len < 0)
+		return ws_unqueue(ws, DWS_ERR_HANDSHAKE_BUF);
+
+	ret = ws_check_upgrade(ws, buf);
+
+	// Extensions we never asked for aren't allowed.
+	if (ret == 0 && ws->extensions != NULL) {
+#ifdef DWS_WITH_ZLIB
+		if (ws->deflate)
+			ret = ws_deflate_start(ws, ws->extensions,
+			    strlen(ws->extensions));
+		else
+#endif
+		ret = DWS_ERR_HANDSHAKE_RES;
+	}
+	if (ret) {
+		// The server's had its say, so there's no trying again on this
+		// connection, and nothing queued is going anywhere.
+		ws_shutdown(ws);
+		return ret;
+	}
+	ws->state = DWS_ST_OPEN;
+	ws_cork(ws);
+
+	// Let the early birds go. They're queued either way, so no waiting.
+	ret = ws_drain(ws);
+	if (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE)
+		ret = 0;
+	return ret;
+}
+
+/*
+ * Turn whichever socket knobs were asked for, plus SO_NOSIGPIPE where
+ * there's such a thing. Failing to turn one isn't worth failing a connect
+ * over, so they're all best effort.
+ */
+static void
+ws_tune(int s, const struct dumb_sockopts *o)
+{
+	int on = 1;
+
+#ifdef SO_NOSIGPIPE
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const void *) &on,
+	    sizeof(on));
+#endif
+
+	if (o->nodelay)
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const void *) &on,
+		    sizeof(on));
+	if (o->sndbuf > 0)
+		setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const void *) &o->sndbuf,
+		    sizeof(o->sndbuf));
+	if (o->rcvbuf > 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const void *) &o->rcvbuf,
+		    sizeof(o->rcvbuf));
+#ifdef TCP_QUICKACK
+	if (o->quickack)
+		setsockopt(s, IPPROTO_TCP, TCP_QUICKACK, (const void *) &on,
+		    sizeof(on));
+#endif
+#ifdef SO_BUSY_POLL
+	if (o->busy_poll > 0)
+		setsockopt(s, SOL_SOCKET, SO_BUSY_POLL,
+		    (const void *) &o->busy_poll, sizeof(o->busy_poll));
+#endif
+}
+
+static int
+ws_set_nonblock(int s)
+{
+#ifdef _WIN32
+	u_long on = 1;
+
+	return ioctlsocket(s, FIONBIO, &on) ? -1 : 0;
+#else
+	return fcntl(s, F_SETFL, O_NONBLOCK) == -1 ? -1 : 0;
+#endif
+}
+
+/*
+ * Look host up, with the resolve hook if there is one.
+ *
+ * Returns how many addresses went in out, or an error.
+ */
+static int
+ws_lookup(struct websocket *ws, const char *host, uint16_t port,
+    struct dumb_addr *out, size_t max)
+{
+	char port_buf[8];
+	struct addrinfo hints, *res, *ai;
+	size_t n = 0;
+
+	if (ws->resolve != NULL)
+		return ws->resolve(ws->resolve_arg, host, port, out, max);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	memset(port_buf, 0, sizeof(port_buf));
+	snprintf(port_buf, sizeof(port_buf), "%d", port);
+	if (getaddrinfo(host, port_buf, &hints, &res))
+		return DWS_ERR_CONN_RESOLVE;
+
+	for (ai = res; ai != NULL && n < max; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(out[n].ss))
+			continue;
+		memset(&out[n], 0, sizeof(out[n]));
+		memcpy(&out[n].ss, ai->ai_addr, ai->ai_addrlen);
+		out[n].len = (socklen_t) ai->ai_addrlen;
+		n++;
+	}
+	freeaddrinfo(res);
+
+	return n > 0 ? (int) n : DWS_ERR_CONN_RESOLVE;
+}
+
+/*
+ * Put addresses in the order RFC 8305 sec. 4 wants them tried: alternating
+ * between families, starting with whichever the resolver put first.
+ */
+static size_t
+ws_sort_addrs(struct dumb_addr *addrs, size_t naddrs, struct dumb_addr **out)
+{
+	struct dumb_addr *fam[2][CONNECT_MAX_ADDRS];
+	size_t nfam[2] = { 0, 0 }, i, n = 0;
+	int k;
+
+	for (i = 0; i < naddrs && i < CONNECT_MAX_ADDRS; i++) {
+		k = addrs[i].ss.ss_family != addrs[0].ss.ss_family;
+		fam[k][nfam[k]++] = &addrs[i];
+	}
+
+	for (i = 0; i < nfam[0] || i < nfam[1]; i++) {
+		if (i < nfam[0])
+			out[n++] = fam[0][i];
+		if (i < nfam[1])
+			out[n++] = fam[1][i];
+	}
+
+	return n;
+}
+
+/*
+ * Kick off a non-blocking connect(2) to one address.
+ *
+ * Returns the socket, or -1 if this address is a dud.
+ */
+static int
+ws_connect_start(const struct dumb_addr *a, const struct dumb_sockopts *o)
+{
+	int s;
+
+	s = socket(a->ss.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (s < 0)
+		return -1;
+
+	// Buffer sizes have to be in before the handshake to count.
+	ws_tune(s, o);
+
+#ifdef TCP_FASTOPEN_CONNECT
+	/*
+	 * With a cookie from last time, connect(2) returns straight away and
+	 * the upgrade request goes out in the SYN. Without one, it's a normal
+	 * connect that picks up a cookie for next time.
+	 */
+	if (o->fast_open)
+		setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+		    (const void *) &o->fast_open, sizeof(o->fast_open));
+#endif
+
+	if (ws_set_nonblock(s) == 0
+	    && (connect(s, (const struct sockaddr *) &a->ss, a->len) == 0
+	    || CONNECT_IN_PROGRESS()))
+		return s;
+
+	CLOSE_SOCKET(s);
+	return -1;
+}
+
+/*
+ * Race connections to addrs, giving each one CONNECT_ATTEMPT_DELAY ms of a
+ * head start on the next (or less, if it fails first). The first to
+ * connect wins and the rest get closed.
+ *
+ * Returns 0 with the socket in *sp and its address in *won, otherwise
+ * DWS_ERR_CONN_CONNECT or DWS_ERR_TIMEOUT.
+ */
+static int
+ws_connect_race(struct dumb_addr **addrs, size_t naddrs, int timeout,
+    const struct dumb_sockopts *o, int *sp, struct dumb_addr **won)
+{
+	struct pollfd pfd[CONNECT_MAX_ADDRS];
+	struct dumb_addr *tried[CONNECT_MAX_ADDRS];
+	uint64_t now, next_at = 0, deadline = 0;
+	size_t next = 0, npfd = 0, i;
+	socklen_t len;
+	int s, n, wait, err, ret = DWS_ERR_CONN_CONNECT;
+
+	if (timeout > 0)
+		deadline = ws_now() + (uint64_t) timeout * 1000;
+
+	for (;;) {
+		now = ws_now();
+		if (deadline && now >= deadline) {
+			ret = DWS_ERR_TIMEOUT;
+			break;
+		}
+
+		// Next one's up if it's time, or if nothing else is in flight.
+		while (next < naddrs && (npfd == 0 || now >= next_at)) {
+			s = ws_connect_start(addrs[next], o);
+			tried[npfd] = addrs[next++];
+			if (s == -1)
+				continue;
+			memset(&pfd[npfd], 0, sizeof(pfd[npfd]));
+			pfd[npfd].fd = s;
+			pfd[npfd].events = POLLOUT;
+			npfd++;
+			next_at = now + CONNECT_ATTEMPT_DELAY * 1000;
+			break;
+		}
+		if (npfd == 0)
+			break;
+
+		wait = -1;
+		if (next < naddrs)
+			wait = (int) ((next_at - now + 999) / 1000);
+		if (deadline && (wait == -1
+		    || (uint64_t) wait * 1000 > deadline - now))
+			wait = (int) ((deadline - now + 999) / 1000);
+
+		n = poll(pfd, npfd, wait);
+		if (n == -1 && errno != EINTR)
+			break;
+
+		for (i = 0; n > 0 && i < npfd; ) {
+			if (pfd[i].revents == 0) {
+				i++;
+				continue;
+			}
+
+			err = 0;
+			len = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+			    (void *) &err, &len) == 0 && err == 0) {
+				*sp = pfd[i].fd;
+				*won = tried[i];
+				pfd[i] = pfd[--npfd];
+				ret = 0;
+				goto done;
+			}
+
+			// That one's dead, so don't keep the next one waiting.
+			CLOSE_SOCKET(pfd[i].fd);
+			pfd[i] = pfd[--npfd];
+			tried[i] = tried[npfd];
+			next_at = now;
+		}
+	}
+
+done:
+	for (i = 0; i < npfd; i++)
+		CLOSE_SOCKET(pfd[i].fd);
+
+	return ret;
+}
+
+/*
+ * Connect to the best of addrs and get ws set up for a handshake with host.
+ */
+static int
+ws_connect_addrs(struct websocket *ws, const char *host, uint16_t port,
+    struct dumb_addr *addrs, size_t naddrs)
+{
+	struct dumb_addr *order[CONNECT_MAX_ADDRS], *won = NULL;
+	size_t n;
+	int s = -1, ret;
+
+	n = ws_sort_addrs(addrs, naddrs, order);
+	ret = ws_connect_race(order, n, ws->connect_timeout, &ws->sockopts,
+	    &s, &won);
+	if (ret)
+		return ret;
+
+	// Store some state, host last since it may be our own (reconnects)
+	if (ws->host != host) {
+		char *dup = strdup(host);
+
+		if (dup == NULL) {
+			CLOSE_SOCKET(s);
+			return DWS_ERR_MALLOC;
+		}
+		free(ws->host);
+		ws->host = dup;
+	}
+	ws->port = port;
+	ws->s = s;
+
+	// A context from an earlier session can't be used on the new socket.
+	if (ws->ctx)
+		tls_free(ws->ctx);
+	ws->ctx = NULL;
+	ws->state = DWS_ST_CONNECTED;
+
+	if (won != &ws->peer)
+		memcpy(&ws->peer, won, sizeof(ws->peer));
+	memset(&ws->addr, 0, sizeof(ws->addr));
+	ws->addr.ai_family = won->ss.ss_family;
+	ws->addr.ai_socktype = SOCK_STREAM;
+	ws->addr.ai_protocol = IPPROTO_TCP;
+	ws->addr.ai_addrlen = won->len;
+
+	return 0;
+}
+
+/*
+ * dumb_connect
+ *
+ * Ugh, just connect to a host/port, ok? This just simplifies some of the
+ * setup of a socket connection, so is totally optional.
+ *
+ * IPv4 and IPv6 addresses get raced Happy Eyeballs style (RFC 8305), so a
+ * host with broken IPv6 or a dead A record or two doesn't leave us hanging
+ * on the first address getaddrinfo(3) came up with. Set connect_timeout
+ * to give up on the whole lot after that many ms.
+ *
+ * getaddrinfo(3) blocks, sometimes for ages. Set a resolve hook to avoid
+ * it, in which case this can also come back with DWS_WANT_RESOLVE while
+ * the lookup's still going. Just call it again later.
+ *
+ * Parameters:
+ *    ws: (out) pointer to a websocket struct to initialize
+ *  host: hostname or ip address a string
+ *  port: tcp port number
+ *
+ * Returns:
+ *  0 on success,
+ *  DWS_WANT_RESOLVE if the resolve hook is still looking host up,
+ *  DWS_ERR_CONN_RESOLVE if it failed to resolve host,
+ *  DWS_ERR_CONN_CONNECT if it couldn't connect(2) to any of its addresses,
+ *  DWS_ERR_TIMEOUT if connect_timeout ran out first,
+ *  DWS_ERR_MALLOC if it couldn't hang on to a copy of host.
+ */
+int
+dumb_connect(struct websocket *ws, const char *host, uint16_t port)
+{
+	struct dumb_addr addrs[CONNECT_MAX_ADDRS];
+	int ret;
+
+#ifdef _WIN32
+	WSADATA wsaData = {0};
+	ret = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (ret)
+		crap(1, "WSAStartup failed: %d", ret);
+#endif
+
+	ret = ws_lookup(ws, host, port, addrs, CONNECT_MAX_ADDRS);
+	if (ret < 0)
+		return ret;
+
+	return ws_connect_addrs(ws, host, port, addrs, (size_t) ret);
+}
+
+/*
+ * dumb_sockopts_preset
+ *
+ * Fill in socket knobs for a websocket's sockopts that go well together.
+ *
+ * DWS_SOCKOPTS_LATENCY turns off Nagle and delayed ACKs and busy polls a
+ * little, for small messages that need to get there now. The price is more
+ * packets and a syscall or two more per read.
+ *
+ * DWS_SOCKOPTS_THROUGHPUT corks the socket once it's open so only full
+ * packets go out until we're done flushing, and asks for big buffers so the
+ * window can open up. Small messages can wait a while for company, though.
+ * The handshake, TLS and all, goes out uncorked.
+ *
+ * DWS_SOCKOPTS_DEFAULT (or anything else) leaves it all to the OS.
+ *
+ * Parameters:
+ *  o: the sockopts to fill in
+ *  preset: one of the DWS_SOCKOPTS_* presets
+ */
+void
+dumb_sockopts_preset(struct dumb_sockopts *o, int preset)
+{
+	memset(o, 0, sizeof(*o));
+
+	switch (preset) {
+	case DWS_SOCKOPTS_LATENCY:
+		o->nodelay = 1;
+		o->quickack = 1;
+		o->busy_poll = 50;
+		break;
+	case DWS_SOCKOPTS_THROUGHPUT:
+		// Without nodelay, Nagle can sit on what pulling the cork
+		// was meant to push until the cork's back in.
+		o->nodelay = 1;
+		o->cork = 1;
+		o->sndbuf = 4 << 20;
+		o->rcvbuf = 4 << 20;
+		break;
+	}
+}
+
+/*
+ * Get TLS going on a freshly connected socket, as set up in ws->cfg.
+ */
+static int
+ws_start_tls(struct websocket *ws)
+{
+	ws->ctx = tls_client();
+	if (ws->ctx == NULL)
+		crap(1, "%s: tls_client failure", __func__);
+
+	if (tls_configure(ws->ctx, ws->cfg))
+		crap(1, "%s: invalid tls config", __func__);
+
+	return tls_connect_socket(ws->ctx, ws->s, ws->host);
+}
+
+/*
+ * What's behind a struct dumb_tls. libtls is happy to share one tls_config
+ * between contexts (it counts its own references), so all this needs to do
+ * is keep the session file around until the last websocket lets go.
+ */
+struct dumb_tls {
+	struct tls_config	*cfg;
+	int			 session_fd;	// -1 if not resuming
+	long			 refs;
+};
+
+#ifdef _WIN32
+#define REF_INC(p)	InterlockedIncrement(p)
+#define REF_DEC(p)	InterlockedDecrement(p)
+#else
+#define REF_INC(p)	__atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define REF_DEC(p)	__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#endif
+
+/*
+ * Open somewhere for libtls to keep the session. An unlinked temp file is
+ * fine for reconnects within this process and cleans up after itself.
+ */
+static int
+ws_session_fd(const char *path)
+{
+	FILE *f;
+	int fd;
+
+	if (path != NULL)
+		return open(path, O_RDWR | O_CREAT, 0600);
+
+	f = tmpfile();
+	if (f == NULL)
+		return -1;
+	fd = dup(fileno(f));
+	fclose(f);
+	return fd;
+}
+
+/*
+ * dumb_tls_new
+ *
+ * Set up a TLS client config once (CAs, ciphers, ALPN, session cache) so a
+ * bunch of websockets can share it with dumb_connect_tls_shared() instead of
+ * each parsing the CA bundle all over again.
+ *
+ * Parameters:
+ *  opts: how to set it up, or NULL for the defaults
+ *
+ * Returns:
+ *  a dumb_tls holding one reference, or NULL if libtls didn't like the
+ *  options (or we're out of memory or file descriptors).
+ */
+struct dumb_tls *
+dumb_tls_new(const struct dumb_tls_opts *opts)
+{
+	struct dumb_tls *t;
+	struct dumb_tls_opts none;
+	uint32_t protocols;
+
+	if (opts == NULL) {
+		memset(&none, 0, sizeof(none));
+		opts = &none;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->refs = 1;
+	t->session_fd = -1;
+
+	t->cfg = tls_config_new();
+	if (t->cfg == NULL)
+		goto fail;
+
+	if (opts->ca_file && tls_config_set_ca_file(t->cfg, opts->ca_file))
+		goto fail;
+	if (opts->ciphers && tls_config_set_ciphers(t->cfg, opts->ciphers))
+		goto fail;
+	if (opts->alpn && tls_config_set_alpn(t->cfg, opts->alpn))
+		goto fail;
+	if (opts->protocols
+	    && (tls_config_parse_protocols(&protocols, opts->protocols)
+	    || tls_config_set_protocols(t->cfg, protocols)))
+		goto fail;
+
+	if (opts->insecure) {
+		// XXX: I sure hope you know what you're doing :-)
+		tls_config_insecure_noverifycert(t->cfg);
+		tls_config_insecure_noverifyname(t->cfg);
+	}
+
+	if (!opts->no_resume) {
+		t->session_fd = ws_session_fd(opts->session_file);
+		if (t->session_fd == -1
+		    || tls_config_set_session_fd(t->cfg, t->session_fd))
+			goto fail;
+	}
+
+	return t;
+
+fail:
+	if (t->session_fd != -1)
+		close(t->session_fd);
+	if (t->cfg)
+		tls_config_free(t->cfg);
+	free(t);
+	return NULL;
+}
+
+/*
+ * dumb_tls_ref
+ *
+ * Take another reference to a dumb_tls. Safe from any thread.
+ */
+struct dumb_tls *
+dumb_tls_ref(struct dumb_tls *t)
+{
+	REF_INC(&t->refs);
+	return t;
+}
+
+/*
+ * dumb_tls_unref
+ *
+ * Drop a reference to a dumb_tls, freeing it with the last one. Websockets
+ * hold their own, so it's fine to unref right after connecting them.
+ */
+void
+dumb_tls_unref(struct dumb_tls *t)
+{
+	if (t == NULL || REF_DEC(&t->refs) > 0)
+		return;
+
+	tls_config_free(t->cfg);
+	if (t->session_fd != -1)
+		close(t->session_fd);
+	free(t);
+}
+
+/*
+ * dumb_connect_tls_shared
+ *
+ * Like dumb_connect, but establishes a TLS connection using a shared
+ * config from dumb_tls_new(). If it has a session from an earlier
+ * connection to the same server, the handshake resumes it.
+ *
+ * Resuming reads and writes the session file, so stick to connecting from
+ * one thread at a time per dumb_tls (or give each thread its own).
+ *
+ * Parameters:
+ *  ws: pointer to a websocket structure,
+ *  host: hostname or ip address to connect to,
+ *  port: tcp port to connect to,
+ *  tls: the shared config, the websocket takes its own reference
+ *
+ * Returns:
+ *  0 on success, or the same errors as dumb_connect().
+ */
+int
+dumb_connect_tls_shared(struct websocket *ws, const char *host, uint16_t port,
+    struct dumb_tls *tls)
+{
+	int ret;
+
+	ret = dumb_connect(ws, host, port);
+	if (ret)
+		return ret;
+
+	dumb_tls_ref(tls);
+	dumb_tls_unref(ws->tls);
+	ws->tls = tls;
+	ws->cfg = tls->cfg;
+
+	return ws_start_tls(ws);
+}
+
+/*
+ * dumb_connect_tls
+ *
+ * Like dumb_connect, but establishes a TLS connection. The websocket gets a
+ * config of its own, so see dumb_connect_tls_shared() if you've got more
+ * than a couple. Reconnects still resume the session.
+ *
+ * Parameters:
+ *  ws: pointer to a websocket structure,
+ *  host: hostname or ip address to connect to,
+ *  port: tcp port to connect to,
+ *  insecure: set to non-zero to disable cert verification
+ */
+int
+dumb_connect_tls(struct websocket *ws, const char *host, uint16_t port,
+				 int insecure)
+{
+	struct dumb_tls_opts opts;
+	struct dumb_tls *tls;
+	int ret;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.insecure = insecure;
+
+	// No session file (read-only /tmp?) just means no resuming.
+	tls = dumb_tls_new(&opts);
+	if (tls == NULL) {
+		opts.no_resume = 1;
+		tls = dumb_tls_new(&opts);
+	}
+	if (tls == NULL)
+		crap(1, "%s: dumb_tls_new failure", __func__);
+
+	ret = dumb_connect_tls_shared(ws, host, port, tls);
+	dumb_tls_unref(tls);
+	return ret;
+}
+
+/*
+ * dumb_tls_resumed
+ *
+ * Did the TLS handshake (done by now if dumb_handshake() succeeded) get to
+ * resume an earlier session? Handy for checking a session cache works.
+ *
+ * Returns:
+ *  1 if it did, 0 if it was a full handshake or there's no TLS at all.
+ */
+int
+dumb_tls_resumed(struct websocket *ws)
+{
+	if (ws->ctx == NULL)
+		return 0;
+	return tls_conn_session_resumed(ws->ctx) == 1;
+}
+
+/*
+ * dumb_reconnect
+ *
+ * Connect a websocket again to wherever it was last connected, with TLS if
+ * it had it, tearing down whatever's left of the old connection first
+ * without bothering with a CLOSE. It still needs a dumb_handshake() after.
+ *
+ * Without a resolve hook (which has its own cache), the address that worked
+ * last time gets tried first so a reconnect doesn't wait on DNS. Only if
+ * that fails is the host looked up again.
+ *
+ * Parameters:
+ *  ws: pointer to a websocket that's been connected before
+ *
+ * Returns:
+ *  0 on success,
+ *  DWS_ERR_INVALID if it's never been connected,
+ *  or the same errors as dumb_connect().
+ */
+int
+dumb_reconnect(struct websocket *ws)
+{
+	int ret;
+
+	if (ws->host == NULL || ws->server)
+		return DWS_ERR_INVALID;
+
+	if (ws->state != DWS_ST_NONE && ws->state != DWS_ST_CLOSED)
+		ws_shutdown(ws);
+
+	ret = DWS_ERR_CONN_CONNECT;
+	if (ws->resolve == NULL && ws->peer.len > 0)
+		ret = ws_connect_addrs(ws, ws->host, ws->port, &ws->peer, 1);
+	if (ret)
+		ret = dumb_connect(ws, ws->host, ws->port);
+	if (ret)
+		return ret;
+
+	STAT_ADD(ws, reconnects, 1);
+	if (ws->cfg)
+		return ws_start_tls(ws);
+	return 0;
+}
+
+/*
+ * Look over a client's upgrade request and queue our answer to it: a 101
+ * if it's a proper RFC 6455 sec. 4.2.1 request, or a 4xx if not. We pick
+ * proto if the client offered it and say nothing about protocols
+ * otherwise, and we don't do extensions at all, so those are never on.
+ *
+ * Returns 0 if it's a 101, DWS_ERR_HANDSHAKE_RES if it's a no or an error
+ * queueing the answer.
+ */
+static int
+ws_answer_upgrade(struct websocket *ws, const char *req, const char *proto)
+{
+	char accept[29], buf[256];
+	const char *eol, *val, *key;
+	size_t vlen, klen;
+	int len, ret;
+
+	eol = strstr(req, "\r\n");
+	if (eol == NULL || eol - req < 14 || strncmp(req, "GET ", 4) != 0
+	    || memcmp(eol - 9, " HTTP/1.1", 9) != 0)
+		goto bad;
+
+	if (ws_header(req, "Host", &vlen) == NULL)
+		goto bad;
+	val = ws_header(req, "Upgrade", &vlen);
+	if (val == NULL || !ws_has_token(val, vlen, "websocket"))
+		goto bad;
+	val = ws_header(req, "Connection", &vlen);
+	if (val == NULL || !ws_has_token(val, vlen, "upgrade"))
+		goto bad;
+
+	// 16 bytes, base64'd.
+	key = ws_header(req, "Sec-WebSocket-Key", &klen);
+	if (key == NULL || klen != 24 || ws_accept_key(key, klen, accept))
+		goto bad;
+
+	val = ws_header(req, "Sec-WebSocket-Version", &vlen);
+	if (val == NULL || vlen != 2 || memcmp(val, "13", 2) != 0) {
+		len = snprintf(buf, sizeof(buf), "HTTP/1.1 426 Upgrade Required\r\n"
+		    "Sec-WebSocket-Version: 13\r\nContent-Length: 0\r\n"
+		    "Connection: close\r\n\r\n");
+		ret = DWS_ERR_HANDSHAKE_RES;
+		goto queue;
+	}
+
+	val = ws_header(req, "Sec-WebSocket-Protocol", &vlen);
+	if (proto == NULL || val == NULL || !ws_has_token(val, vlen, proto))
+		proto = NULL;
+	free(ws->proto);
+	ws->proto = proto ? strdup(proto) : NULL;
+
+	len = snprintf(buf, sizeof(buf), ACCEPT_TEMPLATE, accept,
+	    proto ? "Sec-WebSocket-Protocol: " : "", proto ? proto : "",
+	    proto ? "\r\n" : "");
+	ret = 0;
+	goto queue;
+
+bad:
+	len = snprintf(buf, sizeof(buf), "HTTP/1.1 400 Bad Request\r\n"
+	    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+	ret = DWS_ERR_HANDSHAKE_RES;
+
+queue:
+	if (len < 1 || len >= (int) sizeof(buf)
+	    || ws_reserve(ws, (size_t) len))
+		return DWS_ERR_HANDSHAKE_RES;
+	memcpy(ws->wbuf + ws->wlen, buf, (size_t) len);
+	ws->wlen += (size_t) len;
+	// Not a frame, so don't let ws_drain() go looking for headers.
+	ws->wfrm = ws->wlen - ws->woff;
+	return ret;
+}
+
+/*
+ * dumb_accept
+ *
+ * The other side of the fence: take a socket you accept(2)ed and do the
+ * handshake as the server, so you can write collectors and the like in C
+ * too. After that the websocket works like any other, except it doesn't
+ * mask what it sends and insists everything it gets is masked, like RFC
+ * 6455 says. See dumb_bcast_new() for sending one message to lots of them.
+ *
+ * The websocket owns the socket from here on, so dumb_free() (or a failed
+ * handshake) closes it. There's no TLS here (terminate it in front) and no
+ * permessage-deflate, and dumb_reconnect() makes no sense, so it won't.
+ *
+ * In non-blocking mode this may return DWS_WANT_POLL or DWS_WANT_WRITE. Just
+ * call it again once the socket is ready; it picks up where it left off and
+ * ignores s and proto the second time around.
+ *
+ * Parameters:
+ *  ws: a pointer to a zeroed (or dumb_free()d) websocket
+ *  s: the accepted socket
+ *  proto: the subprotocol to agree to if the client offers it, or NULL
+ *
+ * Returns:
+ *  0 once the upgrade's done,
+ *  DWS_WANT_POLL or DWS_WANT_WRITE in non-blocking mode,
+ *  DWS_ERR_TIMEOUT if the client took too long in blocking mode,
+ *  DWS_ERR_HANDSHAKE_BUF if the request was too big to bother with,
+ *  DWS_ERR_HANDSHAKE_RES if it wasn't a websocket upgrade request,
+ *  DWS_ERR_INVALID if ws is already in use or s isn't a socket,
+ *  fatal error otherwise.
+ */
+int
+dumb_accept(struct websocket *ws, int s, const char *proto)
+{
+	char buf[REQUEST_BUF_SIZE];
+	ssize_t len;
+	int ret, nonblock;
+
+	if (ws->state == DWS_ST_NONE || ws->state == DWS_ST_CLOSED) {
+		if (s < 0 || ws_set_nonblock(s))
+			return DWS_ERR_INVALID;
+		ws_tune(s, &ws->sockopts);
+		ws->s = s;
+		ws->ctx = NULL;
+		ws->server = 1;
+		ws->state = DWS_ST_CONNECTED;
+	} else if (!ws->server)
+		return DWS_ERR_INVALID;
+
+	if (ws->state == DWS_ST_CONNECTED) {
+		memset(buf, 0, sizeof(buf));
+		len = ws_read_headers(ws, buf, sizeof(buf) - 1);
+		if (len == DWS_WANT_POLL || len == DWS_WANT_WRITE
+		    || len == DWS_ERR_TIMEOUT)
+			return (int) len;
+
+		ret = len < 0 ? DWS_ERR_HANDSHAKE_BUF
+		    : ws_answer_upgrade(ws, buf, proto);
+		if (ret) {
+			// Say no if there's room to, but don't hang around.
+			if (len < 0)
+				ws_answer_upgrade(ws, "", NULL);
+			nonblock = ws->nonblock;
+			ws->nonblock = 1;
+			ws_drain(ws);
+			ws->nonblock = nonblock;
+			ws_shutdown(ws);
+			return ret;
+		}
+		ws->state = DWS_ST_HANDSHAKE;
+	} else if (ws->state != DWS_ST_HANDSHAKE)
+		return DWS_ERR_INVALID;
+
+	ret = ws_drain(ws);
+	if (ret)
+		return ret;
+
+	ws->state = DWS_ST_OPEN;
+	ws_cork(ws);
+	return 0;
+}
+
+/*
+ * dumb_free
+ *
+ * Let go of everything a websocket holds on to: the connection (no CLOSE,
+ * so dumb_close() it first to be polite), its buffers and its TLS config.
+ * It can't be reconnected afterwards, but it can be connected afresh.
+ */
+void
+dumb_free(struct websocket *ws)
+{
+	if (ws->state != DWS_ST_NONE && ws->state != DWS_ST_CLOSED)
+		ws_shutdown(ws);
+
+	// Closed doesn't mean empty: a failed handshake can leave these.
+	free(ws->wbuf);
+	ws->wbuf = NULL;
+	ws->wlen = ws->woff = ws->wcap = 0;
+	free(ws->rbuf);
+	ws->rbuf = NULL;
+	ws->rlen = ws->roff = ws->rcap = 0;
+	free(ws->mbuf);
+	ws->mbuf = NULL;
+	ws->mlen = ws->mcap = 0;
+
+	free(ws->host);
+	ws->host = NULL;
+	ws->port = 0;
+	memset(&ws->peer, 0, sizeof(ws->peer));
+
+	dumb_tls_unref(ws->tls);
+	ws->tls = NULL;
+	ws->cfg = NULL;
+
+	ws->server = 0;
+	free(ws->proto);
+	ws->proto = NULL;
+	free(ws->extensions);
+	ws->extensions = NULL;
+
+	// Forget the key, so anything reusing the websocket gets a new one.
+	memset(ws->rng_key, 0, sizeof(ws->rng_key));
+	ws->rng_ctr = 0;
+	ws->rng_left = 0;
+}
+
+/*
+ * dumb_send() and dumb_send_text(): queue one unfragmented message and push
+ * it along.
+ */
+static ssize_t
+ws_send_one(struct websocket *ws, enum ws_opcode opcode, const void *payload,
+    size_t len)
+{
+	ssize_t frame_len;
+	int ret;
+	uint64_t start = STAT_CLOCK(ws);
+
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+	ret = ws_room(ws, ws_header_len(len) + len);
+	if (ret)
+		return ret;
+
+	frame_len = ws_queue_frame(ws, opcode, payload, len);
+	if (frame_len < 0)
+		return frame_len;
+
+	ret = ws_drain(ws);
+	if (ret && ret != DWS_WANT_WRITE && ret != DWS_WANT_POLL)
+		return ret;
+
+	STAT_SINCE(ws, send_ns, start);
+	return frame_len;
+}
+
+/*
+ * dumb_send
+ *
+ * Send some data to a dumb websocket server in a binary frame. Handles the
+ * dumb framing so you don't have toooooo!
+ *
+ * The frame is built in a buffer owned by the websocket that is reused
+ * between calls, so there's no allocation per message once it's big enough.
+ *
+ * In non-blocking mode, whatever the socket won't take right away stays
+ * queued in that buffer; watch dumb_events() for DWS_POLLOUT and call
+ * dumb_flush() to push it along. With ws->high_water set, a message that
+ * would take the queue past it isn't queued at all: you get DWS_WANT_WRITE
+ * and on_writable fires once the queue drains to ws->low_water.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  payload: the binary payload to send
+ *  len: the length of the payload in bytes
+ *
+ * Returns:
+ *  the size of the frame sent (or queued, in non-blocking mode),
+ *  DWS_WANT_WRITE if the queue's over the high watermark,
+ *  DWS_ERR_INVALID if the websocket isn't connected (or is closing),
+ *  DWS_ERR_MALLOC on failure to grow the frame buffer,
+ *  DWS_ERR_TOO_LARGE if the payload is too large to frame,
+ *  DWS_ERR_TIMEOUT if the socket stayed full too long in blocking mode,
+ *  DWS_ERR_WRITE on failure to send(2).
+ */
+ssize_t
+dumb_send(struct websocket *ws, const void *payload, size_t len)
+{
+	return ws_send_one(ws, BINARY, payload, len);
+}
+
+/*
+ * dumb_send_text
+ *
+ * Like dumb_send(), but in a TEXT frame, for the other end that insists.
+ * The text has to be UTF-8, all of it, and we check before sending since
+ * the other end is supposed to hang up on us if it isn't.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  text: the UTF-8 to send, no terminating NUL needed
+ *  len: the length of the text in bytes
+ *
+ * Returns:
+ *  the same as dumb_send(), or DWS_ERR_INVALID if text isn't UTF-8.
+ */
+ssize_t
+dumb_send_text(struct websocket *ws, const char *text, size_t len)
+{
+	uint32_t state = 0;
+
+	if (dumb_utf8_check(&state, text, len) || state != 0)
+		return DWS_ERR_INVALID;
+
+	return ws_send_one(ws, TEXT, text, len);
+}
+
+/*
+ * dumb_sendv
+ *
+ * Send one binary message whose payload is scattered across an iovec, so
+ * you don't have to glue it together first.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  iov: the pieces of the payload, in order
+ *  iovcnt: how many pieces
+ *
+ * Returns:
+ *  the same as dumb_send().
+ */
+ssize_t
+dumb_sendv(struct websocket *ws, const struct iovec *iov, int iovcnt)
+{
+	ssize_t frame_len;
+	size_t len = 0;
+	int i, ret;
+	uint64_t start = STAT_CLOCK(ws);
+
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	ret = ws_room(ws, ws_header_len(len) + len);
+	if (ret)
+		return ret;
+
+	frame_len = ws_queue_message(ws, BINARY, iov, iovcnt);
+	if (frame_len < 0)
+		return frame_len;
+
+	ret = ws_drain(ws);
+	if (ret && ret != DWS_WANT_WRITE && ret != DWS_WANT_POLL)
+		return ret;
+
+	STAT_SINCE(ws, send_ns, start);
+	return frame_len;
+}
+
+/*
+ * dumb_send_batch
+ *
+ * Send a bunch of binary messages at once, one per iovec entry. They're all
+ * framed back to back in the frame buffer and go out together, usually in a
+ * single send(2) or tls_write(), which is a lot cheaper than a syscall (and
+ * a TLS record) per tiny message.
+ *
+ * Since every frame has to be masked on its way in, the payloads get copied
+ * regardless, so there'd be nothing for writev(2) to save us here.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  msgs: one entry per message
+ *  count: how many messages
+ *
+ * Returns:
+ *  the total size of the frames sent (or queued, in non-blocking mode),
+ *  or any of the errors dumb_send() returns, in which case none of the
+ *  messages were queued.
+ */
+ssize_t
+dumb_send_batch(struct websocket *ws, const struct iovec *msgs, int count)
+{
+	size_t total = 0, queued;
+	ssize_t frame_len;
+	int i, ret;
+	uint64_t start = STAT_CLOCK(ws);
+
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+	for (i = 0; i < count; i++) {
+		if (msgs[i].iov_len > SIZE_MAX - FRAME_MAX_HEADER_SIZE - total)
+			return DWS_ERR_TOO_LARGE;
+		total += msgs[i].iov_len + FRAME_MAX_HEADER_SIZE;
+	}
+
+	// All or nothing, as far as the watermark goes too.
+	ret = ws_room(ws, total);
+	if (ret)
+		return ret;
+
+	// One trip to the allocator (at most) for the whole batch.
+	ret = ws_reserve(ws, total);
+	if (ret)
+		return ret;
+
+	// Relative to woff, since a compressed frame reserving more room can
+	// slide the queue to the front of the buffer.
+	queued = ws->wlen - ws->woff;
+	for (i = 0, total = 0; i < count; i++) {
+		frame_len = ws_queue_frame(ws, BINARY, msgs[i].iov_base,
+		    msgs[i].iov_len);
+		if (frame_len < 0) {
+			// The ones before it may have been through deflate.
+			ws->wlen = ws->woff + queued;
+			return i > 0 ? ws_deflate_abort(ws, (int) frame_len)
+			    : frame_len;
+		}
+		total += (size_t) frame_len;
+	}
+
+	ret = ws_drain(ws);
+	if (ret && ret != DWS_WANT_WRITE && ret != DWS_WANT_POLL)
+		return ret;
+
+	STAT_SINCE(ws, send_ns, start);
+	return (ssize_t) total;
+}
+
+/*
+ * Send a whole frame that's already built somewhere of the caller's,
+ * skipping the queue entirely if it's empty, which it usually is. Whatever
+ * the socket won't take right now gets copied to the back of the queue, so
+ * the caller's free to reuse the frame once we return.
+ *
+ * Returns the frame's length or an error.
+ */
+static ssize_t
+ws_send_frame(struct websocket *ws, const uint8_t *frame, size_t frame_len)
+{
+	size_t left = frame_len;
+	ssize_t sz;
+	int ret;
+
+	while (ws->woff == ws->wlen && ws->clen == ws->coff && !ws->wretry
+	    && !ws_held(ws) && left > 0) {
+		sz = ws_write(ws, frame, left);
+		if (sz == DWS_WANT_WRITE || sz == DWS_WANT_POLL) {
+			if (ws->ctx)
+				ws->wretry = left;
+			break;
+		}
+		else if (sz < 0)
+			return sz;
+		frame += sz;
+		left -= (size_t) sz;
+	}
+
+	if (left > 0) {
+		ret = ws_reserve(ws, left);
+		if (ret)
+			return ret;
+		memcpy(ws->wbuf + ws->wlen, frame, left);
+		ws->wlen += left;
+		// We're now partway through this frame.
+		if (left < frame_len)
+			ws->wfrm = left;
+
+		ret = ws_drain(ws);
+		if (ret && ret != DWS_WANT_WRITE && ret != DWS_WANT_POLL)
+			return ret;
+	}
+
+	return (ssize_t) frame_len;
+}
+
+/*
+ * dumb_send_inplace
+ *
+ * Like dumb_send, but frames the payload right where it sits so nothing gets
+ * copied or allocated. The caller reserves DWS_FRAME_HEADROOM bytes in front
+ * of the payload for us to write the frame header into.
+ *
+ * Heads up: the payload is masked in place, so its contents are garbage once
+ * this returns. If the socket won't take the whole frame right now, the rest
+ * is copied into the websocket's queue so you're free to reuse buf.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  buf: DWS_FRAME_HEADROOM bytes of scratch space followed by the payload
+ *  len: the length of the payload in bytes (not counting the headroom)
+ *
+ * Returns:
+ *  the size of the frame sent (or queued, in non-blocking mode),
+ *  DWS_ERR_TOO_LARGE if the payload is too large to frame,
+ *  or any of the errors dumb_send() returns.
+ */
+ssize_t
+dumb_send_inplace(struct websocket *ws, void *buf, size_t len)
+{
+	ssize_t header_len, sz;
+	uint8_t header[FRAME_MAX_HEADER_SIZE];
+	uint8_t key[4] = { 0, 0, 0, 0 };
+	const uint8_t *mask;
+	uint8_t *frame, *payload;
+	uint64_t start;
+	int ret;
+
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+
+	// There's only headroom for one header, so fragments need copying,
+	// and compressing happens somewhere else anyway.
+	if ((ws->frag_size > 0 && len > ws->frag_size)
+	    || (ws->z != NULL && len >= ws->deflate_min))
+		return dumb_send(ws, (uint8_t *)buf + DWS_FRAME_HEADROOM, len);
+
+	start = STAT_CLOCK(ws);
+
+	// Turn it away before masking, so the caller still has the payload.
+	ret = ws_room(ws, ws_header_len(len) + len);
+	if (ret)
+		return ret;
+
+	mask = ws_next_mask(ws, key);
+	header_len = init_frame(header, BINARY, FRAME_FIN, mask, len);
+	if (header_len < 0)
+		return DWS_ERR_TOO_LARGE;
+
+	// The header goes flush against the payload, wherever that lands us.
+	payload = (uint8_t *)buf + DWS_FRAME_HEADROOM;
+	frame = payload - header_len;
+	memcpy(frame, header, (size_t) header_len);
+
+	ws_mask_copy(payload, payload, len, mask, 0);
+	STAT_FRAME(ws, out, BINARY, len);
+
+	sz = ws_send_frame(ws, frame, (size_t) header_len + len);
+	if (sz < 0)
+		return sz;
+
+	STAT_SINCE(ws, send_ns, start);
+	return sz;
+}
+
+/*
+ * dumb_send_stream
+ *
+ * Send one (possibly huge) binary message without ever holding all of it in
+ * memory. The frame header goes out first, then the payload is pulled from
+ * `fill` a chunk at a time, masked and sent before the next chunk is read.
+ * With ws->frag_size set, each chunk goes out as a fragment of its own.
+ *
+ * fill(buf, len, arg) should put between 1 and len bytes of payload in buf
+ * and return how many, or return 0 or -1 if it can't.
+ *
+ * There's no stopping halfway through a frame, so this waits for the whole
+ * thing to go out even in non-blocking mode. If fill gives up or the socket
+ * fails partway through, the server is left expecting bytes that will never
+ * come, so the websocket gets shut down.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  len: the total length of the payload in bytes
+ *  fill: where the payload comes from
+ *  arg: handed to fill as is
+ *
+ * Returns:
+ *  the size of the frame sent,
+ *  DWS_ERR_READ if fill came up short,
+ *  or any of the errors dumb_send() returns.
+ */
+ssize_t
+dumb_send_stream(struct websocket *ws, size_t len,
+    ssize_t (*fill)(void *, size_t, void *), void *arg)
+{
+	ssize_t header_len, n;
+	uint8_t header[FRAME_MAX_HEADER_SIZE];
+	uint8_t key[4] = { 0, 0, 0, 0 };
+	const uint8_t *mask = NULL;
+	uint8_t *chunk;
+	size_t frag, off, want, room, total = 0;
+	int nonblock, ret;
+
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+	if (len > SSIZE_MAX - FRAME_MAX_HEADER_SIZE)
+		return DWS_ERR_TOO_LARGE;
+
+	frag = ws->frag_size < len ? ws->frag_size : 0;
+	if (frag == 0) {
+		// One frame: header now, payload a chunk at a time.
+		ret = ws_reserve(ws, FRAME_MAX_HEADER_SIZE);
+		if (ret)
+			return ret;
+
+		mask = ws_next_mask(ws, key);
+		header_len = init_frame(ws->wbuf + ws->wlen, BINARY, FRAME_FIN,
+		    mask, len);
+		if (header_len < 0)
+			return DWS_ERR_TOO_LARGE;
+		ws->wlen += (size_t) header_len;
+		total += (size_t) header_len;
+		STAT_FRAME(ws, out, BINARY, len);
+	}
+
+	nonblock = ws->nonblock;
+	ws->nonblock = 0;
+
+	for (off = 0; off < len; off += (size_t) n) {
+		if (frag == 0) {
+			want = MIN(len - off, STREAM_CHUNK_SIZE);
+			room = 0;
+		} else {
+			want = MIN(len - off, frag);
+			room = ws_header_len(want);
+		}
+
+		ret = ws_reserve(ws, room + want);
+		if (ret)
+			goto fail;
+
+		chunk = ws->wbuf + ws->wlen + room;
+		n = fill(chunk, want, arg);
+		if (n <= 0 || (size_t) n > want) {
+			ret = DWS_ERR_READ;
+			goto fail;
+		}
+
+		if (room > 0) {
+			// Each piece becomes a fragment, whatever size fill made it.
+			mask = ws_next_mask(ws, key);
+			header_len = init_frame(header, off ? CONTINUATION : BINARY,
+			    off + (size_t) n == len ? FRAME_FIN : 0, mask,
+			    (size_t) n);
+			if ((size_t) header_len < room) {
+				memmove(ws->wbuf + ws->wlen + header_len, chunk,
+				    (size_t) n);
+				chunk = ws->wbuf + ws->wlen + header_len;
+			}
+			memcpy(ws->wbuf + ws->wlen, header, (size_t) header_len);
+			ws_mask_copy(chunk, chunk, (size_t) n, mask, 0);
+			ws->wlen += (size_t) header_len;
+			total += (size_t) header_len;
+			STAT_FRAME(ws, out, off ? CONTINUATION : BINARY,
+			    (size_t) n);
+		} else
+			ws_mask_copy(chunk, chunk, (size_t) n, mask, off);
+		ws->wlen += (size_t) n;
+
+		ret = ws_drain(ws);
+		if (ret)
+			goto fail;
+	}
+
+	ret = ws_drain(ws);
+	if (ret)
+		goto fail;
+
+	ws->nonblock = nonblock;
+	return (ssize_t) (total + len);
+
+fail:
+	ws->nonblock = nonblock;
+	ws_shutdown(ws);
+	return ret;
+}
+
+static ssize_t
+ws_read_fd(void *buf, size_t len, void *arg)
+{
+	ssize_t n;
+
+	do {
+		n = read(*(int *) arg, buf, len);
+	} while (n == -1 && errno == EINTR);
+
+	return n;
+}
+
+/*
+ * dumb_send_fd
+ *
+ * dumb_send_stream() with the next len bytes of a file descriptor as the
+ * payload. Handy for shipping a big file as a single message.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  fd: a file descriptor to read(2) the payload from
+ *  len: how many bytes to send from it
+ *
+ * Returns:
+ *  the same as dumb_send_stream().
+ */
+ssize_t
+dumb_send_fd(struct websocket *ws, int fd, size_t len)
+{
+	return dumb_send_stream(ws, len, ws_read_fd, &fd);
+}
+
+/*
+ * One frame, framed once, for as many websockets as want it.
+ */
+struct dumb_bcast {
+	long		 refs;
+	size_t		 payload_len;
+	size_t		 len;
+	uint8_t		 frame[];
+};
+
+/*
+ * dumb_bcast_new
+ *
+ * Frame a binary message once so dumb_bcast_send() can hand the very same
+ * bytes to any number of websockets we're serving, rather than framing it
+ * again for every one. Only servers can do this: a client has to mask each
+ * frame its own way.
+ *
  * Parameters:
- *  ws: a pointer to a connected websocket
- *  host: string representing the hostname
- *  path: the uri path, like "/" or "/dumb"
+ *  payload: the binary payload to send
+ *  len: the length of the payload in bytes
  *
  * Returns:
- *  0 on success,
- *  DWS_ERR_HANDSHAKE_BUF if it failed to generate the handshake buffer,
- *  DWS_ERR_HANDSHAKE_ERR if it received an invalid handshake response,
- *  fatal error otherwise.
+ *  a dumb_bcast holding one reference, or NULL if we're out of memory or
+ *  it's too large to frame.
+ */
+struct dumb_bcast *
+dumb_bcast_new(const void *payload, size_t len)
+{
+	struct dumb_bcast *b;
+	ssize_t header_len;
+
+	if (len > SIZE_MAX - sizeof(*b) - FRAME_MAX_HEADER_SIZE)
+		return NULL;
+	b = malloc(sizeof(*b) + FRAME_MAX_HEADER_SIZE + len);
+	if (b == NULL)
+		return NULL;
+
+	header_len = init_frame(b->frame, BINARY, FRAME_FIN, NULL, len);
+	if (header_len < 0) {
+		free(b);
+		return NULL;
+	}
+	if (len > 0)
+		memcpy(b->frame + header_len, payload, len);
+	b->refs = 1;
+	b->payload_len = len;
+	b->len = (size_t) header_len + len;
+	return b;
+}
+
+/*
+ * dumb_bcast_ref
+ *
+ * Take another reference to a dumb_bcast, say for another thread's batch
+ * of websockets. Safe from any thread.
+ */
+struct dumb_bcast *
+dumb_bcast_ref(struct dumb_bcast *b)
+{
+	REF_INC(&b->refs);
+	return b;
+}
+
+/*
+ * dumb_bcast_unref
+ *
+ * Drop a reference to a dumb_bcast, freeing it with the last one. Nothing
+ * queued points back at it, so that's fine to do straight after sending.
+ */
+void
+dumb_bcast_unref(struct dumb_bcast *b)
+{
+	if (b == NULL || REF_DEC(&b->refs) > 0)
+		return;
+	free(b);
+}
+
+/*
+ * dumb_bcast_send
+ *
+ * Send a dumb_bcast's message on a websocket we're serving. When nothing
+ * else is queued, which is most of the time, it goes straight from the
+ * shared frame to the socket, so a broadcast costs a send(2) per websocket
+ * and no copies. A slow one that can't take it all gets the rest copied
+ * into its own queue, like dumb_send_inplace() does.
+ *
+ * The high watermark applies, so with ws->high_water set a websocket
+ * that's fallen too far behind gets DWS_WANT_WRITE instead of more.
+ *
+ * Parameters:
+ *  ws: a pointer to a websocket from dumb_accept()
+ *  b: the message
+ *
+ * Returns:
+ *  the size of the frame sent (or queued, in non-blocking mode),
+ *  DWS_ERR_INVALID if ws is a client,
+ *  or any of the errors dumb_send() returns.
+ */
+ssize_t
+dumb_bcast_send(struct websocket *ws, struct dumb_bcast *b)
+{
+	ssize_t sz;
+	int ret;
+	uint64_t start;
+
+	if (!ws->server)
+		return DWS_ERR_INVALID;
+	ret = ws_sendable(ws);
+	if (ret)
+		return ret;
+
+	start = STAT_CLOCK(ws);
+	ret = ws_room(ws, b->len);
+	if (ret)
+		return ret;
+
+	STAT_FRAME(ws, out, BINARY, b->payload_len);
+	sz = ws_send_frame(ws, b->frame, b->len);
+	if (sz < 0)
+		return sz;
+
+	STAT_SINCE(ws, send_ns, start);
+	return sz;
+}
+
+/*
+ * dumb_flush
+ *
+ * Push out anything dumb_send() and friends left queued. In blocking mode
+ * this waits until it's all gone.
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *
+ * Returns:
+ *  DWS_OK once nothing is left queued,
+ *  DWS_WANT_WRITE or DWS_WANT_POLL in non-blocking mode if some is,
+ *  DWS_ERR_TIMEOUT or DWS_ERR_WRITE on failure.
  */
 int
-dumb_handshake(struct websocket *ws, const char *path, const char *proto)
+dumb_flush(struct websocket *ws)
 {
-	int len, ret = 0;
-	char key[25], buf[HANDSHAKE_BUF_SIZE];
-	ssize_t sz = 0;
+	return ws_drain(ws);
+}
+
+/*
+ * dumb_queued
+ *
+ * How many bytes are queued up waiting for the socket, so you can decide
+ * whether to shed load before the high watermark does it for you.
+ *
+ * Parameters:
+ *  ws: a pointer to a dumb websocket
+ *
+ * Returns:
+ *  the number of bytes queued, 0 once it's all been written.
+ */
+size_t
+dumb_queued(struct websocket *ws)
+{
+	return ws_queued(ws);
+}
+
+/*
+ * dumb_fd
+ *
+ * The socket to hand to poll(2), epoll(7), kqueue(2) or whatever you use.
+ */
+int
+dumb_fd(struct websocket *ws)
+{
+	return ws->s;
+}
+
+/*
+ * dumb_events
+ *
+ * What the websocket is waiting on, as DWS_POLLIN and/or DWS_POLLOUT. We
+ * always want to read once connected, and want to write while anything is
+ * queued (or when TLS needs to write in order to read).
+ */
+int
+dumb_events(struct websocket *ws)
+{
+	int events = 0;
+
+	if (ws->s < 0 || ws->state == DWS_ST_CLOSED)
+		return 0;
+
+	// A server's waiting on the client from the start.
+	if (ws->state >= DWS_ST_HANDSHAKE || ws->server)
+		events |= DWS_POLLIN;
+	if (((ws->wlen > ws->woff || ws->clen > ws->coff) && !ws_held(ws))
+	    || (ws->want & DWS_POLLOUT))
+		events |= DWS_POLLOUT;
+
+	return events;
+}
+
+/*
+ * dumb_stats_snapshot
+ *
+ * Copy out what ws->stats has counted so far. It's just a memcpy(3), so
+ * it's cheap enough to do every frame; diff two snapshots for rates.
+ *
+ * Parameters:
+ *  ws: a pointer to a dumb websocket
+ *  (out) out: where to put the copy
+ *
+ * Returns:
+ *  DWS_OK, or DWS_ERR_INVALID if there's no ws->stats or this is a
+ *  DWS_NO_STATS build.
+ */
+int
+dumb_stats_snapshot(struct websocket *ws, struct dumb_stats *out)
+{
+#ifdef DWS_NO_STATS
+	(void) ws;
+	(void) out;
+	return DWS_ERR_INVALID;
+#else
+	if (ws->stats == NULL)
+		return DWS_ERR_INVALID;
+	memcpy(out, ws->stats, sizeof(*out));
+	return DWS_OK;
+#endif
+}
+
+/*
+ * dumb_hist_percentile
+ *
+ * Roughly where the given percentile of a histogram falls, as the top of
+ * the bucket it lands in (so it errs high, by at most 12.5%).
+ *
+ * Parameters:
+ *  h: a histogram from a dumb_stats
+ *  pct: the percentile, e.g. 50 or 99.9
+ *
+ * Returns:
+ *  the value, or 0 if the histogram's empty.
+ */
+uint64_t
+dumb_hist_percentile(const struct dumb_hist *h, double pct)
+{
+	uint64_t want, seen = 0, top;
+	size_t i;
+
+	if (h->count == 0)
+		return 0;
+
+	want = (uint64_t) ((double) h->count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+	if (want > h->count)
+		want = h->count;
+
+	for (i = 0; i < DWS_HIST_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == DWS_HIST_BUCKETS - 1)
+		return h->max;
+	if (i < 16)
+		top = i;
+	else
+		top = ((uint64_t) (i % 8 + 9) << (i / 8 - 1)) - 1;
+
+	return MIN(top, h->max);
+}
+
+/*
+ * Queue a PING stamped with now, in us, which the PONG has to echo back
+ * for ws_pong() to work out the round trip.
+ */
+static int
+ws_queue_stamp(struct websocket *ws, uint64_t now)
+{
+	uint8_t stamp[8];
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		stamp[i] = (uint8_t) (now >> (56 - 8 * i));
+	len = ws_queue_control(ws, PING, stamp, sizeof(stamp));
+	if (len < 0)
+		return (int) len;
+	ws->ping_sent = now;
+	return 0;
+}
+
+/*
+ * Send a keepalive PING if one's due. Its payload is the time it went out,
+ * which the PONG has to echo back, so we can tell how long the round trip
+ * took. If the last one still hasn't been answered a whole interval later,
+ * the server's gone quiet on us and we say so instead.
+ */
+static int
+ws_keepalive(struct websocket *ws)
+{
+	uint64_t now, interval;
+	int ret;
+
+	if (ws->ping_interval <= 0 || ws->state != DWS_ST_OPEN)
+		return 0;
+
+	now = ws_now();
+	if (now < ws->ping_due)
+		return 0;
+
+	// The PONG may well be sitting there unread, so give it another
+	// interval before giving up.
+	interval = (uint64_t) ws->ping_interval * 1000;
+	if (ws->ping_sent != 0) {
+		if (now - ws->ping_sent < 2 * interval) {
+			ws->ping_due = ws->ping_sent + 2 * interval;
+			return 0;
+		}
+		ws->ping_due = now + interval;
+		return DWS_ERR_TIMEOUT;
+	}
+
+	ret = ws_queue_stamp(ws, now);
+	if (ret)
+		return ret;
+	ws->ping_due = now + interval;
+
+	// Get it going, but it's not worth waiting around for.
+	ret = ws_drain(ws);
+	return (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE) ? 0 : ret;
+}
+
+/*
+ * See if a PONG answers one of our PINGs, updating the round trip times if
+ * it's stamped. Returns 1 if it does, 0 if it's unsolicited.
+ */
+static int
+ws_pong(struct websocket *ws, struct ws_frame *f)
+{
+	uint64_t sent = 0, diff;
+	size_t i;
+
+	if (f->len == sizeof(sent))
+		for (i = 0; i < sizeof(sent); i++)
+			sent = (sent << 8) | f->payload[i];
+
+	if (sent != 0 && sent == ws->ping_sent) {
+		ws->rtt = ws_now() - sent;
+		STAT_HIST(ws, rtt_us, ws->rtt);
+		if (ws->srtt == 0) {
+			ws->srtt = ws->rtt;
+			ws->rttvar = ws->rtt / 2;
+		} else {
+			diff = ws->srtt > ws->rtt ? ws->srtt - ws->rtt
+			    : ws->rtt - ws->srtt;
+			ws->rttvar = (3 * ws->rttvar + diff) / 4;
+			ws->srtt = (7 * ws->srtt + ws->rtt) / 8;
+		}
+		ws->ping_sent = 0;
+		ws->awaiting_pong = 0;
+	} else if (ws->awaiting_pong)
+		ws->awaiting_pong = 0;
+	else
+		return 0;
+
+	ws->pongs++;
+	return 1;
+}
+
+/*
+ * Answer a PING with a PONG carrying the same payload, ahead of whatever
+ * data is queued. Once we've sent a CLOSE there's no point.
+ */
+static int
+ws_answer_ping(struct websocket *ws, struct ws_frame *f)
+{
+	ssize_t len;
+	int ret;
+
+	// Control frames can't carry more than this.
+	if (f->len > 125) {
+		ws_consume(ws, f);
+		return DWS_ERR_INVALID;
+	}
+
+	if (ws->state != DWS_ST_OPEN) {
+		ws_consume(ws, f);
+		return 0;
+	}
+
+	len = ws_queue_control(ws, PONG, f->payload, f->len);
+	ws_consume(ws, f);
+	if (len < 0)
+		return (int) len;
+
+	ret = ws_drain(ws);
+	return (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE) ? 0 : ret;
+}
+
+/*
+ * The other end sent a CLOSE, so send one back with its status code (RFC
+ * 6455 sec. 5.5.1) and hang up. Only if nothing else is queued, though,
+ * since nothing can follow a CLOSE, and it's not worth waiting around for.
+ *
+ * Returns DWS_SHUTDOWN, or DWS_ERR_INVALID if it was too big to be a CLOSE.
+ */
+static int
+ws_closed(struct websocket *ws, struct ws_frame *f)
+{
+	int nonblock = ws->nonblock;
+
+	// Control frames can't carry more than this.
+	if (f->len > 125) {
+		ws_consume(ws, f);
+		return DWS_ERR_INVALID;
+	}
+
+	if (ws->state == DWS_ST_OPEN && ws_queued(ws) == 0 && !ws->wretry
+	    && ws_queue_frame(ws, CLOSE, f->payload, MIN(f->len, 2)) > 0) {
+		ws->nonblock = 1;
+		ws_drain(ws);
+		ws->nonblock = nonblock;
+	}
+	ws_shutdown(ws);
+	return DWS_SHUTDOWN;
+}
+
+/*
+ * Tack a fragment's payload onto the message dumb_recv() is putting back
+ * together. The message buffer only ever grows, like the others.
+ */
+static int
+ws_stash(struct websocket *ws, struct ws_frame *f)
+{
+	uint8_t *buf;
+	size_t cap;
+
+	if (f->opcode != CONTINUATION) {
+		ws->rx_frag = f->opcode;
+#ifdef DWS_WITH_ZLIB
+		if (ws->z)
+			ws->z->rx_msg = f->flags & FRAME_RSV1;
+#endif
+	}
+
+	if (f->len > SIZE_MAX / 2 - ws->mlen)
+		return DWS_ERR_TOO_LARGE;
+
+	if (ws->mcap - ws->mlen < f->len) {
+		cap = ws->mcap ? ws->mcap : RECV_BUF_SIZE;
+		while (cap - ws->mlen < f->len)
+			cap *= 2;
+		buf = realloc(ws->mbuf, cap);
+		if (buf == NULL)
+			return DWS_ERR_MALLOC;
+		ws->mbuf = buf;
+		ws->mcap = cap;
+	}
+
+	if (f->len > 0)
+		memcpy(ws->mbuf + ws->mlen, f->payload, f->len);
+	ws->mlen += f->len;
+	return 0;
+}
+
+/*
+ * Forget the fragments put aside so far, after one that broke the rules.
+ */
+static void
+ws_unstash(struct websocket *ws)
+{
+	ws->mlen = 0;
+	ws->rx_frag = 0;
+	ws->rx_utf8 = 0;
+#ifdef DWS_WITH_ZLIB
+	if (ws->z)
+		ws->z->rx_msg = 0;
+#endif
+}
+
+/*
+ * Carry on throwing away a message that was too big, streaming it through
+ * dumb_recv_chunk() so PINGs still get answered and a compressed stream
+ * still sees all of it.
+ *
+ * Returns 0 once it's gone, otherwise what dumb_recv_chunk() said.
+ */
+static int
+ws_skip(struct websocket *ws)
+{
+	uint8_t scrap[1024];
+	size_t left;
+	ssize_t n;
+
+	ws->rx_skip = 0;
+	do {
+		n = dumb_recv_chunk(ws, scrap, sizeof(scrap), &left);
+		if (n < 0) {
+			if (n == DWS_WANT_POLL || n == DWS_WANT_WRITE)
+				ws->rx_skip = 1;
+			return (int) n;
+		}
+	} while (left != 0);
+
+	return 0;
+}
+
+/*
+ * Start throwing away a message that's too big, frame header and all, along
+ * with whatever of it got put aside.
+ *
+ * Returns DWS_ERR_TOO_LARGE, unless the connection broke along the way.
+ */
+static int
+ws_skip_message(struct websocket *ws)
+{
+	int ret;
+#ifdef DWS_WITH_ZLIB
+	size_t in = ws->mlen, out = 0;
+
+	if (RX_INFLATING(ws) && ws->mlen > 0) {
+		ret = ws_inflate(ws, ws->mbuf, &in, NULL, &out, 1);
+		if (ret)
+			return ret;
+	}
+#endif
+
+	// dumb_recv_chunk() takes it from here, fragments and all.
+	ws->mlen = 0;
+	ws->rx_utf8 = 0;
+	ws->rx_text = 0;
+	ws->rx_skip = 1;
+
+	ret = ws_skip(ws);
+	if (ret && ret != DWS_WANT_POLL && ret != DWS_WANT_WRITE)
+		return ret;
+	return DWS_ERR_TOO_LARGE;
+}
+
+/*
+ * Check the next piece of a TEXT message, and if it's the last piece, that
+ * it didn't stop partway through a character.
+ */
+static int
+ws_text(struct websocket *ws, const void *buf, size_t len, int fin)
+{
+	int ret;
+
+	ret = dumb_utf8_check(&ws->rx_utf8, buf, len);
+	if (ret == 0 && fin && ws->rx_utf8 != 0)
+		ret = DWS_ERR_INVALID;
+	if (ret || fin)
+		ws->rx_utf8 = 0;
+
+	return ret;
+}
+
+/*
+ * The guts of dumb_recv() and dumb_recv_view(): deal with control frames and
+ * put fragments back together until there's a whole message. Then `f`
+ * describes it, with the payload either still in the receive buffer or, if
+ * it came in pieces, in mbuf with f->size of 0 since there's nothing left
+ * to consume. Either way it's the caller's to ws_consume().
+ *
+ * Anything bigger than limit is thrown away and we return DWS_ERR_TOO_LARGE
+ * with its size (so far, if fragmented) in *size.
+ */
+static int
+ws_recv_message(struct websocket *ws, struct ws_frame *f, size_t limit,
+    size_t *size)
+{
+	int ret;
+
+	ret = ws_keepalive(ws);
+	if (ret)
+		return ret;
+
+	// The rest of one that was too big goes first.
+	if (ws->rx_skip) {
+		ret = ws_skip(ws);
+		if (ret)
+			return ret;
+	}
+
+again:
+	ret = ws_next(ws, f, 0, ws_parse_header);
+	if (ret)
+		return ret;
+
+	// Check the size before buffering the whole thing, not after. Even
+	// without a limit, it has to fit in memory.
+	if (!(f->opcode & 0x08) && (f->len > SIZE_MAX / 2 - f->size
+	    || f->len > limit || ws->mlen > limit - f->len)) {
+		*size = ws->mlen + f->len;
+		return ws_skip_message(ws);
+	}
 
-	memset(key, 0, sizeof(key));
-	dumb_key(key);
+	ret = ws_next_frame(ws, f, 1);
+	if (ret)
+		return ret;
 
-	len = snprintf(buf, sizeof(buf), HANDSHAKE_TEMPLATE,
-				   path, ws->host, ws->port, key, proto);
-	if (len < 1)
-		return DWS_ERR_HANDSHAKE_BUF;
+	// Now to validate the frame...
+	if ((f->opcode & 0x08) && !(f->flags & 0x80)) {
+		// Control frames can't be fragmented.
+		ws_consume(ws, f);
+		return DWS_ERR_INVALID;
+	}
 
-	// Send our upgrade request.
-	sz = ws_write(ws, buf, len);
-	if (sz != len)
-		crap(1, "dumb_handshake: ws_write");
+	// A PONG we asked for isn't data, so don't hand it out as such.
+	if (f->opcode == PONG && ws_pong(ws, f)) {
+		ws_consume(ws, f);
+		goto again;
+	}
 
-	memset(buf, 0, sizeof(buf));
-	len = ws_read_txt(ws, buf, sizeof(buf));
-	if (len == -1)
-		return DWS_ERR_HANDSHAKE_BUF;
+	switch (f->opcode) {
+	case CLOSE:
+		// Unexpected, but possible if the server hates us apparently!
+		return ws_closed(ws, f);
+	case PING:
+		// Just answer it and carry on.
+		ret = ws_answer_ping(ws, f);
+		if (ret)
+			return ret;
+		goto again;
+	case CONTINUATION:
+		// Only makes sense partway through a fragmented message.
+		if (!ws->rx_frag) {
+			ws_consume(ws, f);
+			return DWS_ERR_INVALID;
+		}
+		break;
+	case PONG:
+		// This...should not happen, but process the message.
+		// Fallthrough
+	case BINARY:
+		// Fallthrough
+	case TEXT:
+		// Fallthrough
+	default:
+		// Ok. We have something we *think* we can work with!
+		break;
+	}
 
-	/* XXX: If we gave a crap, we'd validate the returned key per the
-	 * requirements of RFC6455 sec. 4.1, but we don't.
-	 */
-	if (memcmp(server_handshake, buf, sizeof(server_handshake) - 1)) {
-        ret = DWS_ERR_HANDSHAKE_RES;
-    }
+	// Nor can a new message start before the last one's finished.
+	if (ws->rx_frag && f->opcode != CONTINUATION && !(f->opcode & 0x08)) {
+		ws_consume(ws, f);
+		ws_unstash(ws);
+		return DWS_ERR_INVALID;
+	}
 
-	return ret;
+	// Only the first frame of a message can say it's compressed, and only
+	// if we agreed to that.
+	if ((f->flags & FRAME_RSV1) && (ws->z == NULL || f->opcode == CONTINUATION)) {
+		ws_consume(ws, f);
+		return DWS_ERR_INVALID;
+	}
+
+	if (f->opcode == CONTINUATION || !(f->flags & 0x80)) {
+		// A piece of a fragmented message, so put it aside until the
+		// last piece shows up. Text gets checked a piece at a time,
+		// unless it's compressed, in which case that waits for inflating.
+		ret = ws_stash(ws, f);
+		ws_consume(ws, f);
+		if (ret == 0 && ws->rx_frag == TEXT && !RX_INFLATING(ws))
+			ret = ws_text(ws, ws->mbuf + ws->mlen - f->len, f->len,
+			    f->flags & 0x80);
+		if (ret) {
+			ws_unstash(ws);
+			return ret;
+		}
+		if (!(f->flags & 0x80))
+			goto again;
+
+		// The pieces stay put in mbuf until the next message starts.
+		f->flags = FRAME_FIN | (RX_INFLATING(ws) ? FRAME_RSV1 : 0);
+		f->opcode = (uint8_t) ws->rx_frag;
+		f->payload = ws->mbuf;
+		f->len = ws->mlen;
+		f->size = 0;
+#ifdef DWS_WITH_ZLIB
+		if (ws->z)
+			ws->z->rx_msg = 0;
+#endif
+		ws->mlen = 0;
+		ws->rx_frag = 0;
+	} else if (f->opcode == TEXT && !(f->flags & FRAME_RSV1)) {
+		ret = ws_text(ws, f->payload, f->len, 1);
+		if (ret) {
+			ws_consume(ws, f);
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
 /*
- * dumb_connect
+ * dumb_recv
  *
- * Ugh, just connect to a host/port, ok? This just simplifies some of the
- * setup of a socket connection, so is totally optional.
+ * Try to receive some data from a dumb websocket server. Strips away all the
+ * dumb framing so you get just the data ;-)
+ *
+ * Frames are parsed out of a per-websocket receive buffer that's filled as
+ * much as possible with each read, so a burst of small frames costs a single
+ * recv(2) rather than a few per frame.
+ *
+ * Fragmented messages are put back together and handed over in one piece,
+ * and compressed ones (see ws->deflate) come out decompressed. PINGs are
+ * answered and keepalives (see ws->ping_interval) sent along the way.
+ *
+ * TEXT messages come out the same as BINARY ones, but only once they've
+ * passed as UTF-8 (see dumb_utf8_check()); use dumb_recv_view() if you need
+ * to tell them apart.
+ *
+ * A message too big for buf (or bigger than ws->max_msg) isn't truncated:
+ * it's thrown away, without buffering it, and you get DWS_ERR_TOO_LARGE.
+ * The next call carries on with the message after it. Use dumb_recv_chunk()
+ * for the big ones, or dumb_recv_view() to find out how big they are.
  *
  * Parameters:
- *    ws: (out) pointer to a websocket struct to initialize
- *  host: hostname or ip address a string
- *  port: tcp port number
+ *  ws: a pointer to a connected websocket
+ * (out) out: pointer to a buffer to copy to resulting payload to
+ * len: max size of the out-buffer
  *
  * Returns:
- *  0 on success,
- *  DWS_ERR_CONN_CREATE if it failed to create a socket,
- *  DWS_ERR_CONN_RESOLVE if it failed to resolve host (check h_errno),
- *  DWS_ERR_CONN_CONNECT if it failed to connect(2).
+ *  the number of bytes received in the payload (not including frame headers),
+ *  DWS_ERR_READ on failure to recv(2) data, DWS_WANT_POLL or DWS_SHUTDOWN,
+ *  DWS_ERR_TOO_LARGE if the message is bigger than buflen or ws->max_msg
+ *  (or too big to buffer at all),
+ *  DWS_ERR_INVALID if it's TEXT that isn't UTF-8 (or isn't a frame),
+ *  DWS_ERR_TIMEOUT if a keepalive PING went unanswered (see
+ *  dumb_keepalive()).
  */
-int
-dumb_connect(struct websocket *ws, const char *host, uint16_t port)
+ssize_t
+dumb_recv(struct websocket *ws, void *buf, size_t buflen)
 {
-	int s;
-	char port_buf[8];
-	struct addrinfo hints, *res;
-
-#ifdef _WIN32
+	struct ws_frame f;
+	size_t limit, payload_len;
 	int ret;
-	WSADATA wsaData = {0};
-	ret = WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+	limit = ws->max_msg ? MIN(ws->max_msg, buflen) : buflen;
+	ret = ws_recv_message(ws, &f, limit, &payload_len);
 	if (ret)
-		crap(1, "WSAStartup failed: %d", ret);
+		return ret;
+
+#ifdef DWS_WITH_ZLIB
+	if (f.flags & FRAME_RSV1) {
+		// How big it really is only shows once it's inflated, and text
+		// has to be checked whole anyway, so do it like dumb_recv_view().
+		ret = ws_inflate_all(ws, f.payload, f.len, limit, &payload_len);
+		ws_consume(ws, &f);
+		if (ret == 0 && f.opcode == TEXT)
+			ret = ws_text(ws, ws->z->out, payload_len, 1);
+		if (ret)
+			return ret;
+		if (payload_len > 0)
+			memcpy(buf, ws->z->out, payload_len);
+		return (ssize_t) payload_len;
+	}
 #endif
 
-	s = socket(AF_INET, SOCK_STREAM, 0);
-	if (s < 0)
-		return DWS_ERR_CONN_CREATE;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = 0;
-	hints.ai_flags = AI_CANONNAME;
-
-	memset(port_buf, 0, sizeof(port_buf));
-	snprintf(port_buf, sizeof(port_buf), "%d", port);
-	if (getaddrinfo(host, port_buf, &hints, &res))
-		return DWS_ERR_CONN_RESOLVE;
-
-	// XXX: for now we're lazy and only try the first addrinfo
-	if (connect(s, res->ai_addr, res->ai_addrlen))
-		return DWS_ERR_CONN_CONNECT;
-
-	// Set to non blocking
-	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
-		return DWS_ERR_CONN_CONNECT;
-
-	// Store some state
-	ws->port = port;
-	ws->host = strdup(host);
-	ws->s = s;
-	ws->ctx = NULL;
-	memset(&ws->addr, 0, sizeof(ws->addr));
-	memcpy(&ws->addr, res, sizeof(ws->addr));
-
-	freeaddrinfo(res);
+	if (f.len > 0)
+		memcpy(buf, f.payload, f.len);
+	ws_consume(ws, &f);
 
-	return 0;
+	return (ssize_t) f.len;
 }
 
 /*
- * dumb_connect_tls
+ * dumb_recv_view
+ *
+ * Like dumb_recv(), but instead of copying the message into your buffer we
+ * point you at it where it already sits in ours (unmasked, if the server
+ * was silly enough to mask it). That view is good until the next call on
+ * the websocket, at which point we reuse the space.
  *
- * Like dumb_connect, but establishes a TLS connection.
+ * Messages that came in pieces or compressed have to be put back together
+ * or inflated somewhere first, so those are copied once on our side and
+ * msg->flags says so.
+ *
+ * Nothing gets truncated: a message bigger than ws->max_msg (if set) is
+ * thrown away without being buffered and you get DWS_ERR_TOO_LARGE with its
+ * size in msg->len, so you know what to raise the limit to. For a
+ * fragmented message that's only the size so far, and for a compressed one
+ * it's the inflated size. The next call carries on with the message after
+ * it.
  *
  * Parameters:
- *  ws: pointer to a websocket structure,
- *  host: hostname or ip address to connect to,
- *  port: tcp port to connect to,
- *  insecure: set to non-zero to disable cert verification
+ *  ws: a pointer to a connected websocket
+ *  (out) msg: the message, its opcode and DWS_MSG_* flags
+ *
+ * Returns:
+ *  the length of the message, or the same codes as dumb_recv().
  */
-int
-dumb_connect_tls(struct websocket *ws, const char *host, uint16_t port,
-				 int insecure)
+ssize_t
+dumb_recv_view(struct websocket *ws, struct dumb_msg *msg)
 {
+	struct ws_frame f;
 	int ret;
-	ret = dumb_connect(ws, host, port);
-	// TODO: better error handling...for now we hard fail for debugging
+
+	memset(msg, 0, sizeof(*msg));
+	ret = ws_recv_message(ws, &f, ws->max_msg ? ws->max_msg : SIZE_MAX,
+	    &msg->len);
 	if (ret)
-		crap(ret, "dumb_connect failed");
+		return ret;
+
+	msg->opcode = f.opcode;
+	if (f.size == 0)
+		msg->flags |= DWS_MSG_FRAGMENTED;
+
+#ifdef DWS_WITH_ZLIB
+	if (f.flags & FRAME_RSV1) {
+		msg->flags |= DWS_MSG_COMPRESSED;
+		ret = ws_inflate_all(ws, f.payload, f.len,
+		    ws->max_msg ? ws->max_msg : SIZE_MAX, &msg->len);
+		ws_consume(ws, &f);
+		if (ret == 0 && f.opcode == TEXT)
+			ret = ws_text(ws, ws->z->out, msg->len, 1);
+		if (ret)
+			return ret;
+		msg->data = ws->z->out;
+		return (ssize_t) msg->len;
+	}
+#endif
 
-	ws->ctx = tls_client();
-	if (ws->ctx == NULL)
-		crap(1, "%s: tls_client failure", __func__);
+	// Leave it in the receive buffer until we're called again.
+	msg->data = f.payload;
+	msg->len = f.len;
+	ws->rx_hold = f.size;
 
-	ws->cfg = tls_config_new();
+	return (ssize_t) msg->len;
+}
 
-	if (insecure) {
-		// XXX: I sure hope you know what you're doing :-)
-		tls_config_insecure_noverifycert(ws->cfg);
-		tls_config_insecure_noverifyname(ws->cfg);
-	}
+/*
+ * Wait for at least one byte to be buffered, unless one already is.
+ */
+static int
+ws_fill_some(struct websocket *ws)
+{
+	ssize_t sz;
+	int ret;
 
-	ret = tls_configure(ws->ctx, ws->cfg);
-	if (ret)
-		crap(1, "%s: invalid tls config", __func__);
+	while (ws->rlen == ws->roff) {
+		sz = ws_fill(ws, 1);
+		if (sz == DWS_WANT_POLL || sz == DWS_WANT_WRITE) {
+			ret = ws_wait(ws, (int) sz);
+			if (ret)
+				return ret;
+		} else if (sz < 0)
+			return DWS_ERR_READ;
+	}
 
-	return tls_connect_socket(ws->ctx, ws->s, host);
+	return 0;
 }
 
+#ifdef DWS_WITH_ZLIB
 /*
- * dumb_send
- *
- * Send some data to a dumb websocket server in a binary frame. Handles the
- * dumb framing so you don't have toooooo!
- *
- * Parameters:
- *  ws: a pointer to a connected dumb websocket
- *  payload: the binary payload to send
- *  len: the length of the payload in bytes
- *
- * Returns:
- *  the amount of bytes sent,
- *  DWS_ERR_MALLOC on failure to calloc(3) a buffer for the dumb websocket
- *  frame, or whatever ws_write might return on error (zero or a negative value)
+ * dumb_recv_chunk() for compressed messages: inflate whatever's buffered
+ * of the current frame into buf. After the last frame we still have to feed
+ * the stream the tail the server stripped and drain whatever that shakes
+ * loose before the message is done.
  */
-ssize_t
-dumb_send(struct websocket *ws, const void *payload, size_t len)
+static ssize_t
+ws_recv_inflate(struct websocket *ws, void *buf, size_t buflen, size_t *left)
 {
-	uint8_t *frame;
-	ssize_t frame_len, n;
+	struct ws_deflate *z = ws->z;
+	size_t in, out = buflen;
+	int ret;
 
-	// We need payload size + 14 bytes minimum, but pad a little extra
-	frame = calloc(1, len + 16);
-	if (frame == NULL)
-		return DWS_ERR_MALLOC;
+	if (ws->rx_left > 0) {
+		ret = ws_fill_some(ws);
+		if (ret)
+			return ret;
 
-	frame_len = dumb_frame(frame, payload, len);
-	if (frame_len < 0)
-		crap(1, "%s: invalid frame payload length", __func__);
+		in = MIN(ws->rlen - ws->roff, ws->rx_left);
+		ret = ws_inflate(ws, ws->rbuf + ws->roff, &in, buf, &out, 0);
+		if (ret)
+			return ret;
 
-	n = ws_write(ws, frame, (size_t) frame_len);
+		ws->roff += in;
+		if (ws->roff == ws->rlen)
+			ws->roff = ws->rlen = 0;
+		ws->rx_left -= in;
+	} else {
+		in = sizeof(deflate_tail) - z->rx_tail;
+		ret = ws_inflate(ws, deflate_tail + z->rx_tail, &in, buf, &out, 0);
+		if (ret)
+			return ret;
+
+		// All fed and it didn't fill buf, so there's nothing left.
+		z->rx_tail += in;
+		if (z->rx_tail == sizeof(deflate_tail) && out < buflen) {
+			z->rx_msg = 0;
+			z->rx_tail = 0;
+			if (left)
+				*left = 0;
+			return (ssize_t) out;
+		}
+	}
 
-	free(frame);
-	return n;
+	if (left)
+		*left = DWS_LEN_UNKNOWN;
+	return (ssize_t) out;
 }
+#endif
 
 /*
- * dumb_recv
+ * dumb_recv_chunk
  *
- * Try to receive some data from a dumb websocket server. Strips away all the
- * dumb framing so you get just the data ;-)
+ * Like dumb_recv(), but for messages too big to want in memory all at once.
+ * Each call hands over the next piece of the current message's payload,
+ * up to buflen bytes, and says how much of it is left. Once that hits 0 the
+ * next call starts on the next message. Only a small, fixed amount of the
+ * payload is ever buffered on our side.
+ *
+ * Fragmented messages are streamed through as the fragments arrive rather
+ * than put back together. Until the last fragment shows up there's no
+ * telling how much is left, so `left` is DWS_LEN_UNKNOWN. Same goes for all
+ * of a compressed message, which is inflated as it arrives.
+ *
+ * TEXT is checked as UTF-8 a piece at a time too, so a bad byte gets you
+ * DWS_ERR_INVALID for the piece it's in, after you've had the ones before.
  *
- * If the data is too large to fit in the destination buffer, it is truncated
- * due to using memcpy(3).
+ * PINGs and CLOSEs between messages are dealt with just like dumb_recv() does
+ * and PONGs are swallowed.
+ * Don't mix in dumb_recv(), dumb_ping() or dumb_close() until the current
+ * message is finished; they'll return DWS_ERR_INVALID.
  *
  * Parameters:
  *  ws: a pointer to a connected websocket
- * (out) out: pointer to a buffer to copy to resulting payload to
- * len: max size of the out-buffer
+ *  (out) buf: where to copy the next piece of payload
+ *  buflen: max size of buf
+ *  (out) left: if not NULL, how much of this message's payload is left
  *
  * Returns:
- *  the number of bytes received in the payload (not including frame headers),
- *  DWS_ERR_READ on failure to recv(2) data, DWS_WANT_POLL or DWS_SHUTDOWN.
+ *  the number of payload bytes copied into buf (0 only for empty messages,
+ *  or when a compressed one needed more input to make any progress),
+ *  or the same codes as dumb_recv().
  */
 ssize_t
-dumb_recv(struct websocket *ws, void *buf, size_t buflen)
+dumb_recv_chunk(struct websocket *ws, void *buf, size_t buflen, size_t *left)
 {
-	uint8_t frame[4] = { 0 };
-	ssize_t payload_len;
-	ssize_t n = 0;
+	struct ws_frame f;
+	size_t avail, n;
+	int ret;
+#ifdef DWS_WITH_ZLIB
+	ssize_t len;
+#endif
 
-	// Read first 2 bytes to figure out the framing details.
-	n = ws_read(ws, frame, 2);
-	if (n < 0) {
-		if (n == -1)
-			return DWS_ERR_READ;
-		return n;
-	}
+	ret = ws_keepalive(ws);
+	if (ret)
+		return ret;
 
-	// Now to validate the frame...
-	if (!(frame[0] & 0x80)) {
-		// XXX: We don't currently support fragmentation
-		crap(1, "%s: fragmentation unsupported", __func__);
+	// Finish throwing away one dumb_recv() said was too big first.
+	if (ws->rx_skip) {
+		ret = ws_skip(ws);
+		if (ret)
+			return ret;
 	}
 
-	switch (frame[0] & 0x0F) {
-	case TEXT:
-		crap(1, "%s: unsupported TEXT frame!", __func__);
-		// unreached
-	case CLOSE:
-		// Unexpected, but possible if the server hates us apparently!
-		ws_shutdown(ws);
-		return DWS_SHUTDOWN;
-	case PING:
-		// Also unexpected! WTF.
-		return DWS_WANT_PONG;
-	case PONG:
-		// This...should not happen, but process the message.
-		// Fallthrough
-	case BINARY:
-		// Fallthrough
-	default:
-		// Ok. We have something we *think* we can work with!
-		payload_len = frame[1] & 0x7F;
+again:
+	// Between frames, unless a compressed message still needs finishing.
+	if (ws->rx_left == 0 && !(RX_INFLATING(ws) && !ws->rx_frag)) {
+		ret = ws_next(ws, &f, 0, ws_parse_header);
+		if (ret)
+			return ret;
+
+		if (f.opcode & 0x08) {
+			// Control frames are tiny, so just grab the whole thing.
+			ret = ws_next_frame(ws, &f, 1);
+			if (ret)
+				return ret;
+
+			if (!(f.flags & 0x80)) {
+				ws_consume(ws, &f);
+				return DWS_ERR_INVALID;
+			}
+
+			switch (f.opcode) {
+			case CLOSE:
+				return ws_closed(ws, &f);
+			case PING:
+				ret = ws_answer_ping(ws, &f);
+				if (ret)
+					return ret;
+				goto again;
+			default:
+				if (f.opcode == PONG)
+					ws_pong(ws, &f);
+				ws_consume(ws, &f);
+				goto again;
+			}
+		}
+
+		// Continuations, and only continuations, follow a non-FIN frame.
+		if ((f.opcode == CONTINUATION) != (ws->rx_frag != 0))
+			return DWS_ERR_INVALID;
+
+		// We only inflate what we can stream straight out of rbuf.
+		if ((f.flags & FRAME_RSV1) && (ws->z == NULL
+		    || f.opcode == CONTINUATION || f.mask != NULL))
+			return DWS_ERR_INVALID;
+#ifdef DWS_WITH_ZLIB
+		if (ws->z && f.opcode != CONTINUATION)
+			ws->z->rx_msg = f.flags & FRAME_RSV1;
+#endif
+		if (f.opcode != CONTINUATION) {
+			ws->rx_text = f.opcode == TEXT;
+			ws->rx_utf8 = 0;
+		}
+		if (!(f.flags & 0x80))
+			ws->rx_frag = ws->rx_frag ? ws->rx_frag : f.opcode;
+		else
+			ws->rx_frag = 0;
+
+		// Step past the header and stream out the payload from here.
+		STAT_FRAME(ws, in, f.opcode, f.len);
+		ws->roff += f.size;
+		if (ws->roff == ws->rlen)
+			ws->roff = ws->rlen = 0;
+		ws->rx_left = f.len;
+		ws->rx_off = 0;
+		ws->mlen = 0;	// whatever dumb_recv() put aside is lost
+		ws->rx_masked = f.mask != NULL;
+		if (f.mask)
+			memcpy(ws->rx_mask, f.mask, sizeof(ws->rx_mask));
+
+		if (f.len == 0 && !RX_INFLATING(ws)) {
+			if (ws->rx_frag)
+				goto again;
+			if (ws->rx_text) {
+				ret = ws_text(ws, NULL, 0, 1);
+				if (ret)
+					return ret;
+			}
+			if (left)
+				*left = 0;
+			return 0;
+		}
 	}
 
-	if (payload_len == 126) {
-		// Need the next two bytes to get the actual payload size, which
-		// arrives in network byte order.
-		n = ws_read_all(ws, frame + 2, 2);
-		if (n < 2)
-			return DWS_ERR_READ;
-		payload_len = frame[2] << 8;
-		payload_len += frame[3];
-	} else if (payload_len > 126)
-		crap(1, "%s: unsupported payload size", __func__);
-
-	// We can now read the the payload, if there is one.
-	payload_len = MIN((size_t)payload_len, buflen);
-	if (payload_len == 0)
-		return 0;
+#ifdef DWS_WITH_ZLIB
+	if (RX_INFLATING(ws)) {
+		if (ws->rx_left == 0 && ws->rx_frag)
+			goto again;
+		len = ws_recv_inflate(ws, buf, buflen, left);
+		if (len >= 0 && ws->rx_text) {
+			ret = ws_text(ws, buf, (size_t) len, !ws->z->rx_msg);
+			if (ret)
+				return ret;
+		}
+		return len;
+	}
+#endif
 
-	n = ws_read_all(ws, buf, (size_t)payload_len);
-	if (n < payload_len)
-		return DWS_ERR_READ;
+	// Hand over what's buffered, or wait for at least something.
+	ret = ws_fill_some(ws);
+	if (ret)
+		return ret;
+
+	avail = ws->rlen - ws->roff;
+	n = MIN(MIN(avail, ws->rx_left), buflen);
+	if (ws->rx_masked)
+		dumb_apply_mask(buf, ws->rbuf + ws->roff, n, ws->rx_mask,
+		    ws->rx_off);
+	else if (n > 0)
+		memcpy(buf, ws->rbuf + ws->roff, n);
+
+	ws->roff += n;
+	if (ws->roff == ws->rlen)
+		ws->roff = ws->rlen = 0;
+	ws->rx_left -= n;
+	ws->rx_off += n;
+
+	// Text gets checked as it goes, the same pieces you get.
+	if (ws->rx_text) {
+		ret = ws_text(ws, buf, n, ws->rx_left == 0 && !ws->rx_frag);
+		if (ret)
+			return ret;
+	}
 
-	return payload_len;
+	if (left)
+		*left = ws->rx_frag ? DWS_LEN_UNKNOWN : ws->rx_left;
+	return (ssize_t) n;
 }
 
 /*
@@ -783,63 +5146,118 @@ dumb_recv(struct websocket *ws, void *buf, size_t buflen)
  * Send a websocket ping to the server. It's dumb to have payloads here, so
  * it doesn't support them ;P
  *
+ * In non-blocking mode this returns DWS_WANT_POLL or DWS_WANT_WRITE until
+ * the PONG shows up. Keep calling it; only the first call sends a PING.
+ *
+ * The PING is stamped like a keepalive one, so its PONG updates ws->rtt and
+ * friends. If a keepalive PING is already out, it waits on that instead.
+ *
+ * Data that turns up ahead of the PONG is left where it is for dumb_recv(),
+ * and DWS_WANT_PONG comes back. dumb_recv() picks up the PONG behind it
+ * (ws->pongs goes up); or read the data and call this again to keep waiting.
+ *
  * Parameters:
  *  ws: pointer to a connected websocket for sending the ping
  *
  * Returns:
  *  0 on success,
+ *  DWS_WANT_POLL or DWS_WANT_WRITE in non-blocking mode,
+ *  DWS_WANT_PONG if there's data to read before the PONG,
+ *  DWS_ERR_TIMEOUT if the PONG took too long in blocking mode,
  *  DWS_ERR_WRITE on failure during send(2),
- *  DWS_ERR_READ on failure to recv(2) the response,
- *  DWS_ERR_INVALID on the response being invalid (i.e. not a PONG)
+ *  DWS_ERR_READ on failure to recv(2) the response.
  */
 int
 dumb_ping(struct websocket *ws)
 {
-	ssize_t len, payload_len;
-	uint8_t mask[4];
-	uint8_t frame[128];
+	struct ws_frame f;
+	int ret;
 
-	memset(frame, 0, sizeof(frame));
-	dumb_mask(mask);
+	if (!ws->awaiting_pong) {
+		if (ws->ping_sent == 0) {
+			ret = ws_queue_stamp(ws, ws_now());
+			if (ret)
+				return ret;
+		}
+		ws->awaiting_pong = 1;
+	}
 
-	len = init_frame(frame, PING, mask, 0);
+	ret = ws_drain(ws);
+	if (ret)
+		return ret;
+
+	while (ws->awaiting_pong) {
+		ret = ws_next_frame(ws, &f, 1);
+		if (ret)
+			return ret;
+
+		if (f.flags == (0x80 + PING)) {
+			ret = ws_answer_ping(ws, &f);
+			if (ret)
+				return ret;
+			continue;
+		}
 
-	len = ws_write(ws, frame, (size_t) len);
-	if (len < 1)
-		return DWS_ERR_WRITE;
+		// Leave anything else for dumb_recv(), which takes care of the
+		// PONG behind it.
+		if (f.flags != (0x80 + PONG))
+			return DWS_WANT_PONG;
 
-	memset(frame, 0, sizeof(frame));
+		ws_pong(ws, &f);
+		ws_consume(ws, &f);
+	}
 
-	// Read first 2 bytes.
-	len = ws_read_all(ws, frame, 2);
-	if (len < 0)
-		return DWS_ERR_READ;
+	return 0;
+}
 
-	// We should have a PONG reply.
-	if (frame[0] != (0x80 + PONG))
-		return DWS_ERR_INVALID;
+/*
+ * dumb_keepalive
+ *
+ * Send a keepalive PING if ws->ping_interval says one's due. dumb_recv() and
+ * friends already do this, so it's only needed while you've nothing to read.
+ * The PONG is picked up by whichever of them sees it, which updates ws->rtt,
+ * ws->srtt and ws->rttvar, and never gets in the way of the data.
+ *
+ * Parameters:
+ *  ws: pointer to a connected websocket
+ *
+ * Returns:
+ *  0 on success (or if nothing was due),
+ *  DWS_ERR_TIMEOUT if the last PING went two intervals without a PONG,
+ *  DWS_ERR_WRITE on failure during send(2).
+ */
+int
+dumb_keepalive(struct websocket *ws)
+{
+	return ws_keepalive(ws);
+}
 
-	payload_len = frame[1] & 0x7F;
-	if (payload_len >= 126)
-		crap(1, "dumb_ping: unsupported pong payload size > 125");
+/*
+ * dumb_next_timeout
+ *
+ * How long until the next keepalive PING is due, for your poll(2) timeout.
+ * Don't sleep past it without calling dumb_keepalive() or dumb_recv().
+ *
+ * Parameters:
+ *  ws: pointer to a connected websocket
+ *
+ * Returns:
+ *  the number of ms to wait, or -1 for forever (no keepalives).
+ */
+int
+dumb_next_timeout(struct websocket *ws)
+{
+	uint64_t now;
 
-	// Dump the rest of the data on the floor.
-	if (payload_len > 0) {
-		len = ws_read_all(ws, frame + 2,
-		    MIN((size_t)payload_len, sizeof(frame) - 2));
-		if (len < 1)
-			return DWS_ERR_INVALID;
-	}
+	if (ws->ping_interval <= 0 || ws->state != DWS_ST_OPEN)
+		return -1;
 
-	return 0;
+	now = ws_now();
+	if (now >= ws->ping_due)
+		return 0;
+	return (int) ((ws->ping_due - now + 999) / 1000);
 }
 
-#ifdef _WIN32
-#define HOW SD_BOTH
-#else
-#define HOW SHUT_RDWR
-#endif
-
 static void
 ws_shutdown(struct websocket *ws)
 {
@@ -849,14 +5267,45 @@ ws_shutdown(struct websocket *ws)
 
 	// Don't care if shutdown fails. Other side may have closed some things first.
 	shutdown(ws->s, HOW);
+	CLOSE_SOCKET(ws->s);
 
-	ws->ctx = NULL; // XXX does this leak anything?
+	if (ws->ctx)
+		tls_free(ws->ctx);
+	ws->ctx = NULL;
 	ws->s = -1;
 
-	// Not sure if it make sense to "free" things here or not.
-	free(ws->host);
-	ws->host = NULL;
-	ws->port = 0;
+	// Hang on to host and port for dumb_reconnect(); dumb_free() lets go.
+
+	free(ws->wbuf);
+	ws->wbuf = NULL;
+	ws->wcap = ws->woff = ws->wlen = 0;
+
+	free(ws->rbuf);
+	ws->rbuf = NULL;
+	ws->rcap = ws->roff = ws->rlen = 0;
+	ws->rx_left = ws->rx_off = 0;
+	ws->rx_frag = 0;
+	ws->rx_hold = 0;
+	ws->rx_skip = 0;
+	ws->rx_utf8 = 0;
+	ws->rx_text = 0;
+
+	free(ws->mbuf);
+	ws->mbuf = NULL;
+	ws->mcap = ws->mlen = 0;
+
+	ws->wfrm = ws->wretry = 0;
+	ws->coff = ws->clen = 0;
+	ws->wblocked = 0;
+
+#ifdef DWS_WITH_ZLIB
+	ws_deflate_free(ws);
+#endif
+
+	ws->state = DWS_ST_CLOSED;
+	ws->awaiting_pong = 0;
+	ws->ping_due = ws->ping_sent = 0;
+	ws->want = 0;
 }
 
 /*
@@ -866,58 +5315,58 @@ ws_shutdown(struct websocket *ws)
  * client disconnects without sending one, they sometimes get snippy. It's
  * sorta dumb.
  *
- * Note: doesn't free the data structures as it's reopenable, but the socket
- * does get closed per the spec.
+ * Note: doesn't free the data structures as it's reopenable (see
+ * dumb_reconnect(), or dumb_free() once you're done), but the socket does
+ * get closed per the spec.
+ *
+ * Like dumb_ping, in non-blocking mode keep calling it until it stops
+ * returning DWS_WANT_POLL or DWS_WANT_WRITE.
  *
  * Parameters:
  *  ws: a pointer to a connected websocket to close
  *
  * Returns:
  *  0 on success,
+ *  DWS_WANT_POLL or DWS_WANT_WRITE in non-blocking mode,
+ *  DWS_ERR_TIMEOUT if the server took too long in blocking mode,
  *  DWS_ERR_WRITE on failure to send(2) the close frame,
  *  DWS_ERR_READ on failure to recv(2) a response,
- *  DWS_ERR_INVALID on a response being invalid (i.e. not a CLOSE),
+ *  DWS_ERR_INVALID on a response being invalid (i.e. not a CLOSE), or
+ *  if the websocket isn't connected in the first place.
  */
 int
 dumb_close(struct websocket *ws)
 {
-	ssize_t len, payload_len;
-	uint8_t mask[4];
-	uint8_t frame[128];
-
-	memset(frame, 0, sizeof(frame));
-	dumb_mask(mask);
-
-	len = init_frame(frame, CLOSE, mask, 0);
+	struct ws_frame f;
+	ssize_t len;
+	int ret;
 
-	len = ws_write(ws, frame, (size_t) len);
-	if (len < 1)
-		return DWS_ERR_WRITE;
+	if (ws->state != DWS_ST_CLOSING) {
+		ret = ws_sendable(ws);
+		if (ret)
+			return ret;
+		len = ws_queue_frame(ws, CLOSE, NULL, 0);
+		if (len < 0)
+			return (int) len;
+		ws->state = DWS_ST_CLOSING;
+	}
 
-	memset(frame, 0, sizeof(frame));
+	ret = ws_drain(ws);
+	if (ret)
+		return ret;
 
 	// A valid RFC6455 websocket server MUST send a Close frame in response
-	// Read first 2 bytes.
-	len = ws_read_all(ws, frame, 2);
-	if (len != 2)
-		return DWS_ERR_READ;
+	ret = ws_next_frame(ws, &f, 1);
+	if (ret)
+		return ret;
 
 	// If we don't have a CLOSE frame...someone screwed up before calling
 	// dumb_close and there's still unread data!
-	if (frame[0] != (0x80 + CLOSE))
+	if (f.flags != (0x80 + CLOSE))
 		return DWS_ERR_INVALID;
 
-	payload_len = frame[1] & 0x7F;
-	if (payload_len > 126)
-		crap(1, "dumb_close: unsupported close payload size > 125");
-
-	// Dump the rest of the data on the floor.
-	if (payload_len > 0) {
-		len = ws_read_all(ws, frame + 2,
-		    MIN((size_t)payload_len, sizeof(frame) - 2));
-		if (len < 1)
-			return DWS_ERR_READ;
-	}
+	// Dump the payload on the floor.
+	ws_consume(ws, &f);
 
 	ws_shutdown(ws);
 
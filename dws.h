@@ -21,17 +21,29 @@
 #include <WinSock2.h>
 #include <WS2tcpip.h>
 #else
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #endif
 
 #include <sys/types.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+struct iovec {
+	void	*iov_base;
+	size_t	 iov_len;
+};
+#endif
 
 /*
- * We only do Binary frames. Why? You might ask...
- * Well Text frames require utf-8 support, which is hella gross.
+ * We mostly do Binary frames. Why? You might ask...
+ * Well Text frames require utf-8 support, which is hella gross. They're
+ * checked on the way in and out now anyway (see dumb_utf8_check()).
  */
 enum ws_opcode {
+	CONTINUATION	= 0x0,
 	TEXT	= 0x1,
 	BINARY	= 0x2,
 	CLOSE	= 0x8,
@@ -39,6 +51,88 @@ enum ws_opcode {
 	PONG	= 0xa,
 };
 
+/*
+ * Where a websocket is in its life. Non-blocking calls use this to pick up
+ * where they left off.
+ */
+enum ws_state {
+	DWS_ST_NONE = 0,
+	DWS_ST_CONNECTED,	/* socket is up, no handshake yet */
+	DWS_ST_HANDSHAKE,	/* upgrade request sent, waiting on the server
+				   (or, serving, our answer's going out) */
+	DWS_ST_OPEN,
+	DWS_ST_CLOSING,		/* CLOSE sent, waiting for one back */
+	DWS_ST_CLOSED,
+};
+
+/*
+ * An address to connect to, as handed to dumb_connect() by a resolve hook.
+ */
+struct dumb_addr {
+	struct sockaddr_storage	 ss;
+	socklen_t		 len;
+};
+
+/*
+ * Socket knobs for dumb_connect() to turn before it connects. All zeros
+ * leaves the OS defaults alone (Nagle and all), and knobs the OS doesn't
+ * have or won't let us turn get quietly skipped. dumb_sockopts_preset()
+ * fills in ones that make sense together.
+ */
+struct dumb_sockopts {
+	int                  nodelay;	/* TCP_NODELAY, so no Nagle */
+	int                  quickack;	/* TCP_QUICKACK after every read */
+	int                  cork;	/* TCP_CORK once open, pushed on flush */
+	int                  sndbuf;	/* SO_SNDBUF bytes, 0 for the default */
+	int                  rcvbuf;	/* SO_RCVBUF bytes, 0 for the default */
+	int                  busy_poll;	/* SO_BUSY_POLL us, 0 for none */
+	int                  fast_open;	/* TCP Fast Open, request in the SYN */
+};
+
+#define DWS_SOCKOPTS_DEFAULT	0
+#define DWS_SOCKOPTS_LATENCY	1	/* small messages, right now */
+#define DWS_SOCKOPTS_THROUGHPUT	2	/* big messages, full packets */
+
+/*
+ * A latency histogram, HDR style: exact below 16, then 8 buckets for every
+ * power of two, so a value is never more than 12.5% off. Anything from
+ * 2^40 up lands in the last bucket.
+ */
+#define DWS_HIST_BUCKETS	304
+
+struct dumb_hist {
+	uint64_t             count;
+	uint64_t             sum;
+	uint64_t             max;
+	uint64_t             buckets[DWS_HIST_BUCKETS];
+};
+
+/*
+ * What a websocket has been up to, if you gave it somewhere to keep count.
+ * Frames and payload bytes are by opcode, counted as they're queued going
+ * out and as they're parsed coming in. No locks or atomics, so it belongs
+ * to whichever thread drives the websocket.
+ */
+struct dumb_stats {
+	uint64_t             frames_out[16];
+	uint64_t             bytes_out[16];
+	uint64_t             frames_in[16];
+	uint64_t             bytes_in[16];
+	uint64_t             sends;		/* dumb_send() and friends */
+	uint64_t             reads;		/* recv(2) or tls_read() calls */
+	uint64_t             writes;		/* send(2) or tls_write() calls */
+	uint64_t             would_block;	/* ...that came back EAGAIN */
+	uint64_t             tls_retries;	/* ...or TLS_WANT_POLL* */
+	uint64_t             waits;		/* poll(2)s in blocking mode */
+	uint64_t             turned_away;	/* sends over high_water */
+	uint64_t             reconnects;
+	struct dumb_hist     send_ns;		/* every 16th of those sends */
+	struct dumb_hist     rtt_us;		/* per keepalive PING */
+};
+
+/* Four ChaCha20 blocks, or 64 masks, per trip through the cipher. */
+#define DWS_RNG_BYTES	256
+
 /*
  * A websocket contains all the state needed for both establishing the
  * connection as well as re-connecting if required. It's possibly a
@@ -48,23 +142,271 @@ enum ws_opcode {
 struct websocket {
 	int s;
 	struct addrinfo      addr; // for reconnects
+	struct dumb_addr     peer; // ...and the address that worked
 	struct tls          *ctx;
 	struct tls_config   *cfg;
+	struct dumb_tls     *tls;	// who cfg belongs to
 
 	/* Retain connection details so we can avoid addrinfo nonsense. */
 	uint16_t             port;
 	char                *host;
 
+	/*
+	 * Reusable frame buffer for dumb_send(). Only ever grows. Bytes in
+	 * [woff, wlen) are queued but not yet written.
+	 */
+	uint8_t             *wbuf;
+	size_t               wcap;
+	size_t               woff;
+	size_t               wlen;
+	size_t               wfrm;	/* bytes left of the frame at woff */
+	size_t               wretry;	/* a tls_write() to repeat as is */
+	int                  wretry_ctrl;
+
+	/* Control frames waiting to cut in line ahead of wbuf. */
+	uint8_t              cbuf[256];
+	size_t               coff;
+	size_t               clen;
+
+	/* Receive buffer. Bytes in [roff, rlen) are read but not consumed. */
+	uint8_t             *rbuf;
+	size_t               rcap;
+	size_t               roff;
+	size_t               rlen;
+
+	/*
+	 * The message dumb_recv_chunk() is partway through: how much payload
+	 * is left, how much came before, and the mask if the server used one.
+	 */
+	size_t               rx_left;
+	size_t               rx_off;
+	uint8_t              rx_mask[4];
+	int                  rx_masked;
+
+	/*
+	 * Opcode of the fragmented message we're partway through (0 if none)
+	 * and, for dumb_recv(), the pieces of it we've got so far.
+	 */
+	int                  rx_frag;
+	uint8_t             *mbuf;
+	size_t               mcap;
+	size_t               mlen;
+
+	/*
+	 * How far dumb_utf8_check() got into the TEXT message we're partway
+	 * through and, for dumb_recv_chunk(), whether that's what it is.
+	 */
+	uint32_t             rx_utf8;
+	int                  rx_text;
+
+	/* Frame dumb_recv_view() handed out, consumed on the next call. */
+	size_t               rx_hold;
+
+	/* Still throwing away a message that was too big. */
+	int                  rx_skip;
+
+	enum ws_state        state;
+	int                  server;		/* dumb_accept()ed, so no masks */
+
+	/*
+	 * What the handshake settled on: the subprotocol and the server's
+	 * Sec-WebSocket-Extensions, NULL if none. While a dumb_handshake()
+	 * is waiting on the 101, proto is what we offered and accept is what
+	 * has to come back.
+	 */
+	char                *proto;
+	char                *extensions;
+	char                 accept[29];
+
+	int                  want;		/* DWS_POLL* a TLS read is stuck on */
+	int                  awaiting_pong;
+
+	/*
+	 * Keepalive bookkeeping, in microseconds: when the next PING is due
+	 * and when the one we're waiting on went out (0 if none).
+	 */
+	uint64_t             ping_due;
+	uint64_t             ping_sent;
+
+	/*
+	 * Round trip times measured by keepalive PINGs, in microseconds: the
+	 * latest, the smoothed average and the jitter (mean deviation), worked
+	 * out like TCP does. pongs counts the PONGs we got for our PINGs.
+	 */
+	uint64_t             rtt;
+	uint64_t             srtt;
+	uint64_t             rttvar;
+	unsigned long        pongs;
+
+	/*
+	 * Set nonblock to have calls return DWS_WANT_POLL/DWS_WANT_WRITE
+	 * instead of waiting, so you can drive things from your own event
+	 * loop using dumb_fd() and dumb_events(). Otherwise we wait in poll(2)
+	 * for up to timeout ms at a time (0 waits forever).
+	 */
+	int                  nonblock;
+	int                  timeout;
+
+	/*
+	 * Set high_water to cap the bytes queued in non-blocking mode: a send
+	 * that would take the queue past it gets DWS_WANT_WRITE instead, and
+	 * on_writable(ws, writable_arg) is called from dumb_flush() and friends
+	 * once the queue drains to low_water. 0 lets the queue grow forever.
+	 * dumb_queued() says how much is waiting.
+	 */
+	size_t               high_water;
+	size_t               low_water;
+	void               (*on_writable)(struct websocket *, void *);
+	void                *writable_arg;
+	int                  wblocked;	/* turned a send away */
+
+	/*
+	 * Set connect_timeout to have dumb_connect() give up on finding an
+	 * address that answers after that many ms. 0 leaves it to the OS.
+	 */
+	int                  connect_timeout;
+
+	/*
+	 * Set sockopts before dumb_connect() to tune the socket, TLS or not.
+	 */
+	struct dumb_sockopts sockopts;
+
+	/*
+	 * Set resolve to have dumb_connect() look hosts up with it instead of
+	 * a blocking getaddrinfo(3), like dumb_resolve() from dws_resolver.h
+	 * with its dumb_resolver as resolve_arg. It fills in at most max
+	 * addresses (port included) and returns how many, DWS_WANT_RESOLVE
+	 * if the answer's not in yet, or DWS_ERR_CONN_RESOLVE.
+	 */
+	int                (*resolve)(void *, const char *, uint16_t,
+	                        struct dumb_addr *, size_t);
+	void                *resolve_arg;
+
+	/*
+	 * Set frag_size to send messages larger than it as fragments of at
+	 * most that many bytes, so a PING or PONG can go out between them
+	 * instead of waiting for the whole message. 0 never fragments.
+	 */
+	size_t               frag_size;
+
+	/*
+	 * Set max_msg to have dumb_recv() and dumb_recv_view() turn down
+	 * messages bigger than it with DWS_ERR_TOO_LARGE rather than buffer
+	 * them. They're thrown away, and the next call gets the next one.
+	 * 0 means no limit.
+	 */
+	size_t               max_msg;
+
+	/*
+	 * Set ping_interval to send a PING every that many ms, stamped so its
+	 * PONG gives us the round trip time. It goes out from whichever of
+	 * dumb_recv() and friends or dumb_keepalive() runs first once it's
+	 * due; dumb_next_timeout() says when that is. 0 means never.
+	 */
+	int                  ping_interval;
+
+	/*
+	 * Set deflate before dumb_handshake() to offer permessage-deflate
+	 * (needs a DWS_WITH_ZLIB build). deflate_bits caps our compression
+	 * window at 9-15 bits (0 means 15) and messages under deflate_min
+	 * bytes go out as is. z is only set if the server agreed.
+	 */
+	int                  deflate;
+	int                  deflate_bits;
+	size_t               deflate_min;
+	struct ws_deflate   *z;
+
+	/*
+	 * Point stats at a zeroed struct dumb_stats of your own to have the
+	 * websocket count what it gets up to (see dumb_stats_snapshot()).
+	 * NULL counts nothing, and a DWS_NO_STATS build never does.
+	 */
+	struct dumb_stats   *stats;
+
+	/*
+	 * Where masks and handshake keys come from: a ChaCha20 keystream of
+	 * the websocket's very own, keyed from the OS on first use and made
+	 * DWS_RNG_BYTES at a time. Only its websocket touches it, so there's
+	 * nothing to lock.
+	 */
+	uint32_t             rng_key[8];
+	uint64_t             rng_ctr;
+	uint8_t              rng_buf[DWS_RNG_BYTES];
+	size_t               rng_left;
+
 	// TODO: add basic auth details?
 };
 
 /*
  * Possible non-error responses from dumb_recv() based on the state of the
- * socket or the next websocket control message (e.g. PING).
+ * socket or the next websocket control message. PINGs get answered for you
+ * these days, so DWS_WANT_PONG only comes back from dumb_ping(), when
+ * there's data to read ahead of its PONG.
  */
 #define DWS_WANT_POLL	-2
 #define DWS_WANT_PONG	-3
 #define DWS_SHUTDOWN	-4
+#define DWS_WANT_READ	DWS_WANT_POLL
+
+/*
+ * Only in non-blocking mode: the socket has to become writable before the
+ * call can make progress (or, from a send, before there's room under the
+ * high watermark). Kept clear of the error codes below.
+ */
+#define DWS_WANT_WRITE	-20
+
+/*
+ * Only from dumb_connect() with a resolve hook: the lookup isn't done yet,
+ * so try again in a bit. DWS_WANT_POLL would clash with the error codes.
+ */
+#define DWS_WANT_RESOLVE	-21
+
+/*
+ * Interest flags from dumb_events().
+ */
+#define DWS_POLLIN	0x01
+#define DWS_POLLOUT	0x02
+
+/*
+ * What dumb_recv_chunk() says is left of a fragmented message before its
+ * last fragment arrives.
+ */
+#define DWS_LEN_UNKNOWN	SIZE_MAX
+
+/*
+ * A message from dumb_recv_view(). data points into the websocket's own
+ * buffers and is only good until the next call on the websocket.
+ */
+struct dumb_msg {
+	const uint8_t       *data;
+	size_t               len;
+	int                  opcode;		/* BINARY, or an unexpected PONG */
+	int                  flags;		/* DWS_MSG_* */
+};
+
+#define DWS_MSG_FRAGMENTED	0x01	/* put back together, so copied */
+#define DWS_MSG_COMPRESSED	0x02	/* inflated, so copied */
+
+/*
+ * How to set up a dumb_tls, a TLS client config that's built once and
+ * shared by as many websockets as you like. Anything left 0 or NULL gets
+ * the libtls default. Sessions are kept in session_file if given (it must
+ * be 0600 and yours), otherwise in an anonymous temp file, so reconnects
+ * get to skip the full handshake. LibreSSL only resumes TLSv1.2 sessions,
+ * so set protocols to "tlsv1.2" if reconnects matter more than 1.3 does.
+ */
+struct dumb_tls_opts {
+	const char          *ca_file;		/* instead of the system CAs */
+	const char          *ciphers;		/* see tls_config_set_ciphers(3) */
+	const char          *alpn;		/* e.g. "http/1.1" */
+	const char          *protocols;		/* e.g. "tlsv1.2", see below */
+	int                  insecure;		/* don't verify cert or name */
+	int                  no_resume;		/* full handshake every time */
+	const char          *session_file;
+};
+
+struct dumb_tls;
+struct dumb_bcast;
 
 /*
  * Simplistic error code approach using define's.
@@ -80,14 +422,60 @@ struct websocket {
 #define DWS_ERR_HANDSHAKE_BUF	-8
 #define DWS_ERR_HANDSHAKE_RES	-9
 #define DWS_ERR_TOO_LARGE	-10
+#define DWS_ERR_TIMEOUT		-11
+#define DWS_ERR_FULL		-12
+
+/*
+ * Bytes a caller must reserve in front of a payload handed to
+ * dumb_send_inplace(). Enough for the largest possible frame header.
+ */
+#define DWS_FRAME_HEADROOM	14
 
 int dumb_connect(struct websocket *ws, const char*, uint16_t);
+void dumb_sockopts_preset(struct dumb_sockopts*, int);
 int dumb_connect_tls(struct websocket *ws, const char*, uint16_t, int);
 int dumb_handshake(struct websocket *s, const char*, const char*);
+int dumb_reconnect(struct websocket *ws);
+int dumb_accept(struct websocket *ws, int, const char*);
+void dumb_free(struct websocket *ws);
+
+struct dumb_tls *dumb_tls_new(const struct dumb_tls_opts*);
+struct dumb_tls *dumb_tls_ref(struct dumb_tls*);
+void dumb_tls_unref(struct dumb_tls*);
+int dumb_connect_tls_shared(struct websocket *ws, const char*, uint16_t,
+    struct dumb_tls*);
+int dumb_tls_resumed(struct websocket *ws);
 
 ssize_t dumb_send(struct websocket *ws, const void*, size_t);
+ssize_t dumb_send_text(struct websocket *ws, const char*, size_t);
+ssize_t dumb_send_inplace(struct websocket *ws, void*, size_t);
+ssize_t dumb_sendv(struct websocket *ws, const struct iovec*, int);
+ssize_t dumb_send_batch(struct websocket *ws, const struct iovec*, int);
+ssize_t dumb_send_stream(struct websocket *ws, size_t,
+    ssize_t (*)(void*, size_t, void*), void*);
+ssize_t dumb_send_fd(struct websocket *ws, int, size_t);
+int dumb_flush(struct websocket *ws);
+struct dumb_bcast *dumb_bcast_new(const void*, size_t);
+struct dumb_bcast *dumb_bcast_ref(struct dumb_bcast*);
+void dumb_bcast_unref(struct dumb_bcast*);
+ssize_t dumb_bcast_send(struct websocket *ws, struct dumb_bcast*);
+size_t dumb_queued(struct websocket *ws);
 ssize_t dumb_recv(struct websocket *ws, void*, size_t);
+ssize_t dumb_recv_view(struct websocket *ws, struct dumb_msg*);
+ssize_t dumb_recv_chunk(struct websocket *ws, void*, size_t, size_t*);
 int dumb_ping(struct websocket *ws);
+int dumb_keepalive(struct websocket *ws);
+int dumb_next_timeout(struct websocket *ws);
 int dumb_close(struct websocket *ws);
 
+int dumb_fd(struct websocket *ws);
+int dumb_events(struct websocket *ws);
+
+int dumb_stats_snapshot(struct websocket *ws, struct dumb_stats*);
+uint64_t dumb_hist_percentile(const struct dumb_hist*, double);
+
+void dumb_mask(struct websocket *ws, uint8_t[4]);
+void dumb_apply_mask(void*, const void*, size_t, const uint8_t[4], size_t);
+int dumb_utf8_check(uint32_t*, const void*, size_t);
+
 #endif /* DWS_H */
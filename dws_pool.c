@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dws_pool.h"
+
+#define POOL_SIZE		2
+#define POOL_BACKOFF_MIN	100
+#define POOL_BACKOFF_MAX	30000
+
+// A server that accepts and never answers mustn't hold up the pool thread.
+#define POOL_TIMEOUT		10000
+
+enum slot_state {
+	SLOT_DEAD,	// waiting for its turn to reconnect
+	SLOT_BUSY,	// the pool thread is busy with it
+	SLOT_IDLE,	// connected and ready to hand out
+	SLOT_LENT,	// somebody's using it
+};
+
+/*
+ * The websocket comes first so dumb_pool_put() can find its slot.
+ */
+struct pool_slot {
+	struct websocket	 ws;
+	enum slot_state		 state;
+	int			 failures;
+	uint64_t		 retry_at;	// ms, on pool_now()'s clock
+};
+
+struct dumb_pool {
+	struct dumb_pool_config	 cfg;
+	struct dumb_tls		*tls;		// shared by all the slots
+
+	struct pool_slot	*slots;
+	size_t			 nslots;
+	size_t			 idle;
+
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 ready;		// a slot went idle
+	int			 wake[2];	// pokes the thread out of poll(2)
+	int			 stop;
+
+	uint64_t		 rng;		// for the jitter
+};
+
+static uint64_t
+pool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void
+pool_poke(struct dumb_pool *p)
+{
+	ssize_t n;
+
+	// If the pipe's full the thread has plenty of pokes to wake up to.
+	n = write(p->wake[1], "", 1);
+	(void) n;
+}
+
+/*
+ * How long to wait before the next attempt after `failures` failed ones:
+ * doubling each time up to backoff_max, then jittered to somewhere between
+ * half and all of that so a crowd of clients doesn't retry in lockstep.
+ */
+static uint64_t
+pool_backoff(struct dumb_pool *p, int failures)
+{
+	uint64_t delay = (uint64_t) p->cfg.backoff_min;
+
+	while (failures-- > 0 && delay < (uint64_t) p->cfg.backoff_max)
+		delay *= 2;
+	if (delay > (uint64_t) p->cfg.backoff_max)
+		delay = (uint64_t) p->cfg.backoff_max;
+
+	// xorshift64, plenty random enough for this.
+	p->rng ^= p->rng << 13;
+	p->rng ^= p->rng >> 7;
+	p->rng ^= p->rng << 17;
+
+	return delay / 2 + p->rng % (delay / 2 + 1);
+}
+
+/*
+ * Get a slot connected and handshaken. Runs without the lock held.
+ */
+static int
+pool_connect(struct dumb_pool *p, struct pool_slot *s)
+{
+	struct websocket *ws = &s->ws;
+	int ret, timeout;
+
+	timeout = p->cfg.timeout > 0 ? p->cfg.timeout : POOL_TIMEOUT;
+	ws->connect_timeout = timeout;
+	ws->sockopts = p->cfg.sockopts;
+	if (ws->host == NULL) {
+		if (p->tls)
+			ret = dumb_connect_tls_shared(ws, p->cfg.host,
+			    p->cfg.port, p->tls);
+		else
+			ret = dumb_connect(ws, p->cfg.host, p->cfg.port);
+	} else
+		ret = dumb_reconnect(ws);
+	if (ret)
+		return ret;
+
+	ws->nonblock = 0;
+	ws->timeout = timeout;
+	ret = dumb_handshake(ws, p->cfg.path, p->cfg.proto);
+	if (ret)
+		return ret;
+
+	// Idle websockets are only ever checked on, never waited on.
+	ws->timeout = p->cfg.timeout;
+	ws->ping_interval = p->cfg.ping_interval;
+	ws->nonblock = 1;
+	return 0;
+}
+
+/*
+ * See whether an idle websocket is still alive: send a keepalive if it's
+ * due and read whatever's arrived. Nobody's listening, so any messages go
+ * on the floor. Runs without the lock held.
+ */
+static int
+pool_check(struct websocket *ws)
+{
+	struct dumb_msg msg;
+	ssize_t len;
+	int ret;
+
+	while ((len = dumb_recv_view(ws, &msg)) >= 0)
+		;
+	if (len != DWS_WANT_POLL && len != DWS_WANT_WRITE)
+		return 0;
+
+	ret = dumb_flush(ws);
+	return ret == 0 || ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE;
+}
+
+static void
+pool_idle(struct dumb_pool *p, struct pool_slot *s)
+{
+	s->state = SLOT_IDLE;
+	p->idle++;
+	pthread_cond_signal(&p->ready);
+}
+
+/*
+ * The pool thread: reconnect the dead, check on the idle and sleep in
+ * poll(2) until one of those needs doing again.
+ */
+static void *
+pool_run(void *arg)
+{
+	struct dumb_pool *p = arg;
+	struct pool_slot *s;
+	struct pollfd *pfds;
+	size_t *which, i, n;
+	uint64_t now;
+	char junk[64];
+	int ret, timeout, t;
+
+	pfds = calloc(p->nslots + 1, sizeof(*pfds));
+	which = calloc(p->nslots, sizeof(*which));
+	if (pfds == NULL || which == NULL) {
+		free(pfds);
+		free(which);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop) {
+		timeout = -1;
+		n = 0;
+		for (i = 0; i < p->nslots && !p->stop; i++) {
+			s = &p->slots[i];
+			now = pool_now();
+			if (s->state == SLOT_DEAD && now >= s->retry_at) {
+				s->state = SLOT_BUSY;
+				pthread_mutex_unlock(&p->lock);
+				ret = pool_connect(p, s);
+				pthread_mutex_lock(&p->lock);
+
+				if (ret == 0) {
+					s->failures = 0;
+					pool_idle(p, s);
+				} else {
+					s->state = SLOT_DEAD;
+					now = pool_now();
+					s->retry_at = now
+					    + pool_backoff(p, s->failures++);
+				}
+			}
+
+			if (s->state == SLOT_DEAD) {
+				t = (int) (s->retry_at - now);
+				if (timeout < 0 || t < timeout)
+					timeout = t;
+			} else if (s->state == SLOT_IDLE) {
+				pfds[n].fd = dumb_fd(&s->ws);
+				pfds[n].events = POLLIN;
+				pfds[n].revents = 0;
+				which[n++] = i;
+				t = dumb_next_timeout(&s->ws);
+				if (t >= 0 && (timeout < 0 || t < timeout))
+					timeout = t;
+			}
+		}
+		if (p->stop)
+			break;
+
+		pfds[n].fd = p->wake[0];
+		pfds[n].events = POLLIN;
+		pfds[n].revents = 0;
+
+		pthread_mutex_unlock(&p->lock);
+		ret = poll(pfds, (nfds_t) n + 1, timeout);
+		if (ret > 0 && pfds[n].revents)
+			while (read(p->wake[0], junk, sizeof(junk)) > 0)
+				;
+		pthread_mutex_lock(&p->lock);
+
+		// Anything lent out meanwhile isn't ours to check anymore.
+		for (i = 0; i < n && !p->stop; i++) {
+			s = &p->slots[which[i]];
+			if (s->state != SLOT_IDLE)
+				continue;
+			if (pfds[i].revents == 0 && dumb_next_timeout(&s->ws))
+				continue;
+
+			s->state = SLOT_BUSY;
+			p->idle--;
+			pthread_mutex_unlock(&p->lock);
+			ret = pool_check(&s->ws);
+			pthread_mutex_lock(&p->lock);
+
+			if (ret)
+				pool_idle(p, s);
+			else {
+				// It was fine until now, so try again right away.
+				s->state = SLOT_DEAD;
+				s->retry_at = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	free(pfds);
+	free(which);
+	return NULL;
+}
+
+/*
+ * dumb_pool_new
+ *
+ * Make a pool and start connecting its websockets in the background.
+ *
+ * Keepalives are how dead idle websockets get noticed, so set ping_interval
+ * unless the server is good about closing them. Plain websockets never
+ * raise SIGPIPE, but TLS writes on a system without SO_NOSIGPIPE can, so
+ * ignore it if you're using TLS.
+ *
+ * Parameters:
+ *  cfg: where to connect and how (copied, along with its strings)
+ *
+ * Returns:
+ *  a new pool, or NULL if we ran out of memory, pipes or threads
+ */
+struct dumb_pool *
+dumb_pool_new(const struct dumb_pool_config *cfg)
+{
+	struct dumb_pool *p;
+	struct dumb_tls_opts opts;
+	size_t i;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+
+	p->cfg = *cfg;
+	if (p->cfg.size == 0)
+		p->cfg.size = POOL_SIZE;
+	if (p->cfg.backoff_min <= 0)
+		p->cfg.backoff_min = POOL_BACKOFF_MIN;
+	if (p->cfg.backoff_max < p->cfg.backoff_min)
+		p->cfg.backoff_max = p->cfg.backoff_min > POOL_BACKOFF_MAX
+		    ? p->cfg.backoff_min : POOL_BACKOFF_MAX;
+
+	p->cfg.host = strdup(cfg->host);
+	p->cfg.path = strdup(cfg->path ? cfg->path : "/");
+	p->cfg.proto = cfg->proto ? strdup(cfg->proto) : NULL;
+	p->nslots = p->cfg.size;
+	p->slots = calloc(p->nslots, sizeof(*p->slots));
+	p->wake[0] = p->wake[1] = -1;
+	p->rng = pool_now() ^ (uint64_t) (uintptr_t) p;
+	if (p->rng == 0)
+		p->rng = 1;
+
+	if (p->cfg.host == NULL || p->cfg.path == NULL || p->slots == NULL
+	    || (cfg->proto && p->cfg.proto == NULL))
+		goto fail;
+
+	// One TLS config for the lot, so reconnects resume sessions.
+	if (cfg->tls_ctx)
+		p->tls = dumb_tls_ref(cfg->tls_ctx);
+	else if (cfg->tls) {
+		memset(&opts, 0, sizeof(opts));
+		opts.insecure = cfg->insecure;
+		p->tls = dumb_tls_new(&opts);
+		if (p->tls == NULL)
+			goto fail;
+	}
+
+	for (i = 0; i < p->nslots; i++)
+		p->slots[i].ws.s = -1;
+
+	if (pipe(p->wake) == -1) {
+		p->wake[0] = p->wake[1] = -1;
+		goto fail;
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(p->wake[i], F_SETFL, O_NONBLOCK) == -1
+		    || fcntl(p->wake[i], F_SETFD, FD_CLOEXEC) == -1)
+			goto fail;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->ready, NULL);
+	if (pthread_create(&p->thread, NULL, pool_run, p)) {
+		pthread_cond_destroy(&p->ready);
+		pthread_mutex_destroy(&p->lock);
+		goto fail;
+	}
+
+	return p;
+
+fail:
+	if (p->wake[0] != -1) {
+		close(p->wake[0]);
+		close(p->wake[1]);
+	}
+	dumb_tls_unref(p->tls);
+	free(p->slots);
+	free((char *) p->cfg.host);
+	free((char *) p->cfg.path);
+	free((char *) p->cfg.proto);
+	free(p);
+	return NULL;
+}
+
+/*
+ * dumb_pool_free
+ *
+ * Stop the pool thread, close all the websockets and free the pool. Put
+ * back everything you got from it first.
+ */
+void
+dumb_pool_free(struct dumb_pool *p)
+{
+	struct websocket *ws;
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pool_poke(p);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	for (i = 0; i < p->nslots; i++) {
+		ws = &p->slots[i].ws;
+		if (ws->state == DWS_ST_OPEN) {
+			ws->nonblock = 0;
+			if (ws->timeout <= 0)
+				ws->timeout = 1000;
+			dumb_close(ws);
+		}
+		dumb_free(ws);
+	}
+
+	pthread_cond_destroy(&p->ready);
+	pthread_mutex_destroy(&p->lock);
+	close(p->wake[0]);
+	close(p->wake[1]);
+	dumb_tls_unref(p->tls);
+	free(p->slots);
+	free((char *) p->cfg.host);
+	free((char *) p->cfg.path);
+	free((char *) p->cfg.proto);
+	free(p);
+}
+
+/*
+ * dumb_pool_get
+ *
+ * Borrow a connected, handshaken websocket from the pool. It's in blocking
+ * mode and all yours until you dumb_pool_put() it back.
+ *
+ * Parameters:
+ *  p: the pool
+ *  timeout: ms to wait for one if none are ready (-1 forever, 0 not at all)
+ *
+ * Returns:
+ *  a websocket, or NULL if none turned up in time
+ */
+struct websocket *
+dumb_pool_get(struct dumb_pool *p, int timeout)
+{
+	struct websocket *ws = NULL;
+	struct timespec deadline;
+	size_t i;
+	int ret = 0;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while (p->idle == 0 && timeout != 0 && ret != ETIMEDOUT) {
+		if (timeout < 0)
+			pthread_cond_wait(&p->ready, &p->lock);
+		else
+			ret = pthread_cond_timedwait(&p->ready, &p->lock,
+			    &deadline);
+	}
+
+	for (i = 0; i < p->nslots && p->idle > 0; i++) {
+		if (p->slots[i].state == SLOT_IDLE) {
+			p->slots[i].state = SLOT_LENT;
+			p->idle--;
+			ws = &p->slots[i].ws;
+			ws->nonblock = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return ws;
+}
+
+/*
+ * dumb_pool_put
+ *
+ * Give a websocket back to the pool. If it's closed, or you say it's
+ * broken (say, a send failed), it gets reconnected in the background.
+ *
+ * Parameters:
+ *  p: the pool it came from
+ *  ws: the websocket from dumb_pool_get()
+ *  broken: non-zero if you've given up on it
+ */
+void
+dumb_pool_put(struct dumb_pool *p, struct websocket *ws, int broken)
+{
+	struct pool_slot *s = (struct pool_slot *) ws;
+
+	pthread_mutex_lock(&p->lock);
+	if (broken || ws->state != DWS_ST_OPEN) {
+		s->state = SLOT_DEAD;
+		s->retry_at = 0;
+	} else {
+		ws->nonblock = 1;
+		pool_idle(p, s);
+	}
+	pool_poke(p);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * dumb_pool_ready
+ *
+ * How many websockets are connected and waiting to be handed out.
+ */
+size_t
+dumb_pool_ready(struct dumb_pool *p)
+{
+	size_t n;
+
+	pthread_mutex_lock(&p->lock);
+	n = p->idle;
+	pthread_mutex_unlock(&p->lock);
+
+	return n;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DWS_POOL_H
+#define	DWS_POOL_H
+
+#include "dws.h"
+
+/*
+ * A dumb pool keeps `size` websockets to one server connected and
+ * handshaken, so there's always a warm one to hand out. A background thread
+ * keeps an eye on the idle ones (EOF, CLOSE, keepalive PINGs going
+ * unanswered) and reconnects the dead ones, backing off exponentially with
+ * some jitter so a restarted server doesn't get stampeded.
+ *
+ * Needs pthreads, so no Windows for now.
+ */
+struct dumb_pool_config {
+	const char	*host;
+	uint16_t	 port;
+	int		 tls;		/* connect with dumb_connect_tls() */
+	int		 insecure;	/* ...and skip verifying the cert */
+	struct dumb_tls	*tls_ctx;	/* ...or share this config instead */
+	const char	*path;		/* for dumb_handshake() */
+	const char	*proto;
+	struct dumb_sockopts sockopts;	/* for every connect */
+
+	size_t		 size;		/* websockets to keep, 0 means 2 */
+	int		 ping_interval;	/* ms between health checks, 0 never */
+	int		 timeout;	/* ms per connect or handshake, 0 is 10s */
+	int		 backoff_min;	/* ms before the first retry, 0 is 100 */
+	int		 backoff_max;	/* ms to back off at most, 0 is 30s */
+};
+
+struct dumb_pool;
+
+struct dumb_pool *dumb_pool_new(const struct dumb_pool_config *);
+void dumb_pool_free(struct dumb_pool *);
+
+struct websocket *dumb_pool_get(struct dumb_pool *, int);
+void dumb_pool_put(struct dumb_pool *, struct websocket *, int);
+size_t dumb_pool_ready(struct dumb_pool *);
+
+#endif /* DWS_POOL_H */
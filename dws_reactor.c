@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define DWS_EPOLL
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dws_reactor.h"
+
+// Default cap on the size of messages handed to on_message
+#define REACTOR_BUF_SIZE 65536
+
+// How many events we take from epoll_wait(2) at a time
+#define REACTOR_MAX_EVENTS 256
+
+struct reactor_entry {
+	struct websocket	*ws;
+	int			 fd;
+	size_t			 idx;		// position in entries
+	char			*path;
+	char			*proto;
+	void			*arg;
+	struct reactor_entry	*next;		// on the dead list
+};
+
+struct dumb_reactor {
+	struct dumb_reactor_callbacks	 cb;
+
+	struct reactor_entry	**entries;
+	size_t			  nentries;
+	size_t			  cap;
+
+	// Entries we're done with, freed once nothing can be pointing at them
+	struct reactor_entry	 *dead;
+
+	size_t			  buflen;
+
+#ifdef DWS_EPOLL
+	int			  ep;
+	struct epoll_event	  events[REACTOR_MAX_EVENTS];
+#else
+	struct pollfd		 *pfds;
+	size_t			  npfds;
+#endif
+};
+
+/*
+ * dumb_reactor_new
+ *
+ * Make a new, empty reactor.
+ *
+ * Parameters:
+ *  cb: callbacks to fire as things happen (copied)
+ *  buflen: largest message to receive, anything bigger closes the websocket
+ *          with DWS_ERR_TOO_LARGE (0 for the default of 64k)
+ *
+ * Returns:
+ *  a new reactor, or NULL if we ran out of memory or file descriptors
+ */
+struct dumb_reactor *
+dumb_reactor_new(const struct dumb_reactor_callbacks *cb, size_t buflen)
+{
+	struct dumb_reactor *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	if (cb)
+		r->cb = *cb;
+	r->buflen = buflen ? buflen : REACTOR_BUF_SIZE;
+
+#ifdef DWS_EPOLL
+	r->ep = epoll_create1(EPOLL_CLOEXEC);
+	if (r->ep == -1) {
+		free(r);
+		return NULL;
+	}
+#endif
+
+	return r;
+}
+
+static void
+entry_free(struct reactor_entry *e)
+{
+	free(e->path);
+	free(e->proto);
+	free(e);
+}
+
+static void
+reactor_bury(struct dumb_reactor *r)
+{
+	struct reactor_entry *e;
+
+	while ((e = r->dead) != NULL) {
+		r->dead = e->next;
+		entry_free(e);
+	}
+}
+
+/*
+ * dumb_reactor_free
+ *
+ * Tear down the reactor. Any websockets still in it are left alone, so shut
+ * them down first if you care.
+ */
+void
+dumb_reactor_free(struct dumb_reactor *r)
+{
+	size_t i;
+
+	for (i = 0; i < r->nentries; i++)
+		entry_free(r->entries[i]);
+	reactor_bury(r);
+	free(r->entries);
+#ifdef DWS_EPOLL
+	close(r->ep);
+#else
+	free(r->pfds);
+#endif
+	free(r);
+}
+
+/*
+ * dumb_reactor_add
+ *
+ * Hand a connected websocket over to the reactor, which flips it into
+ * non-blocking mode and does the handshake (unless that's already done).
+ * Its max_msg is capped at the reactor's buflen, so anything bigger is
+ * turned down before it's buffered.
+ *
+ * Parameters:
+ *  r: the reactor
+ *  ws: a websocket from dumb_connect() or dumb_connect_tls()
+ *  path: the uri path for the handshake, like "/"
+ *  proto: the websocket protocol for the handshake
+ *  arg: passed along to every callback for this websocket
+ *
+ * Returns:
+ *  0 on success,
+ *  DWS_ERR_MALLOC if we ran out of memory,
+ *  DWS_ERR_INVALID if the websocket isn't connected or epoll(7) said no
+ */
+int
+dumb_reactor_add(struct dumb_reactor *r, struct websocket *ws,
+    const char *path, const char *proto, void *arg)
+{
+	struct reactor_entry *e, **entries;
+	size_t cap;
+#ifdef DWS_EPOLL
+	struct epoll_event ev;
+#endif
+
+	if (ws->s < 0 || ws->state == DWS_ST_CLOSED)
+		return DWS_ERR_INVALID;
+
+	if (r->nentries == r->cap) {
+		cap = r->cap ? r->cap * 2 : 64;
+		entries = realloc(r->entries, cap * sizeof(*entries));
+		if (entries == NULL)
+			return DWS_ERR_MALLOC;
+		r->entries = entries;
+		r->cap = cap;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return DWS_ERR_MALLOC;
+	e->ws = ws;
+	e->fd = ws->s;
+	e->arg = arg;
+	e->path = strdup(path ? path : "/");
+	e->proto = strdup(proto ? proto : "");
+	if (e->path == NULL || e->proto == NULL) {
+		entry_free(e);
+		return DWS_ERR_MALLOC;
+	}
+
+#ifdef DWS_EPOLL
+	// Edge triggered and never modified: we always run a websocket until
+	// it says it wants more, so we'll hear about it when it can go again.
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = e;
+	if (epoll_ctl(r->ep, EPOLL_CTL_ADD, e->fd, &ev) == -1) {
+		entry_free(e);
+		return DWS_ERR_INVALID;
+	}
+#endif
+
+	ws->nonblock = 1;
+	if (ws->max_msg == 0 || ws->max_msg > r->buflen)
+		ws->max_msg = r->buflen;
+	e->idx = r->nentries;
+	r->entries[r->nentries++] = e;
+
+	return 0;
+}
+
+static void
+reactor_drop(struct dumb_reactor *r, struct reactor_entry *e)
+{
+	struct reactor_entry *last;
+
+#ifdef DWS_EPOLL
+	// Fails harmlessly if the websocket already closed its socket.
+	epoll_ctl(r->ep, EPOLL_CTL_DEL, e->fd, NULL);
+#endif
+
+	last = r->entries[--r->nentries];
+	r->entries[e->idx] = last;
+	last->idx = e->idx;
+
+	// We might be in the middle of a batch of events that still points
+	// at this entry, so just mark it dead for now.
+	e->ws = NULL;
+	e->next = r->dead;
+	r->dead = e;
+}
+
+static struct reactor_entry *
+reactor_find(struct dumb_reactor *r, struct websocket *ws)
+{
+	size_t i;
+
+	for (i = 0; i < r->nentries; i++) {
+		if (r->entries[i]->ws == ws)
+			return r->entries[i];
+	}
+	return NULL;
+}
+
+static int
+is_want(ssize_t ret)
+{
+	return ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE;
+}
+
+static void
+reactor_close(struct dumb_reactor *r, struct reactor_entry *e, int reason)
+{
+	struct websocket *ws = e->ws;
+	void *arg = e->arg;
+
+	reactor_drop(r, e);
+	if (r->cb.on_close)
+		r->cb.on_close(ws, reason, arg);
+}
+
+/*
+ * dumb_reactor_remove
+ *
+ * Take a websocket back out of the reactor without closing it. It stays in
+ * non-blocking mode.
+ *
+ * Returns:
+ *  0 on success,
+ *  DWS_ERR_INVALID if the websocket isn't in this reactor
+ */
+int
+dumb_reactor_remove(struct dumb_reactor *r, struct websocket *ws)
+{
+	struct reactor_entry *e;
+
+	e = reactor_find(r, ws);
+	if (e == NULL)
+		return DWS_ERR_INVALID;
+
+	reactor_drop(r, e);
+	return 0;
+}
+
+/*
+ * dumb_reactor_close
+ *
+ * Start closing a websocket in the reactor. Use this rather than calling
+ * dumb_close() yourself: if the server answers right away there'd be nothing
+ * left for the reactor to wait on. on_close fires once it's done.
+ *
+ * Returns:
+ *  0 if the close is done or under way,
+ *  DWS_ERR_INVALID if the websocket isn't in this reactor,
+ *  or whatever dumb_close() failed with (on_close fires with it too).
+ */
+int
+dumb_reactor_close(struct dumb_reactor *r, struct websocket *ws)
+{
+	struct reactor_entry *e;
+	int ret;
+
+	e = reactor_find(r, ws);
+	if (e == NULL)
+		return DWS_ERR_INVALID;
+
+	ret = dumb_close(ws);
+	if (is_want(ret))
+		return 0;
+
+	reactor_close(r, e, ret);
+	return ret;
+}
+
+/*
+ * dumb_reactor_count
+ *
+ * How many websockets the reactor is driving.
+ */
+size_t
+dumb_reactor_count(struct dumb_reactor *r)
+{
+	return r->nentries;
+}
+
+/*
+ * Run a websocket as far as it'll go: finish the handshake, push out queued
+ * frames and hand out every message that's arrived.
+ */
+static void
+reactor_step(struct dumb_reactor *r, struct reactor_entry *e)
+{
+	struct websocket *ws = e->ws;
+	struct dumb_msg msg;
+	unsigned long pongs;
+	ssize_t len;
+	int ret;
+
+	if (ws->state < DWS_ST_OPEN) {
+		ret = dumb_handshake(ws, e->path, e->proto);
+		if (is_want(ret))
+			return;
+		else if (ret) {
+			reactor_close(r, e, ret);
+			return;
+		}
+		if (r->cb.on_open)
+			r->cb.on_open(ws, e->arg);
+		// The callback might have done something drastic.
+		if (e->ws == NULL || ws->state != DWS_ST_OPEN)
+			return;
+	}
+
+	ret = dumb_flush(ws);
+	if (ret && !is_want(ret)) {
+		reactor_close(r, e, ret);
+		return;
+	}
+
+	for (;;) {
+		pongs = ws->pongs;
+		// Messages are handed out right where they sit, no copying.
+		len = dumb_recv_view(ws, &msg);
+
+		if (ws->pongs != pongs && r->cb.on_pong)
+			r->cb.on_pong(ws, e->arg);
+
+		// Anything over buflen is DWS_ERR_TOO_LARGE, thanks to max_msg.
+		if (len >= 0) {
+			if (r->cb.on_message)
+				r->cb.on_message(ws, msg.data, msg.len, e->arg);
+		} else if (is_want(len)) {
+			break;
+		} else if (len == DWS_SHUTDOWN) {
+			// Either the server closed on us or answered our CLOSE.
+			reactor_close(r, e, DWS_OK);
+			return;
+		} else {
+			reactor_close(r, e, (int) len);
+			return;
+		}
+
+		// Callbacks are allowed to close or remove the websocket.
+		if (e->ws == NULL || ws->state == DWS_ST_CLOSED)
+			return;
+	}
+}
+
+/*
+ * dumb_reactor_run
+ *
+ * Wait up to timeout ms (-1 for forever) for something to happen, then deal
+ * with it. Call it in a loop. Websockets with a ping_interval get their
+ * keepalives sent on time, which may cut the wait short.
+ *
+ * Returns:
+ *  the number of websockets we did something with,
+ *  DWS_ERR_READ if waiting failed.
+ */
+int
+dumb_reactor_run(struct dumb_reactor *r, int timeout)
+{
+	struct reactor_entry *e;
+	size_t k;
+	int n, ms;
+
+	// Send any keepalives that are due and don't sleep past the next one.
+	for (k = 0; k < r->nentries; ) {
+		e = r->entries[k];
+		if (e->ws->ping_interval > 0 && dumb_next_timeout(e->ws) == 0) {
+			reactor_step(r, e);
+			// Dropped, and the last one swapped into this slot.
+			if (e->ws == NULL)
+				continue;
+		}
+		ms = dumb_next_timeout(e->ws);
+		if (ms >= 0 && (timeout < 0 || ms < timeout))
+			timeout = ms;
+		k++;
+	}
+#ifdef DWS_EPOLL
+	int i;
+
+	n = epoll_wait(r->ep, r->events, REACTOR_MAX_EVENTS, timeout);
+	if (n == -1)
+		return errno == EINTR ? 0 : DWS_ERR_READ;
+
+	for (i = 0; i < n; i++) {
+		e = r->events[i].data.ptr;
+		if (e->ws != NULL)
+			reactor_step(r, e);
+	}
+#else
+	struct pollfd *pfds;
+	size_t j, count;
+	int events;
+
+	if (r->npfds < r->nentries) {
+		pfds = realloc(r->pfds, r->cap * sizeof(*pfds));
+		if (pfds == NULL)
+			return DWS_ERR_MALLOC;
+		r->pfds = pfds;
+		r->npfds = r->cap;
+	}
+
+	count = r->nentries;
+	for (j = 0; j < count; j++) {
+		events = dumb_events(r->entries[j]->ws);
+		if (r->entries[j]->ws->state < DWS_ST_HANDSHAKE)
+			events |= DWS_POLLOUT;
+		r->pfds[j].fd = r->entries[j]->fd;
+		r->pfds[j].events = 0;
+		r->pfds[j].revents = 0;
+		if (events & DWS_POLLIN)
+			r->pfds[j].events |= POLLIN;
+		if (events & DWS_POLLOUT)
+			r->pfds[j].events |= POLLOUT;
+	}
+
+	n = poll(r->pfds, (nfds_t) count, timeout);
+	if (n == -1)
+		return errno == EINTR ? 0 : DWS_ERR_READ;
+
+	// Entries shuffle around as websockets close, so one may have moved
+	// into a slot we polled for another. Skip any whose fd isn't the one
+	// we polled; they'll get their turn next time around.
+	for (j = 0; j < count && j < r->nentries; j++) {
+		e = r->entries[j];
+		if (r->pfds[j].revents == 0 || r->pfds[j].fd != e->fd)
+			continue;
+		reactor_step(r, e);
+	}
+#endif
+
+	reactor_bury(r);
+	return n;
+}
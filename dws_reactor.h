@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DWS_REACTOR_H
+#define	DWS_REACTOR_H
+
+#include "dws.h"
+
+/*
+ * A dumb reactor drives a pile of non-blocking websockets from one thread:
+ * epoll(7) on Linux, plain poll(2) everywhere else. You still send and ping
+ * with the usual dumb_* calls (close with dumb_reactor_close()); the reactor
+ * just does the waiting and tells you what happened through these callbacks.
+ *
+ * Any callback may be NULL. `arg` is whatever you handed dumb_reactor_add().
+ */
+struct dumb_reactor_callbacks {
+	/* Handshake finished, the websocket is ready to use. */
+	void (*on_open)(struct websocket *ws, void *arg);
+
+	/* A message arrived. buf is only valid during the callback. */
+	void (*on_message)(struct websocket *ws, const void *buf, size_t len,
+	    void *arg);
+
+	/*
+	 * The PONG for a dumb_ping() or a keepalive (see ws->ping_interval)
+	 * showed up. For a keepalive, ws->rtt and friends are up to date.
+	 */
+	void (*on_pong)(struct websocket *ws, void *arg);
+
+	/*
+	 * The websocket is done for and no longer in the reactor: reason is
+	 * DWS_OK for a clean close, otherwise the error that killed it.
+	 */
+	void (*on_close)(struct websocket *ws, int reason, void *arg);
+};
+
+struct dumb_reactor;
+
+struct dumb_reactor *dumb_reactor_new(const struct dumb_reactor_callbacks *,
+    size_t);
+void dumb_reactor_free(struct dumb_reactor *);
+
+int dumb_reactor_add(struct dumb_reactor *, struct websocket *, const char*,
+    const char*, void*);
+int dumb_reactor_remove(struct dumb_reactor *, struct websocket *);
+int dumb_reactor_close(struct dumb_reactor *, struct websocket *);
+int dumb_reactor_run(struct dumb_reactor *, int);
+size_t dumb_reactor_count(struct dumb_reactor *);
+
+#endif /* DWS_REACTOR_H */
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dws_resolver.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+#define RESOLVER_THREADS	1
+#define RESOLVER_TTL		60000
+#define RESOLVER_NEG_TTL	5000
+#define RESOLVER_HOSTS		64
+
+// Same as dumb_connect() bothers with.
+#define RESOLVER_ADDRS		16
+
+enum entry_state {
+	ENTRY_QUEUED,	// waiting for a thread
+	ENTRY_BUSY,	// a thread's looking it up
+	ENTRY_DONE,
+	ENTRY_FAILED,	// no such host, for now
+};
+
+struct resolver_entry {
+	char			*host;		// NULL if the entry's free
+	enum entry_state	 state;
+	struct dumb_addr	 addrs[RESOLVER_ADDRS];
+	size_t			 naddrs;
+	uint64_t		 expires;	// ms, on resolver_now()'s clock
+	uint64_t		 used;		// ms, for picking who to evict
+};
+
+struct dumb_resolver {
+	struct dumb_resolver_config	 cfg;
+
+	struct resolver_entry	*entries;
+	size_t			 nentries;
+
+	pthread_t		*threads;
+	size_t			 nthreads;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 work;		// an entry got queued
+	int			 done[2];	// a lookup finished
+	int			 stop;
+};
+
+static uint64_t
+resolver_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/*
+ * The default lookup: plain old getaddrinfo(3), just not on your thread.
+ */
+static int
+resolver_getaddrinfo(void *arg, const char *host, struct dumb_addr *out,
+    size_t max, int *ttl)
+{
+	struct addrinfo hints, *res, *ai;
+	size_t n = 0;
+
+	(void) arg;
+	(void) ttl;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(host, NULL, &hints, &res))
+		return -1;
+
+	for (ai = res; ai != NULL && n < max; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(out[n].ss))
+			continue;
+		memset(&out[n], 0, sizeof(out[n]));
+		memcpy(&out[n].ss, ai->ai_addr, ai->ai_addrlen);
+		out[n].len = (socklen_t) ai->ai_addrlen;
+		n++;
+	}
+	freeaddrinfo(res);
+
+	return n > 0 ? (int) n : -1;
+}
+
+static struct resolver_entry *
+resolver_find(struct dumb_resolver *r, const char *host)
+{
+	size_t i;
+
+	for (i = 0; i < r->nentries; i++)
+		if (r->entries[i].host && strcmp(r->entries[i].host, host) == 0)
+			return &r->entries[i];
+	return NULL;
+}
+
+/*
+ * Find room for another host: a free entry, or else the least recently
+ * used one that isn't in the middle of a lookup.
+ */
+static struct resolver_entry *
+resolver_slot(struct dumb_resolver *r)
+{
+	struct resolver_entry *e, *lru = NULL;
+	size_t i;
+
+	for (i = 0; i < r->nentries; i++) {
+		e = &r->entries[i];
+		if (e->host == NULL)
+			return e;
+		if (e->state != ENTRY_DONE && e->state != ENTRY_FAILED)
+			continue;
+		if (lru == NULL || e->used < lru->used)
+			lru = e;
+	}
+
+	if (lru != NULL) {
+		free(lru->host);
+		lru->host = NULL;
+	}
+	return lru;
+}
+
+/*
+ * A resolver thread: look up whatever's queued until told to stop.
+ */
+static void *
+resolver_run(void *arg)
+{
+	struct dumb_resolver *r = arg;
+	struct resolver_entry *e;
+	struct dumb_addr addrs[RESOLVER_ADDRS];
+	size_t i;
+	ssize_t wrote;
+	int n, ttl;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop) {
+		e = NULL;
+		for (i = 0; i < r->nentries && e == NULL; i++)
+			if (r->entries[i].host
+			    && r->entries[i].state == ENTRY_QUEUED)
+				e = &r->entries[i];
+		if (e == NULL) {
+			pthread_cond_wait(&r->work, &r->lock);
+			continue;
+		}
+
+		// Busy entries never get evicted, so e->host stays put.
+		e->state = ENTRY_BUSY;
+		pthread_mutex_unlock(&r->lock);
+		ttl = -1;
+		n = r->cfg.lookup(r->cfg.lookup_arg, e->host, addrs,
+		    RESOLVER_ADDRS, &ttl);
+		pthread_mutex_lock(&r->lock);
+
+		if (n > 0) {
+			e->naddrs = (size_t) n;
+			memcpy(e->addrs, addrs, e->naddrs * sizeof(addrs[0]));
+			e->state = ENTRY_DONE;
+			if (ttl < 0)
+				ttl = r->cfg.ttl;
+		} else {
+			e->naddrs = 0;
+			e->state = ENTRY_FAILED;
+			if (ttl < 0)
+				ttl = r->cfg.neg_ttl;
+		}
+		e->expires = resolver_now() + (uint64_t) ttl;
+
+		// If the pipe's full there are plenty of wakeups in it already.
+		wrote = write(r->done[1], "", 1);
+		(void) wrote;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/*
+ * dumb_resolver_new
+ *
+ * Make a resolver and start its threads.
+ *
+ * Parameters:
+ *  cfg: how to resolve and how long to remember (copied), or NULL
+ *
+ * Returns:
+ *  a new resolver, or NULL if we ran out of memory, pipes or threads
+ */
+struct dumb_resolver *
+dumb_resolver_new(const struct dumb_resolver_config *cfg)
+{
+	struct dumb_resolver *r;
+	size_t i;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	if (cfg != NULL)
+		r->cfg = *cfg;
+	if (r->cfg.threads <= 0)
+		r->cfg.threads = RESOLVER_THREADS;
+	if (r->cfg.ttl <= 0)
+		r->cfg.ttl = RESOLVER_TTL;
+	if (r->cfg.neg_ttl <= 0)
+		r->cfg.neg_ttl = RESOLVER_NEG_TTL;
+	if (r->cfg.max_hosts == 0)
+		r->cfg.max_hosts = RESOLVER_HOSTS;
+	if (r->cfg.lookup == NULL)
+		r->cfg.lookup = resolver_getaddrinfo;
+
+	r->nentries = r->cfg.max_hosts;
+	r->entries = calloc(r->nentries, sizeof(*r->entries));
+	r->threads = calloc((size_t) r->cfg.threads, sizeof(*r->threads));
+	r->done[0] = r->done[1] = -1;
+	if (r->entries == NULL || r->threads == NULL)
+		goto fail;
+
+	if (pipe(r->done) == -1) {
+		r->done[0] = r->done[1] = -1;
+		goto fail;
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(r->done[i], F_SETFL, O_NONBLOCK) == -1
+		    || fcntl(r->done[i], F_SETFD, FD_CLOEXEC) == -1)
+			goto fail;
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->work, NULL);
+	for (i = 0; i < (size_t) r->cfg.threads; i++) {
+		if (pthread_create(&r->threads[i], NULL, resolver_run, r))
+			break;
+		r->nthreads++;
+	}
+	if (r->nthreads == 0) {
+		pthread_cond_destroy(&r->work);
+		pthread_mutex_destroy(&r->lock);
+		goto fail;
+	}
+
+	return r;
+
+fail:
+	if (r->done[0] != -1) {
+		close(r->done[0]);
+		close(r->done[1]);
+	}
+	free(r->threads);
+	free(r->entries);
+	free(r);
+	return NULL;
+}
+
+/*
+ * dumb_resolver_free
+ *
+ * Stop the resolver threads and forget everything. A thread in the middle
+ * of a lookup gets to finish it first, so this can take a while.
+ */
+void
+dumb_resolver_free(struct dumb_resolver *r)
+{
+	size_t i;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	for (i = 0; i < r->nthreads; i++)
+		pthread_join(r->threads[i], NULL);
+
+	for (i = 0; i < r->nentries; i++)
+		free(r->entries[i].host);
+
+	pthread_cond_destroy(&r->work);
+	pthread_mutex_destroy(&r->lock);
+	close(r->done[0]);
+	close(r->done[1]);
+	free(r->threads);
+	free(r->entries);
+	free(r);
+}
+
+/*
+ * dumb_resolve
+ *
+ * Look a host up in the cache, queueing a lookup if it's not there or its
+ * answer is past its TTL. Never blocks on the lookup itself, so it's fine
+ * to call from a game loop. Call it with max 0 to get a lookup going early.
+ *
+ * The arguments line up with a websocket's resolve hook, so the resolver
+ * goes in as a void pointer.
+ *
+ * Parameters:
+ *  arg: the dumb_resolver
+ *  host: hostname or ip address
+ *  port: tcp port to put in the addresses
+ *  out: where to put the addresses
+ *  max: how many fit in out
+ *
+ * Returns:
+ *  how many addresses went in out,
+ *  DWS_WANT_RESOLVE if the lookup hasn't finished yet,
+ *  DWS_ERR_CONN_RESOLVE if there's no such host,
+ *  DWS_ERR_MALLOC if we ran out of memory.
+ */
+int
+dumb_resolve(void *arg, const char *host, uint16_t port,
+    struct dumb_addr *out, size_t max)
+{
+	struct dumb_resolver *r = arg;
+	struct resolver_entry *e;
+	uint64_t now;
+	size_t i, n;
+	char junk[64];
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	while (read(r->done[0], junk, sizeof(junk)) > 0)
+		;
+
+	now = resolver_now();
+	e = resolver_find(r, host);
+	if (e == NULL) {
+		e = resolver_slot(r);
+		if (e == NULL) {
+			// Every entry's mid-lookup, try again in a bit.
+			pthread_mutex_unlock(&r->lock);
+			return DWS_WANT_RESOLVE;
+		}
+		e->host = strdup(host);
+		if (e->host == NULL) {
+			pthread_mutex_unlock(&r->lock);
+			return DWS_ERR_MALLOC;
+		}
+		e->state = ENTRY_QUEUED;
+		pthread_cond_signal(&r->work);
+	} else if ((e->state == ENTRY_DONE || e->state == ENTRY_FAILED)
+	    && now >= e->expires) {
+		e->state = ENTRY_QUEUED;
+		pthread_cond_signal(&r->work);
+	}
+	e->used = now;
+
+	switch (e->state) {
+	case ENTRY_DONE:
+		n = MIN(e->naddrs, max);
+		for (i = 0; i < n; i++) {
+			out[i] = e->addrs[i];
+			if (out[i].ss.ss_family == AF_INET)
+				((struct sockaddr_in *) &out[i].ss)->sin_port
+				    = htons(port);
+			else if (out[i].ss.ss_family == AF_INET6)
+				((struct sockaddr_in6 *) &out[i].ss)->sin6_port
+				    = htons(port);
+		}
+		ret = (int) n;
+		break;
+	case ENTRY_FAILED:
+		ret = DWS_ERR_CONN_RESOLVE;
+		break;
+	default:
+		ret = DWS_WANT_RESOLVE;
+		break;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return ret;
+}
+
+/*
+ * dumb_resolver_fd
+ *
+ * A descriptor that turns readable when a lookup finishes, to poll(2) on
+ * alongside your websockets. dumb_resolve() reads it empty again.
+ */
+int
+dumb_resolver_fd(struct dumb_resolver *r)
+{
+	return r->done[0];
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DWS_RESOLVER_H
+#define	DWS_RESOLVER_H
+
+#include "dws.h"
+
+/*
+ * A dumb resolver does lookups on threads of its own and caches the
+ * answers, so dumb_connect() never has to sit in getaddrinfo(3). Hook it
+ * up by setting a websocket's resolve to dumb_resolve and resolve_arg to
+ * the resolver, then call dumb_connect() until it stops saying
+ * DWS_WANT_RESOLVE (dumb_resolver_fd() turns readable when it's worth it).
+ *
+ * getaddrinfo(3) won't tell us the real TTLs, so its answers are kept for
+ * ttl ms. A lookup function of your own can say otherwise per answer.
+ *
+ * Needs pthreads, so no Windows for now.
+ */
+struct dumb_resolver_config {
+	int		 threads;	/* lookups at once, 0 means 1 */
+	int		 ttl;		/* ms to keep answers, 0 is 60s */
+	int		 neg_ttl;	/* ms to remember failures, 0 is 5s */
+	size_t		 max_hosts;	/* hosts to cache, 0 is 64 */
+
+	/*
+	 * How to look a host up, or NULL for getaddrinfo(3). Called on a
+	 * resolver thread with lookup_arg, it fills in at most max addresses
+	 * (the port doesn't matter) and returns how many, or -1 if there's no
+	 * such host. It may set *ttl to how many ms the answer's good for.
+	 */
+	int		(*lookup)(void *, const char *, struct dumb_addr *,
+			    size_t, int *);
+	void		*lookup_arg;
+};
+
+struct dumb_resolver;
+
+struct dumb_resolver *dumb_resolver_new(const struct dumb_resolver_config *);
+void dumb_resolver_free(struct dumb_resolver *);
+
+int dumb_resolve(void *, const char *, uint16_t, struct dumb_addr *, size_t);
+int dumb_resolver_fd(struct dumb_resolver *);
+
+#endif /* DWS_RESOLVER_H */
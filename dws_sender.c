@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dws_sender.h"
+
+#define SENDER_QUEUE_LEN	1024
+#define SENDER_SLOT_SIZE	256
+#define SENDER_BATCH		64
+
+// Times a blocked producer yields before it goes to sleep.
+#define SENDER_SPINS		64
+
+// How long the sender thread waits on the socket before looking again.
+#define SENDER_POLL_MS		100
+
+#define CACHE_LINE		64
+
+/*
+ * The queue is a bounded ring after Dmitry Vyukov's: each slot's seq says
+ * whose turn it is. seq == pos means it's free for the producer that claims
+ * pos, seq == pos + 1 means it's full for whoever dequeues pos. Producers
+ * claim with a CAS on tail, the sender thread (and, when dropping the
+ * oldest, producers) with a CAS on head.
+ */
+struct sender_slot {
+	size_t			 seq;
+	size_t			 len;
+	uint8_t			*big;	// malloc'd if it didn't fit inline
+};
+
+struct dumb_sender {
+	struct websocket	*ws;
+	struct dumb_sender_config cfg;
+	int			 nonblock;	// to put back afterwards
+
+	struct sender_slot	*slots;
+	uint8_t			*data;		// slot_size bytes per slot
+	size_t			 mask;
+
+	// Keep the two ends from fighting over a cache line.
+	char			 pad0[CACHE_LINE];
+	size_t			 tail;
+	char			 pad1[CACHE_LINE];
+	size_t			 head;
+	char			 pad2[CACHE_LINE];
+
+	pthread_t		 thread;
+	pthread_mutex_t		 io;		// around the websocket
+	pthread_mutex_t		 lock;		// for sleeping on the conds
+	pthread_cond_t		 work;		// something got queued
+	pthread_cond_t		 room;		// something got sent
+	int			 sleeping;	// sender thread's waiting on work
+	int			 waiters;	// producers waiting on room
+	int			 stop;
+	int			 error;		// the websocket's broken
+	unsigned long		 dropped;
+};
+
+static uint8_t *
+sender_payload(struct dumb_sender *s, struct sender_slot *slot, size_t pos)
+{
+	if (slot->big)
+		return slot->big;
+	return s->data + (pos & s->mask) * s->cfg.slot_size;
+}
+
+/*
+ * Queue a message, which is either copied into the slot or, if it's too
+ * big for that, already copied into big.
+ *
+ * Returns 1 if it's queued, 0 if the queue's full.
+ */
+static int
+sender_push(struct dumb_sender *s, const void *buf, size_t len, uint8_t *big)
+{
+	struct sender_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &s->slots[pos & s->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&s->tail, &pos, pos + 1,
+			    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+	}
+
+	slot->len = len;
+	slot->big = big;
+	if (big == NULL && len > 0)
+		memcpy(sender_payload(s, slot, pos), buf, len);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/*
+ * Claim the oldest message in the queue. It's ours until sender_release().
+ *
+ * Returns its slot, with its position in *posp, or NULL if it's empty.
+ */
+static struct sender_slot *
+sender_pop(struct dumb_sender *s, size_t *posp)
+{
+	struct sender_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &s->slots[pos & s->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&s->head, &pos, pos + 1,
+			    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+	}
+
+	*posp = pos;
+	return slot;
+}
+
+static void
+sender_release(struct dumb_sender *s, struct sender_slot *slot, size_t pos)
+{
+	free(slot->big);
+	slot->big = NULL;
+	__atomic_store_n(&slot->seq, pos + s->mask + 1, __ATOMIC_RELEASE);
+}
+
+static int
+sender_full(struct dumb_sender *s)
+{
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&s->tail, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&s->slots[pos & s->mask].seq, __ATOMIC_SEQ_CST);
+	return (intptr_t) seq - (intptr_t) pos < 0;
+}
+
+static int
+sender_empty(struct dumb_sender *s)
+{
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&s->head, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&s->slots[pos & s->mask].seq, __ATOMIC_SEQ_CST);
+	return (intptr_t) seq - (intptr_t) (pos + 1) < 0;
+}
+
+/*
+ * Wake whoever's asleep on cond, if anyone says they are. Both sides
+ * announce themselves before their last look at the queue, so one of us
+ * is bound to notice the other.
+ */
+static void
+sender_wake(struct dumb_sender *s, int *asleep, pthread_cond_t *cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(asleep, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Write a batch and wait until it's all out, even if the websocket's high
+ * watermark turns it away at first. Runs on the sender thread, only holding
+ * the websocket's lock while actually touching it.
+ */
+static int
+sender_write(struct dumb_sender *s, const struct iovec *iov, int n)
+{
+	struct websocket *ws = s->ws;
+	struct pollfd pfd;
+	ssize_t sz;
+	int ret, events;
+
+	pthread_mutex_lock(&s->io);
+	sz = dumb_send_batch(ws, iov, n);
+	ret = sz < 0 ? (int) sz : dumb_flush(ws);
+	while (ret == DWS_WANT_WRITE || ret == DWS_WANT_POLL) {
+		events = dumb_events(ws);
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = dumb_fd(ws);
+		if (events & DWS_POLLIN)
+			pfd.events |= POLLIN;
+		if (events & DWS_POLLOUT)
+			pfd.events |= POLLOUT;
+
+		// Let dumb_sender_recv() in while we wait.
+		pthread_mutex_unlock(&s->io);
+		poll(&pfd, 1, SENDER_POLL_MS);
+		pthread_mutex_lock(&s->io);
+		ret = dumb_flush(ws);
+
+		// Turned away over the high watermark, so it's not queued
+		// yet: now there's room, have another go.
+		if (ret == 0 && sz < 0) {
+			sz = dumb_send_batch(ws, iov, n);
+			ret = sz < 0 ? (int) sz : dumb_flush(ws);
+		}
+	}
+	pthread_mutex_unlock(&s->io);
+
+	return ret;
+}
+
+/*
+ * The sender thread: dequeue a batch, write it, repeat, and sleep when
+ * there's nothing to do. Once told to stop it keeps going until the queue
+ * is empty so nothing queued gets lost.
+ */
+static void *
+sender_run(void *arg)
+{
+	struct dumb_sender *s = arg;
+	struct sender_slot **claimed;
+	struct iovec *iov;
+	size_t *pos;
+	int i, n, ret;
+
+	claimed = calloc((size_t) s->cfg.batch, sizeof(*claimed));
+	iov = calloc((size_t) s->cfg.batch, sizeof(*iov));
+	pos = calloc((size_t) s->cfg.batch, sizeof(*pos));
+	if (claimed == NULL || iov == NULL || pos == NULL) {
+		// Nothing gets popped, so this goes straight to bed.
+		__atomic_store_n(&s->error, DWS_ERR_MALLOC, __ATOMIC_SEQ_CST);
+	}
+
+	for (;;) {
+		n = 0;
+		while (claimed && iov && pos && n < s->cfg.batch
+		    && (claimed[n] = sender_pop(s, &pos[n])) != NULL) {
+			iov[n].iov_base = sender_payload(s, claimed[n], pos[n]);
+			iov[n].iov_len = claimed[n]->len;
+			n++;
+		}
+
+		if (n == 0) {
+			pthread_mutex_lock(&s->lock);
+			__atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (s->stop || __atomic_load_n(&s->error,
+			    __ATOMIC_SEQ_CST)) {
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+			if (sender_empty(s))
+				pthread_cond_wait(&s->work, &s->lock);
+			__atomic_store_n(&s->sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+
+		// Once it's broken, the rest just gets thrown away.
+		ret = __atomic_load_n(&s->error, __ATOMIC_SEQ_CST);
+		if (ret == 0 && (ret = sender_write(s, iov, n)) != 0)
+			__atomic_store_n(&s->error, ret, __ATOMIC_SEQ_CST);
+
+		for (i = 0; i < n; i++)
+			sender_release(s, claimed[i], pos[i]);
+		sender_wake(s, &s->waiters, &s->room);
+	}
+
+	// Nobody's getting anything sent anymore, so let them know.
+	pthread_mutex_lock(&s->lock);
+	pthread_cond_broadcast(&s->room);
+	pthread_mutex_unlock(&s->lock);
+
+	free(claimed);
+	free(iov);
+	free(pos);
+	return NULL;
+}
+
+/*
+ * dumb_sender_new
+ *
+ * Give a websocket a sender thread. The websocket should be connected and
+ * handshaken, and gets switched to non-blocking mode until
+ * dumb_sender_free().
+ *
+ * Parameters:
+ *  ws: a pointer to a connected dumb websocket
+ *  cfg: how big a queue and what to do when it's full, or NULL
+ *
+ * Returns:
+ *  a new sender, or NULL if we ran out of memory or threads
+ */
+struct dumb_sender *
+dumb_sender_new(struct websocket *ws, const struct dumb_sender_config *cfg)
+{
+	struct dumb_sender *s;
+	size_t i, len;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+
+	if (cfg != NULL)
+		s->cfg = *cfg;
+	if (s->cfg.queue_len == 0)
+		s->cfg.queue_len = SENDER_QUEUE_LEN;
+	if (s->cfg.slot_size == 0)
+		s->cfg.slot_size = SENDER_SLOT_SIZE;
+	if (s->cfg.batch <= 0)
+		s->cfg.batch = SENDER_BATCH;
+
+	for (len = 2; len < s->cfg.queue_len; len *= 2)
+		;
+	s->cfg.queue_len = len;
+	s->mask = len - 1;
+
+	// Leave something in a full queue for DWS_SENDER_DROP_OLDEST to drop,
+	// or it waits on the socket along with the sender thread.
+	if ((size_t) s->cfg.batch >= len)
+		s->cfg.batch = (int) (len - 1);
+
+	s->slots = calloc(len, sizeof(*s->slots));
+	s->data = calloc(len, s->cfg.slot_size);
+	if (s->slots == NULL || s->data == NULL)
+		goto fail;
+	for (i = 0; i < len; i++)
+		s->slots[i].seq = i;
+
+	s->ws = ws;
+	s->nonblock = ws->nonblock;
+	ws->nonblock = 1;
+
+	pthread_mutex_init(&s->io, NULL);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->work, NULL);
+	pthread_cond_init(&s->room, NULL);
+	if (pthread_create(&s->thread, NULL, sender_run, s)) {
+		pthread_cond_destroy(&s->room);
+		pthread_cond_destroy(&s->work);
+		pthread_mutex_destroy(&s->lock);
+		pthread_mutex_destroy(&s->io);
+		ws->nonblock = s->nonblock;
+		goto fail;
+	}
+
+	return s;
+
+fail:
+	free(s->slots);
+	free(s->data);
+	free(s);
+	return NULL;
+}
+
+/*
+ * dumb_sender_free
+ *
+ * Send whatever's still queued, stop the sender thread and hand the
+ * websocket back, in whatever blocking mode it was in before. Don't
+ * dumb_sender_send() while this is going on.
+ */
+void
+dumb_sender_free(struct dumb_sender *s)
+{
+	struct sender_slot *slot;
+	size_t pos;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	// Only left over if the websocket broke.
+	while ((slot = sender_pop(s, &pos)) != NULL)
+		sender_release(s, slot, pos);
+
+	s->ws->nonblock = s->nonblock;
+
+	pthread_cond_destroy(&s->room);
+	pthread_cond_destroy(&s->work);
+	pthread_mutex_destroy(&s->lock);
+	pthread_mutex_destroy(&s->io);
+	free(s->slots);
+	free(s->data);
+	free(s);
+}
+
+/*
+ * dumb_sender_send
+ *
+ * Queue a binary message for the sender thread. Safe to call from as many
+ * threads at once as you like; the payload is copied, so it's yours again
+ * as soon as this returns. Messages from one thread go out in order.
+ *
+ * Parameters:
+ *  s: the sender
+ *  buf: the payload
+ *  len: how long it is
+ *
+ * Returns:
+ *  0 once it's queued,
+ *  DWS_ERR_FULL if the queue's full and the policy is DWS_SENDER_FAIL,
+ *  DWS_ERR_MALLOC if it's too big to queue inline and malloc(3) failed,
+ *  or whatever error broke the websocket, after which nothing more goes.
+ */
+int
+dumb_sender_send(struct dumb_sender *s, const void *buf, size_t len)
+{
+	struct sender_slot *slot;
+	uint8_t *big = NULL;
+	size_t pos;
+	int ret, spins = 0;
+
+	ret = __atomic_load_n(&s->error, __ATOMIC_RELAXED);
+	if (ret)
+		return ret;
+
+	if (len > s->cfg.slot_size) {
+		big = malloc(len);
+		if (big == NULL)
+			return DWS_ERR_MALLOC;
+		memcpy(big, buf, len);
+	}
+
+	while (!sender_push(s, buf, len, big)) {
+		ret = __atomic_load_n(&s->error, __ATOMIC_RELAXED);
+		if (ret) {
+			free(big);
+			return ret;
+		}
+
+		switch (s->cfg.policy) {
+		case DWS_SENDER_FAIL:
+			free(big);
+			return DWS_ERR_FULL;
+		case DWS_SENDER_DROP_OLDEST:
+			slot = sender_pop(s, &pos);
+			if (slot != NULL) {
+				sender_release(s, slot, pos);
+				__atomic_add_fetch(&s->dropped, 1,
+				    __ATOMIC_RELAXED);
+			} else {
+				// The lot's on its way out, so it won't be long.
+				sched_yield();
+			}
+			break;
+		default:
+			if (spins++ < SENDER_SPINS) {
+				sched_yield();
+				break;
+			}
+			pthread_mutex_lock(&s->lock);
+			__atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+			if (sender_full(s) && !__atomic_load_n(&s->error,
+			    __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&s->room, &s->lock);
+			__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+	}
+
+	sender_wake(s, &s->sleeping, &s->work);
+	return 0;
+}
+
+/*
+ * dumb_sender_recv
+ *
+ * dumb_recv() for a websocket that has a sender, which is non-blocking for
+ * now, so expect DWS_WANT_POLL and poll dumb_fd() yourself.
+ */
+ssize_t
+dumb_sender_recv(struct dumb_sender *s, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&s->io);
+	ret = dumb_recv(s->ws, buf, len);
+	pthread_mutex_unlock(&s->io);
+
+	return ret;
+}
+
+/*
+ * dumb_sender_dropped
+ *
+ * How many messages DWS_SENDER_DROP_OLDEST has thrown away so far.
+ */
+unsigned long
+dumb_sender_dropped(struct dumb_sender *s)
+{
+	return __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DWS_SENDER_H
+#define	DWS_SENDER_H
+
+#include "dws.h"
+
+/*
+ * A dumb sender gives a websocket a thread of its own to do the sending,
+ * so any number of threads can dumb_sender_send() at once without a lock
+ * between them or waiting on the socket. Messages go through a lock-free
+ * queue and the sender thread frames and writes them in batches.
+ *
+ * Once a websocket has a sender, the sender owns it: receive through
+ * dumb_sender_recv() (it may have PINGs to answer) and leave the rest alone
+ * until dumb_sender_free().
+ *
+ * Needs pthreads, so no Windows for now.
+ */
+
+/* What dumb_sender_send() does when the queue's full. */
+#define DWS_SENDER_BLOCK	0	/* wait for room */
+#define DWS_SENDER_DROP_OLDEST	1	/* make room, goodbye oldest message */
+#define DWS_SENDER_FAIL		2	/* give up with DWS_ERR_FULL */
+
+struct dumb_sender_config {
+	size_t		 queue_len;	/* messages, 0 is 1024 (power of 2) */
+	size_t		 slot_size;	/* bytes kept in the queue, 0 is 256 */
+	int		 policy;	/* DWS_SENDER_* */
+	int		 batch;		/* messages per write, 0 is 64 (< queue_len) */
+};
+
+struct dumb_sender;
+
+struct dumb_sender *dumb_sender_new(struct websocket *,
+    const struct dumb_sender_config *);
+void dumb_sender_free(struct dumb_sender *);
+
+int dumb_sender_send(struct dumb_sender *, const void *, size_t);
+ssize_t dumb_sender_recv(struct dumb_sender *, void *, size_t);
+unsigned long dumb_sender_dropped(struct dumb_sender *);
+
+#endif /* DWS_SENDER_H */
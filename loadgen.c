@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2020 Dave Voutila <voutilad@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A dumb load generator. Drives a bunch of websockets at an echo server
+ * from one thread, either ping-ponging one message at a time or keeping a
+ * window of them in flight, and reports throughput and round trip times
+ * as text, JSON (a line per run) or CSV.
+ *
+ * Without -p it forks an echo server of its own first, so there's always
+ * something to run against; bench.sh takes care of the go, nodejs and rust
+ * ones.
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dws.h"
+
+#define FMT_TEXT	0
+#define FMT_JSON	1
+#define FMT_CSV		2
+
+// Give up if nothing at all happens for this long.
+#define STALL_MS	10000
+
+struct conn {
+	struct websocket	 ws;
+	long			 sent;
+	long			 recvd;
+	double			*stamps;	/* send times, window slots */
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * The echo server: a poll(2) loop in a child process that accepts with
+ * dumb_accept() and replies to every message with "You said: " and the
+ * payload, like the go server does.
+ *
+ * Replies to everything that came in with one read go back out in one
+ * dumb_send_batch(), so a pipelining client costs a write per window
+ * rather than per message.
+ */
+#define ECHO_BATCH	64
+
+struct echo_batch {
+	uint8_t		*buf;
+	size_t		 len;
+	size_t		 cap;
+	struct iovec	 iov[ECHO_BATCH];
+	int		 n;
+};
+
+static int
+echo_flush(struct websocket *ws, struct echo_batch *b)
+{
+	ssize_t n = 0;
+	int i;
+
+	if (b->n > 0) {
+		// The buffer may have moved since, so point at it now.
+		for (i = 0; i < b->n; i++)
+			b->iov[i].iov_base = b->buf + (size_t) b->iov[i].iov_base;
+		n = dumb_send_batch(ws, b->iov, b->n);
+	}
+	b->n = 0;
+	b->len = 0;
+	return n < 0 ? (int) n : 0;
+}
+
+static int
+echo_add(struct websocket *ws, struct echo_batch *b, const struct dumb_msg *m)
+{
+	static const char said[] = "You said: ";
+	size_t len = sizeof(said) - 1 + m->len, cap;
+	uint8_t *p;
+	int ret;
+
+	if (b->n == ECHO_BATCH && (ret = echo_flush(ws, b)) != 0)
+		return ret;
+	if (b->cap - b->len < len) {
+		for (cap = b->cap ? b->cap : 65536; cap - b->len < len; cap *= 2)
+			;
+		p = realloc(b->buf, cap);
+		if (p == NULL)
+			return DWS_ERR_MALLOC;
+		b->buf = p;
+		b->cap = cap;
+	}
+
+	memcpy(b->buf + b->len, said, sizeof(said) - 1);
+	memcpy(b->buf + b->len + sizeof(said) - 1, m->data, m->len);
+	// An offset for now, see echo_flush().
+	b->iov[b->n].iov_base = (void *) b->len;
+	b->iov[b->n].iov_len = len;
+	b->n++;
+	b->len += len;
+	return 0;
+}
+
+static void
+echo_server(int l)
+{
+	struct websocket **peers, *ws;
+	struct pollfd *pfds;
+	struct dumb_msg msg;
+	struct echo_batch batch;
+	size_t npeers = 0, cap = 64, i;
+	ssize_t n;
+	int fd, ev, ret;
+
+	peers = calloc(cap, sizeof(*peers));
+	pfds = calloc(cap + 1, sizeof(*pfds));
+	if (peers == NULL || pfds == NULL)
+		_exit(1);
+	memset(&batch, 0, sizeof(batch));
+
+	for (;;) {
+		pfds[0].fd = l;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < npeers; i++) {
+			ev = dumb_events(peers[i]);
+			pfds[i + 1].fd = dumb_fd(peers[i]);
+			pfds[i + 1].events = (short) (((ev & DWS_POLLIN)
+			    ? POLLIN : 0) | ((ev & DWS_POLLOUT) ? POLLOUT : 0));
+		}
+		if (poll(pfds, npeers + 1, -1) == -1 && errno != EINTR)
+			_exit(1);
+
+		for (i = 0; i < npeers; i++) {
+			ws = peers[i];
+			if (pfds[i + 1].revents == 0)
+				continue;
+
+			ret = 0;
+			if (pfds[i + 1].revents & POLLOUT)
+				ret = dumb_flush(ws);
+			if (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE)
+				ret = 0;
+
+			if (ret == 0 && ws->state != DWS_ST_OPEN) {
+				ret = dumb_accept(ws, -1, "dumb-ws");
+				if (ret == DWS_WANT_POLL || ret == DWS_WANT_WRITE)
+					continue;
+			}
+
+			while (ret == 0) {
+				n = dumb_recv_view(ws, &msg);
+				if (n == DWS_WANT_POLL || n == DWS_WANT_WRITE)
+					break;
+				if (n < 0) {
+					ret = (int) n;
+					break;
+				}
+				if (msg.opcode == BINARY)
+					ret = echo_add(ws, &batch, &msg);
+			}
+			if (echo_flush(ws, &batch) != 0)
+				ret = -1;
+
+			if (ret != 0) {
+				dumb_free(ws);
+				free(ws);
+				peers[i] = NULL;
+			}
+		}
+
+		// Squeeze out the dead before taking on anyone new.
+		for (i = 0; i < npeers; ) {
+			if (peers[i] == NULL)
+				peers[i] = peers[--npeers];
+			else
+				i++;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			fd = accept(l, NULL, NULL);
+			if (fd < 0)
+				continue;
+			if (npeers == cap) {
+				cap *= 2;
+				peers = realloc(peers, cap * sizeof(*peers));
+				pfds = realloc(pfds, (cap + 1) * sizeof(*pfds));
+				if (peers == NULL || pfds == NULL)
+					_exit(1);
+			}
+			ws = calloc(1, sizeof(*ws));
+			if (ws == NULL)
+				_exit(1);
+			ws->nonblock = 1;
+			ret = dumb_accept(ws, fd, "dumb-ws");
+			if (ret != DWS_WANT_POLL && ret != 0) {
+				dumb_free(ws);
+				free(ws);
+				continue;
+			}
+			peers[npeers++] = ws;
+		}
+	}
+}
+
+/*
+ * Fork the echo server on a loopback port of its own, returning the port.
+ */
+static uint16_t
+echo_start(pid_t *pid)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	int l, on = 1;
+
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	if (l < 0)
+		return 0;
+	setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+	if (bind(l, (struct sockaddr *) &sin, sizeof(sin))
+	    || listen(l, 1024)
+	    || getsockname(l, (struct sockaddr *) &sin, &len))
+		return 0;
+
+	*pid = fork();
+	if (*pid == 0)
+		echo_server(l);
+	close(l);
+	return *pid > 0 ? ntohs(sin.sin_port) : 0;
+}
+
+/*
+ * Take in whatever replies the connection has for us, timing each against
+ * the send it answers. Echo servers answer in order, so the oldest stamp
+ * in the window is always the right one.
+ */
+static int
+drain_replies(struct conn *c, long window, size_t size, uint8_t *buf,
+    double *lat, long *nlat, long *errors)
+{
+	ssize_t len;
+
+	for (;;) {
+		len = dumb_recv(&c->ws, buf, size + 64);
+		if (len == DWS_WANT_POLL || len == DWS_WANT_WRITE)
+			return 0;
+		if (len < 0)
+			return (int) len;
+
+		// The rust server echoes as is, the rest say "You said: " first.
+		if (len != (ssize_t) size && len != (ssize_t) size + 10)
+			(*errors)++;
+		lat[(*nlat)++] = now() - c->stamps[c->recvd % window];
+		c->recvd++;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct conn *c;
+	struct pollfd *pfds;
+	struct rlimit rl;
+	const char *host = "localhost", *label = NULL, *pattern;
+	uint8_t *msg, *buf;
+	double *lat, start, secs, last;
+	long n = 1000, conns = 1, window = 1, i, nlat = 0, done = 0;
+	long errors = 0, total;
+	size_t size = 64;
+	uint16_t port = 0;
+	pid_t server = -1;
+	int ch, fmt = FMT_TEXT, use_tls = 0, ret, ev;
+
+	while ((ch = getopt(argc, argv, "c:f:Hh:l:n:p:s:tw:")) != -1) {
+		switch (ch) {
+		case 'c':
+			conns = atol(optarg);
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				fmt = FMT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				fmt = FMT_CSV;
+			else
+				fmt = FMT_TEXT;
+			break;
+		case 'H':
+			// Just the CSV header, for the top of a results file.
+			printf("server,tls,pattern,window,conns,size,msgs,errors,"
+			    "secs,msg_s,mb_s,p50_us,p90_us,p99_us,p999_us,"
+			    "max_us\n");
+			return 0;
+		case 'h':
+			host = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 'p':
+			port = (uint16_t) atoi(optarg);
+			break;
+		case 's':
+			size = (size_t) atol(optarg);
+			break;
+		case 't':
+			use_tls = 1;
+			break;
+		case 'w':
+			window = atol(optarg);
+			break;
+		default:
+			printf("loadgen usage: [-t] [-h host] [-p port] "
+			    "[-c conns] [-n msgs per conn]\n"
+			    "               [-s size] [-w window] "
+			    "[-f text | json | csv] [-H] [-l label]\n");
+			exit(1);
+		}
+	}
+
+	if (n < 1 || conns < 1 || window < 1) {
+		printf("-c, -n and -w need to be at least 1\n");
+		exit(1);
+	}
+	pattern = window == 1 ? "pingpong" : "pipeline";
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (port == 0) {
+		if (use_tls) {
+			printf("the built-in echo server doesn't do TLS\n");
+			exit(1);
+		}
+		port = echo_start(&server);
+		if (port == 0) {
+			printf("can't start the echo server\n");
+			exit(1);
+		}
+		host = "127.0.0.1";
+		if (label == NULL)
+			label = "c";
+	}
+	if (label == NULL)
+		label = host;
+
+	// Lots of connections need lots of descriptors.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	total = n * conns;
+	c = calloc((size_t) conns, sizeof(*c));
+	pfds = calloc((size_t) conns, sizeof(*pfds));
+	lat = calloc((size_t) total, sizeof(*lat));
+	msg = malloc(size);
+	buf = malloc(size + 64);
+	if (c == NULL || pfds == NULL || lat == NULL || msg == NULL
+	    || buf == NULL) {
+		printf("out of memory\n");
+		exit(1);
+	}
+	memset(msg, 'L', size);
+
+	for (i = 0; i < conns; i++) {
+		c[i].stamps = calloc((size_t) window, sizeof(double));
+		if (c[i].stamps == NULL) {
+			printf("out of memory\n");
+			exit(1);
+		}
+		if (use_tls)
+			ret = dumb_connect_tls(&c[i].ws, host, port, 1);
+		else
+			ret = dumb_connect(&c[i].ws, host, port);
+		if (ret == 0)
+			ret = dumb_handshake(&c[i].ws, "/", "dumb-ws");
+		if (ret) {
+			printf("connect failed after %ld connections (%d)\n", i,
+			    ret);
+			exit(1);
+		}
+		c[i].ws.nonblock = 1;
+	}
+
+	start = last = now();
+	while (done < conns) {
+		// Top up every connection's window.
+		for (i = 0; i < conns; i++) {
+			while (c[i].sent - c[i].recvd < window && c[i].sent < n) {
+				// Stamp it first; the echo can beat us back.
+				c[i].stamps[c[i].sent % window] = now();
+				ret = (int) dumb_send(&c[i].ws, msg, size);
+				if (ret < 0) {
+					printf("send failed (%d)\n", ret);
+					exit(1);
+				}
+				c[i].sent++;
+			}
+		}
+
+		for (i = 0; i < conns; i++) {
+			pfds[i].fd = dumb_fd(&c[i].ws);
+			pfds[i].events = 0;
+			ev = c[i].recvd < n ? dumb_events(&c[i].ws) : 0;
+			if (ev & DWS_POLLIN)
+				pfds[i].events |= POLLIN;
+			if (ev & DWS_POLLOUT)
+				pfds[i].events |= POLLOUT;
+		}
+		ret = poll(pfds, (nfds_t) conns, 100);
+		if (ret == -1 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		if (ret <= 0) {
+			if (now() - last > STALL_MS / 1000.0) {
+				printf("stalled with %ld of %ld replies\n", nlat,
+				    total);
+				exit(1);
+			}
+			continue;
+		}
+		last = now();
+
+		for (i = 0; i < conns; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+			if (pfds[i].revents & POLLOUT) {
+				ret = dumb_flush(&c[i].ws);
+				if (ret && ret != DWS_WANT_WRITE
+				    && ret != DWS_WANT_POLL) {
+					printf("flush failed (%d)\n", ret);
+					exit(1);
+				}
+			}
+			ret = drain_replies(&c[i], window, size, buf, lat, &nlat,
+			    &errors);
+			if (ret) {
+				printf("recv failed (%d)\n", ret);
+				exit(1);
+			}
+			if (c[i].recvd == n)
+				done++;
+		}
+	}
+	secs = now() - start;
+
+	for (i = 0; i < conns; i++) {
+		c[i].ws.nonblock = 0;
+		dumb_close(&c[i].ws);
+		dumb_free(&c[i].ws);
+		free(c[i].stamps);
+	}
+
+	qsort(lat, (size_t) nlat, sizeof(*lat), cmp_double);
+#define PCT(p)	(lat[(long) ((double) (nlat - 1) * (p))] * 1e6)
+	switch (fmt) {
+	case FMT_JSON:
+		printf("{\"server\": \"%s\", \"tls\": %d, \"pattern\": \"%s\", "
+		    "\"window\": %ld, \"conns\": %ld, \"size\": %zu, "
+		    "\"msgs\": %ld, \"errors\": %ld, \"secs\": %.3f, "
+		    "\"msg_s\": %.0f, \"mb_s\": %.2f, \"p50_us\": %.1f, "
+		    "\"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+		    "\"max_us\": %.1f}\n", label, use_tls, pattern, window,
+		    conns, size, nlat, errors, secs, (double) nlat / secs,
+		    (double) nlat * (double) size / secs / 1e6, PCT(0.5),
+		    PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+		break;
+	case FMT_CSV:
+		printf("%s,%d,%s,%ld,%ld,%zu,%ld,%ld,%.3f,%.0f,%.2f,%.1f,%.1f,"
+		    "%.1f,%.1f,%.1f\n", label, use_tls, pattern, window, conns,
+		    size, nlat, errors, secs, (double) nlat / secs,
+		    (double) nlat * (double) size / secs / 1e6, PCT(0.5),
+		    PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+		break;
+	default:
+		printf("%-8s %-4s %-8s w%-3ld %5ld conns %7zu B %10.0f msg/s "
+		    "%8.1f MB/s  p50 %8.1f us  p99 %8.1f us%s\n", label,
+		    use_tls ? "tls" : "", pattern, window, conns, size,
+		    (double) nlat / secs,
+		    (double) nlat * (double) size / secs / 1e6, PCT(0.5),
+		    PCT(0.99), errors ? "  (bad replies!)" : "");
+	}
+
+	if (server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+	free(c);
+	free(pfds);
+	free(lat);
+	free(msg);
+	free(buf);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Exercises the dumb resolver against a stand-in lookup function, so it
+ * doesn't need DNS (or a network) to run.
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dws.h"
+#include "dws_resolver.h"
+
+/*
+ * Our pretend DNS. ttl is in ms, -1 for the resolver's default.
+ */
+static struct {
+	const char	*host;
+	const char	*ip;
+	int		 ttl;
+	int		 delay;		/* ms the lookup takes */
+	int		 lookups;
+} hosts[] = {
+	{ "game.test",	"127.0.0.1",	-1,	0,	0 },
+	{ "slow.test",	"127.0.0.1",	-1,	300,	0 },
+	{ "short.test",	"127.0.0.1",	50,	0,	0 },
+	{ "nx.test",	NULL,		-1,	0,	0 },
+	{ "v6.test",	"::1",		-1,	0,	0 },
+};
+#define NHOSTS (sizeof(hosts) / sizeof(hosts[0]))
+
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+fake_lookup(void *arg, const char *host, struct dumb_addr *out, size_t max,
+    int *ttl)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	size_t i;
+	int delay = 0, found = -1;
+
+	(void) arg;
+	assert(max > 0);
+
+	pthread_mutex_lock(&hosts_lock);
+	for (i = 0; i < NHOSTS; i++) {
+		if (strcmp(hosts[i].host, host) == 0) {
+			hosts[i].lookups++;
+			delay = hosts[i].delay;
+			found = (int) i;
+		}
+	}
+	pthread_mutex_unlock(&hosts_lock);
+
+	if (delay)
+		usleep((useconds_t) delay * 1000);
+	if (found == -1 || hosts[found].ip == NULL)
+		return -1;
+
+	memset(out, 0, sizeof(*out));
+	if (strchr(hosts[found].ip, ':')) {
+		sin6 = (struct sockaddr_in6 *) &out->ss;
+		sin6->sin6_family = AF_INET6;
+		assert(inet_pton(AF_INET6, hosts[found].ip,
+		    &sin6->sin6_addr) == 1);
+		out->len = sizeof(*sin6);
+	} else {
+		sin = (struct sockaddr_in *) &out->ss;
+		sin->sin_family = AF_INET;
+		assert(inet_pton(AF_INET, hosts[found].ip,
+		    &sin->sin_addr) == 1);
+		out->len = sizeof(*sin);
+	}
+	if (hosts[found].ttl >= 0)
+		*ttl = hosts[found].ttl;
+	return 1;
+}
+
+static int
+lookups(const char *host)
+{
+	size_t i;
+	int n = 0;
+
+	pthread_mutex_lock(&hosts_lock);
+	for (i = 0; i < NHOSTS; i++)
+		if (strcmp(hosts[i].host, host) == 0)
+			n = hosts[i].lookups;
+	pthread_mutex_unlock(&hosts_lock);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * Keep asking until the lookup's done, like a game loop would.
+ */
+static int
+resolve_wait(struct dumb_resolver *r, const char *host, uint16_t port,
+    struct dumb_addr *out, size_t max)
+{
+	struct pollfd pfd;
+	int ret;
+
+	for (;;) {
+		ret = dumb_resolve(r, host, port, out, max);
+		if (ret != DWS_WANT_RESOLVE)
+			break;
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = dumb_resolver_fd(r);
+		pfd.events = POLLIN;
+		assert(poll(&pfd, 1, 5000) == 1);
+	}
+	return ret;
+}
+
+int
+main(void)
+{
+	struct dumb_resolver_config cfg;
+	struct dumb_resolver *r;
+	struct dumb_addr addrs[4];
+	struct sockaddr_in sin;
+	struct websocket ws;
+	socklen_t len;
+	double start;
+	int s, c;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.threads = 2;
+	cfg.neg_ttl = 10000;
+	cfg.lookup = fake_lookup;
+	r = dumb_resolver_new(&cfg);
+	assert(r != NULL);
+
+	// First time around it has to go look, then it remembers.
+	assert(dumb_resolve(r, "game.test", 80, addrs, 4)
+	    == DWS_WANT_RESOLVE);
+	assert(resolve_wait(r, "game.test", 80, addrs, 4) == 1);
+	assert(addrs[0].ss.ss_family == AF_INET);
+	assert(ntohs(((struct sockaddr_in *) &addrs[0].ss)->sin_port) == 80);
+	assert(dumb_resolve(r, "game.test", 443, addrs, 4) == 1);
+	assert(ntohs(((struct sockaddr_in *) &addrs[0].ss)->sin_port) == 443);
+	assert(lookups("game.test") == 1);
+	printf("cached a lookup\n");
+
+	// A slow lookup mustn't hold us up.
+	start = now();
+	assert(dumb_resolve(r, "slow.test", 80, addrs, 4)
+	    == DWS_WANT_RESOLVE);
+	assert(dumb_resolve(r, "game.test", 80, addrs, 4) == 1);
+	assert(now() - start < 0.1);
+	assert(resolve_wait(r, "slow.test", 80, addrs, 4) == 1);
+	printf("slow lookup took %.0fms without blocking\n",
+	    (now() - start) * 1e3);
+
+	// Failures get remembered too.
+	assert(resolve_wait(r, "nx.test", 80, addrs, 4)
+	    == DWS_ERR_CONN_RESOLVE);
+	assert(dumb_resolve(r, "nx.test", 80, addrs, 4)
+	    == DWS_ERR_CONN_RESOLVE);
+	assert(lookups("nx.test") == 1);
+	printf("cached a failure\n");
+
+	// Past its TTL, an answer gets looked up again.
+	assert(resolve_wait(r, "short.test", 80, addrs, 4) == 1);
+	usleep(100 * 1000);
+	assert(dumb_resolve(r, "short.test", 80, addrs, 4)
+	    == DWS_WANT_RESOLVE);
+	assert(resolve_wait(r, "short.test", 80, addrs, 4) == 1);
+	assert(lookups("short.test") == 2);
+	printf("refreshed an expired answer\n");
+
+	assert(resolve_wait(r, "v6.test", 8080, addrs, 4) == 1);
+	assert(addrs[0].ss.ss_family == AF_INET6);
+	assert(ntohs(((struct sockaddr_in6 *) &addrs[0].ss)->sin6_port)
+	    == 8080);
+
+	// Now have dumb_connect() use it, against a listener of our own.
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert(s >= 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(s, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	assert(listen(s, 4) == 0);
+	len = sizeof(sin);
+	assert(getsockname(s, (struct sockaddr *) &sin, &len) == 0);
+
+	memset(&ws, 0, sizeof(ws));
+	ws.resolve = dumb_resolve;
+	ws.resolve_arg = r;
+	assert(dumb_connect(&ws, "nx.test", ntohs(sin.sin_port))
+	    == DWS_ERR_CONN_RESOLVE);
+	assert(dumb_connect(&ws, "game.test", ntohs(sin.sin_port)) == 0);
+	c = accept(s, NULL, NULL);
+	assert(c >= 0);
+	close(c);
+	assert(dumb_reconnect(&ws) == 0);
+	c = accept(s, NULL, NULL);
+	assert(c >= 0);
+	close(c);
+	assert(lookups("game.test") == 1);
+	dumb_free(&ws);
+	close(s);
+	printf("connected and reconnected with one lookup\n");
+
+	dumb_resolver_free(r);
+
+	// A tiny cache has to make room by dropping the stalest host.
+	cfg.max_hosts = 2;
+	r = dumb_resolver_new(&cfg);
+	assert(r != NULL);
+	assert(resolve_wait(r, "game.test", 80, addrs, 4) == 1);
+	usleep(5 * 1000);
+	assert(resolve_wait(r, "v6.test", 80, addrs, 4) == 1);
+	usleep(5 * 1000);
+	assert(resolve_wait(r, "slow.test", 80, addrs, 4) == 1);
+	assert(dumb_resolve(r, "v6.test", 80, addrs, 4) == 1);
+	assert(dumb_resolve(r, "game.test", 80, addrs, 4)
+	    == DWS_WANT_RESOLVE);
+	assert(resolve_wait(r, "game.test", 80, addrs, 4) == 1);
+	dumb_resolver_free(r);
+	printf("evicted the least recently used host\n");
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,803 @@
+/*
+ * Plays both sides: dumb_connect() clients against dumb_accept() servers
+ * over loopback, all in one thread with non-blocking websockets (bar the
+ * dumb_sender's own), plus a few hand-rolled clients that don't play by
+ * the rules.
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dws.h"
+#include "dws_pool.h"
+#include "dws_sender.h"
+
+#ifdef DWS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
+// Sender messages are numbered, padded out to this.
+#define SENDER_MSG	100
+
+static int listener;
+static uint16_t port;
+
+static void
+listen_local(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	int qlen = 8;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listener >= 0);
+#ifdef TCP_FASTOPEN
+	// Only counts if the sysctl lets servers do it, but doesn't hurt.
+	setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#endif
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	assert(bind(listener, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	assert(listen(listener, 8) == 0);
+	len = sizeof(sin);
+	assert(getsockname(listener, (struct sockaddr *) &sin, &len) == 0);
+	port = ntohs(sin.sin_port);
+}
+
+/*
+ * Connect a client, accept it and handshake both ends at once. If there's
+ * an early message, the client sends it before the handshake starts.
+ */
+static void
+pair(struct websocket *cli, struct websocket *srv, const char *early)
+{
+	int fd = -1, c = 1, s = 1;
+
+	memset(srv, 0, sizeof(*srv));
+	cli->nonblock = srv->nonblock = 1;
+
+	assert(dumb_connect(cli, "127.0.0.1", port) == 0);
+	if (early != NULL) {
+		assert(dumb_send(cli, early, strlen(early))
+		    == (ssize_t) strlen(early) + 6);
+		assert(dumb_queued(cli) == strlen(early) + 6);
+		assert((dumb_events(cli) & DWS_POLLOUT) == 0);
+	}
+
+	while (c || s) {
+		if (c) {
+			c = dumb_handshake(cli, "/", "dumb-ws");
+			assert(c == 0 || c == DWS_WANT_POLL
+			    || c == DWS_WANT_WRITE);
+		}
+		// Not before then, since a Fast Open connect waits for data.
+		if (fd == -1) {
+			fd = accept(listener, NULL, NULL);
+			assert(fd >= 0);
+		}
+		if (s) {
+			s = dumb_accept(srv, fd, "dumb-ws");
+			assert(s == 0 || s == DWS_WANT_POLL
+			    || s == DWS_WANT_WRITE);
+		}
+	}
+	assert(srv->server && !cli->server);
+	assert(strcmp(cli->proto, "dumb-ws") == 0);
+	assert(strcmp(srv->proto, "dumb-ws") == 0);
+}
+
+#ifdef DWS_WITH_ZLIB
+/*
+ * Write text to fd as a compressed, unmasked TEXT frame, the way a server
+ * keeping its context between messages would.
+ */
+static void
+send_deflated(int fd, z_stream *zs, const char *text)
+{
+	uint8_t frame[128];
+	size_t len;
+
+	zs->next_in = (Bytef *) text;
+	zs->avail_in = (uInt) strlen(text);
+	zs->next_out = frame + 2;
+	zs->avail_out = sizeof(frame) - 2;
+	assert(deflate(zs, Z_SYNC_FLUSH) == Z_OK && zs->avail_in == 0);
+	// Minus the 00 00 ff ff the receiver puts back.
+	len = sizeof(frame) - 2 - zs->avail_out - 4;
+	assert(len < 126);
+	frame[0] = 0xc1;
+	frame[1] = (uint8_t) len;
+	assert(write(fd, frame, len + 2) == (ssize_t) len + 2);
+}
+#endif
+
+#ifdef TCP_CORK
+static int
+corked(struct websocket *ws)
+{
+	socklen_t len = sizeof(int);
+	int on = 0;
+
+	assert(getsockopt(dumb_fd(ws), IPPROTO_TCP, TCP_CORK, &on, &len) == 0);
+	return on;
+}
+#endif
+
+static ssize_t
+recv_wait(struct websocket *ws, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while ((n = dumb_recv(ws, buf, len)) == DWS_WANT_POLL)
+		;
+	return n;
+}
+
+/*
+ * Pair a client up with a sender, squeezing both ends' socket buffers and
+ * setting a high watermark so the sender has to wait on the socket long
+ * before the kernel's taken it all. With a backlog, messages get sent
+ * straight away until there's more queued than the kernel would ever take,
+ * so the sender's first batches are turned away; *backlog says how many.
+ */
+static struct dumb_sender *
+sender_pair(struct websocket *cli, struct websocket *srv, size_t queue_len,
+    int policy, uint32_t *backlog)
+{
+	struct dumb_sender_config cfg;
+	struct dumb_sender *sender;
+	uint8_t msg[SENDER_MSG];
+	ssize_t n;
+	int small = 16384;
+
+	memset(cli, 0, sizeof(*cli));
+	pair(cli, srv, NULL);
+	assert(setsockopt(dumb_fd(cli), SOL_SOCKET, SO_SNDBUF, &small,
+	    sizeof(small)) == 0);
+	assert(setsockopt(dumb_fd(srv), SOL_SOCKET, SO_RCVBUF, &small,
+	    sizeof(small)) == 0);
+
+	if (backlog != NULL) {
+		memset(msg, 0, sizeof(msg));
+		for (*backlog = 0; dumb_queued(cli) < 64 * 1024; (*backlog)++) {
+			memcpy(msg, backlog, sizeof(*backlog));
+			n = dumb_send(cli, msg, sizeof(msg));
+			assert(n == SENDER_MSG + 6);
+		}
+	}
+	cli->high_water = 4 * SENDER_MSG;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.queue_len = queue_len;
+	cfg.policy = policy;
+	sender = dumb_sender_new(cli, &cfg);
+	assert(sender != NULL);
+	return sender;
+}
+
+static int
+sender_send(struct dumb_sender *sender, uint32_t seq)
+{
+	uint8_t msg[SENDER_MSG];
+
+	memset(msg, 0, sizeof(msg));
+	memcpy(msg, &seq, sizeof(seq));
+	return dumb_sender_send(sender, msg, sizeof(msg));
+}
+
+/*
+ * Receive a sender message, returning its number.
+ */
+static uint32_t
+sender_recv(struct websocket *srv)
+{
+	struct pollfd pfd;
+	uint8_t msg[SENDER_MSG];
+	uint32_t seq;
+	ssize_t n;
+
+	while ((n = dumb_recv(srv, msg, sizeof(msg))) == DWS_WANT_POLL) {
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = dumb_fd(srv);
+		pfd.events = POLLIN;
+		assert(poll(&pfd, 1, 5000) == 1);
+	}
+	assert(n == sizeof(msg));
+	memcpy(&seq, msg, sizeof(seq));
+	return seq;
+}
+
+/*
+ * Connect without any help, send req and accept the connection, returning
+ * our end with the server's in *fd.
+ */
+static int
+raw_request(const char *req, int *fd)
+{
+	struct sockaddr_in sin;
+	int s;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert(s >= 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	assert(connect(s, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	*fd = accept(listener, NULL, NULL);
+	assert(*fd >= 0);
+	assert(write(s, req, strlen(req)) == (ssize_t) strlen(req));
+	return s;
+}
+
+/*
+ * Read whatever the server said, NUL terminated.
+ */
+static void
+raw_response(int s, char *buf, size_t len)
+{
+	ssize_t n;
+
+	n = read(s, buf, len - 1);
+	assert(n > 0);
+	buf[n] = '\0';
+}
+
+/*
+ * Connect a client (cleared, or set up, by the caller) and answer its
+ * upgrade by hand with res, where "%s" is the accept key it's expecting,
+ * step bytes at a time so the headers come in over several reads. Returns
+ * what dumb_handshake() finally said, with our end in *fd.
+ */
+static int
+fake_upgrade(struct websocket *cli, const char *res, size_t step, int *fd)
+{
+	char buf[8192];
+	size_t len, off;
+	int ret;
+
+	cli->nonblock = 1;
+	assert(dumb_connect(cli, "127.0.0.1", port) == 0);
+	*fd = accept(listener, NULL, NULL);
+	assert(*fd >= 0);
+	while ((ret = dumb_handshake(cli, "/", "chat, dumb-ws"))
+	    == DWS_WANT_WRITE)
+		;
+	assert(ret == DWS_WANT_POLL);
+	raw_response(*fd, buf, sizeof(buf));
+
+	len = (size_t) snprintf(buf, sizeof(buf), res, cli->accept);
+	for (off = 0; off < len; off += step) {
+		step = MIN(step, len - off);
+		assert(write(*fd, buf + off, step) == (ssize_t) step);
+		if (ret == DWS_WANT_POLL)
+			ret = dumb_handshake(cli, "/", "chat, dumb-ws");
+	}
+	while (ret == DWS_WANT_POLL)
+		ret = dumb_handshake(cli, "/", "chat, dumb-ws");
+	return ret;
+}
+
+int
+main(void)
+{
+	static const char req[] =
+	    "GET /chat HTTP/1.1\r\n"
+	    "Host: server.example.com\r\n"
+	    "Upgrade: websocket\r\n"
+	    "Connection: keep-alive, Upgrade\r\n"
+	    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	    "Sec-WebSocket-Protocol: chat, dumb-ws\r\n"
+	    "Sec-WebSocket-Version: 13\r\n\r\n";
+	static const char no[] = "HTTP/1.1 403 Forbidden\r\n\r\n";
+	static const uint8_t unmasked[] = { 0x82, 0x02, 'h', 'i' };
+	static const uint8_t interleaved[] = {
+		0x01, 0x02, 'h', 0xe2, 0x82, 0x02, 'h', 'i',
+	};
+	static const uint8_t rsv2[] = { 0xa2, 0x02, 'h', 'i' };
+	static const uint8_t long_close[4 + 126] = { 0x88, 0x7e, 0x00, 0x7e };
+	static const uint8_t *bad[] = { interleaved, rsv2, long_close };
+	static const size_t bad_len[] = {
+		sizeof(interleaved), sizeof(rsv2), sizeof(long_close),
+	};
+	struct websocket cli, srv, cli2, srv2, raw, *lent;
+	struct dumb_bcast *b;
+	struct dumb_pool_config pcfg;
+	struct dumb_pool *pool;
+	struct dumb_sender *sender;
+	struct dumb_msg msg;
+	char buf[1024], big[4096];
+	uint8_t peek[2];
+	size_t i, left;
+	ssize_t n;
+	uint32_t seq, got;
+	int ret;
+#ifdef DWS_WITH_ZLIB
+	z_stream zs;
+#endif
+	int s, fd;
+
+	listen_local();
+
+	// The example from RFC 6455 sec. 1.3, protocol and all.
+	s = raw_request(req, &fd);
+	memset(&raw, 0, sizeof(raw));
+	assert(dumb_accept(&raw, fd, "dumb-ws") == 0);
+	raw_response(s, buf, sizeof(buf));
+	assert(strncmp(buf, "HTTP/1.1 101 ", 13) == 0);
+	assert(strstr(buf, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+	    != NULL);
+	assert(strstr(buf, "Sec-WebSocket-Protocol: dumb-ws\r\n") != NULL);
+
+	// Clients have to mask.
+	assert(write(s, unmasked, sizeof(unmasked)) == sizeof(unmasked));
+	assert(dumb_recv(&raw, buf, sizeof(buf)) == DWS_ERR_INVALID);
+	dumb_free(&raw);
+	close(s);
+	printf("answered the RFC's example, turned away an unmasked frame\n");
+
+	// Anything that's not an upgrade gets a 400.
+	s = raw_request("GET / HTTP/1.1\r\nHost: x\r\n\r\n", &fd);
+	memset(&raw, 0, sizeof(raw));
+	assert(dumb_accept(&raw, fd, NULL) == DWS_ERR_HANDSHAKE_RES);
+	raw_response(s, buf, sizeof(buf));
+	assert(strncmp(buf, "HTTP/1.1 400 ", 13) == 0);
+	dumb_free(&raw);
+	close(s);
+	printf("said no to a plain GET\n");
+
+	// Both ways, masked one way and not the other.
+	memset(&cli, 0, sizeof(cli));
+	pair(&cli, &srv, NULL);
+	assert(dumb_send(&cli, "hello", 5) == 5 + 6);
+	assert(recv_wait(&srv, buf, sizeof(buf)) == 5);
+	assert(memcmp(buf, "hello", 5) == 0);
+	assert(dumb_send(&srv, "hi back", 7) == 7 + 2);
+	assert(recv(dumb_fd(&cli), peek, sizeof(peek), MSG_PEEK) == 2);
+	assert((peek[1] & 0x80) == 0);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 7);
+	assert(memcmp(buf, "hi back", 7) == 0);
+	printf("echoed both ways\n");
+
+	// One frame, two websockets.
+	memset(&cli2, 0, sizeof(cli2));
+	pair(&cli2, &srv2, NULL);
+	b = dumb_bcast_new("everyone", 8);
+	assert(b != NULL);
+	assert(dumb_bcast_send(&srv, b) == 8 + 2);
+	assert(dumb_bcast_send(&srv2, b) == 8 + 2);
+	assert(dumb_bcast_send(&cli, b) == DWS_ERR_INVALID);
+	dumb_bcast_unref(b);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 8);
+	assert(memcmp(buf, "everyone", 8) == 0);
+	assert(recv_wait(&cli2, buf, sizeof(buf)) == 8);
+	assert(memcmp(buf, "everyone", 8) == 0);
+	printf("broadcast to two\n");
+
+	// The server answers a CLOSE, so the client's dumb_close() finishes.
+	assert(dumb_close(&cli) == DWS_WANT_POLL);
+	assert(recv_wait(&srv, buf, sizeof(buf)) == DWS_SHUTDOWN);
+	while ((s = dumb_close(&cli)) == DWS_WANT_POLL)
+		;
+	assert(s == 0);
+	printf("closed politely\n");
+
+	dumb_free(&cli);
+	dumb_free(&srv);
+	dumb_free(&cli2);
+	dumb_free(&srv2);
+
+	// Sent before the handshake, out right after the 101. Fast Open if
+	// the kernel's up for it, a plain connect if not.
+	memset(&cli, 0, sizeof(cli));
+	cli.sockopts.fast_open = 1;
+	pair(&cli, &srv, "early");
+	assert(recv_wait(&srv, buf, sizeof(buf)) == 5);
+	assert(memcmp(buf, "early", 5) == 0);
+	dumb_free(&cli);
+	dumb_free(&srv);
+	printf("sent early, got there after the 101\n");
+
+	// No 101, so the early message never leaves.
+	memset(&cli, 0, sizeof(cli));
+	cli.nonblock = 1;
+	assert(dumb_connect(&cli, "127.0.0.1", port) == 0);
+	assert(dumb_send(&cli, "early", 5) == 5 + 6);
+	fd = accept(listener, NULL, NULL);
+	assert(fd >= 0);
+	while ((s = dumb_handshake(&cli, "/", "dumb-ws")) == DWS_WANT_WRITE)
+		;
+	assert(s == DWS_WANT_POLL);
+	raw_response(fd, buf, sizeof(buf));
+	assert(strcmp(buf + strlen(buf) - 4, "\r\n\r\n") == 0);
+	assert(write(fd, no, sizeof(no) - 1) == sizeof(no) - 1);
+	while ((s = dumb_handshake(&cli, "/", "dumb-ws")) == DWS_WANT_POLL)
+		;
+	assert(s == DWS_ERR_HANDSHAKE_RES);
+	assert(cli.state == DWS_ST_CLOSED);
+	assert(dumb_queued(&cli) == 0);
+	assert(recv(fd, buf, sizeof(buf), MSG_DONTWAIT) == 0);
+	dumb_free(&cli);
+	close(fd);
+	printf("threw out the early message when the upgrade failed\n");
+
+	// Odd-but-legal 101 in dribs and drabs, with a frame right behind it.
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Whatever\r\n"
+	    "upgrade: WebSocket\r\nConnection: keep-alive, upgrade\r\n"
+	    "Sec-WebSocket-Accept:%s \r\nSec-WebSocket-Protocol: chat\r\n"
+	    "\r\n\x82\x02hi", 5, &fd) == 0);
+	assert(strcmp(cli.proto, "chat") == 0);
+	assert(cli.extensions == NULL);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 2);
+	assert(memcmp(buf, "hi", 2) == 0);
+	dumb_free(&cli);
+	close(fd);
+
+	// A 101 weighed down with a cookie and the usual banners, and an
+	// empty extensions line, is still a 101.
+	i = (size_t) snprintf(big, sizeof(big), "HTTP/1.1 101 Switching "
+	    "Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\nServer: dumb/1.0\r\n"
+	    "Set-Cookie: session=");
+	memset(big + i, 'c', 3000);
+	i += 3000;
+	snprintf(big + i, sizeof(big) - i, "; Path=/; HttpOnly\r\n"
+	    "Sec-WebSocket-Accept: %%s\r\nSec-WebSocket-Extensions:\r\n\r\n");
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, big, 512, &fd) == 0);
+	assert(cli.extensions == NULL);
+	dumb_free(&cli);
+	close(fd);
+
+	// Wrong key, a protocol we never offered, extensions we never asked
+	// for, or a 101 that forgot to upgrade.
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n%s",
+	    64, &fd) == DWS_ERR_HANDSHAKE_RES);
+	dumb_free(&cli);
+	close(fd);
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\nSec-WebSocket-Protocol: superchat\r\n"
+	    "\r\n", 64, &fd) == DWS_ERR_HANDSHAKE_RES);
+	dumb_free(&cli);
+	close(fd);
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\nSec-WebSocket-Extensions: x-nope\r\n"
+	    "\r\n", 64, &fd) == DWS_ERR_HANDSHAKE_RES);
+	assert(cli.state != DWS_ST_OPEN);
+	assert(dumb_send(&cli, "hi", 2) == DWS_ERR_INVALID);
+	dumb_free(&cli);
+	close(fd);
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+	    64, &fd) == DWS_ERR_HANDSHAKE_RES);
+	dumb_free(&cli);
+	close(fd);
+	printf("checked the server's 101 properly\n");
+
+#ifdef TCP_CORK
+	// The cork waits for the 101, so the handshake doesn't wait on it.
+	memset(&cli, 0, sizeof(cli));
+	cli.nonblock = 1;
+	cli.sockopts.cork = 1;
+	assert(dumb_connect(&cli, "127.0.0.1", port) == 0);
+	fd = accept(listener, NULL, NULL);
+	assert(fd >= 0);
+	while ((s = dumb_handshake(&cli, "/", NULL)) == DWS_WANT_WRITE)
+		;
+	assert(s == DWS_WANT_POLL && !corked(&cli));
+	raw_response(fd, buf, sizeof(buf));
+	n = snprintf(buf, sizeof(buf), "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n\r\n", cli.accept);
+	assert(write(fd, buf, (size_t) n) == n);
+	while ((s = dumb_handshake(&cli, "/", NULL)) == DWS_WANT_POLL)
+		;
+	assert(s == 0 && corked(&cli));
+	dumb_free(&cli);
+	close(fd);
+	printf("corked only once open\n");
+#endif
+
+	// A length no buffer could hold, right behind a frame that's already
+	// sitting in ours.
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n\r\n\x82\x02hi"
+	    "\x82\x7f\x7f\xff\xff\xff\xff\xff\xff\xff", 64, &fd) == 0);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 2);
+	assert(dumb_recv_view(&cli, &msg) == DWS_ERR_TOO_LARGE);
+	assert(msg.len == SIZE_MAX / 2);
+	// It's on its way to the floor, so it isn't reported again.
+	assert(dumb_recv(&cli, buf, sizeof(buf)) == DWS_WANT_POLL);
+	dumb_free(&cli);
+	close(fd);
+	printf("turned away a frame too big to buffer\n");
+
+	// Too big for max_msg, whole or once the fragments add up (with a
+	// PING cutting in), or for dumb_recv()'s buffer: each is thrown away
+	// and the next message is still there.
+	memset(&cli, 0, sizeof(cli));
+	cli.max_msg = 4;
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n\r\n"
+	    "\x82\x06" "abcdef"
+	    "\x02\x03" "abc" "\x89\x01" "p" "\x80\x03" "def"
+	    "\x82\x02" "ok"
+	    "\x82\x02" "hi"
+	    "\x82\x01" "!", 64, &fd) == 0);
+	while ((n = dumb_recv_view(&cli, &msg)) == DWS_WANT_POLL)
+		;
+	assert(n == DWS_ERR_TOO_LARGE && msg.len == 6);
+	while ((n = dumb_recv_view(&cli, &msg)) == DWS_WANT_POLL)
+		;
+	assert(n == DWS_ERR_TOO_LARGE && msg.len == 6);
+	while ((n = dumb_recv_view(&cli, &msg)) == DWS_WANT_POLL)
+		;
+	assert(n == 2 && memcmp(msg.data, "ok", 2) == 0);
+	assert(recv_wait(&cli, buf, 1) == DWS_ERR_TOO_LARGE);
+	assert(recv_wait(&cli, buf, 1) == 1 && buf[0] == '!');
+	// And the PING got its PONG.
+	assert(dumb_flush(&cli) == 0);
+	assert(read(fd, buf, sizeof(buf)) == 7);
+	assert((uint8_t) buf[0] == 0x8a);
+	dumb_free(&cli);
+	close(fd);
+	printf("threw away messages too big for the limit, kept the rest\n");
+
+	// A whole message in the middle of a fragmented one, a reserved bit
+	// nobody negotiated, and a CLOSE too big to be one.
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		memset(&cli, 0, sizeof(cli));
+		assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+		    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+		    "Sec-WebSocket-Accept: %s\r\n\r\n", 64, &fd) == 0);
+		assert(write(fd, bad[i], bad_len[i]) == (ssize_t) bad_len[i]);
+		assert(recv_wait(&cli, buf, sizeof(buf)) == DWS_ERR_INVALID);
+		dumb_free(&cli);
+		close(fd);
+	}
+	printf("turned away frames that break the rules\n");
+
+	// TEXT both ways, and only if it's UTF-8.
+	memset(&cli, 0, sizeof(cli));
+	pair(&cli, &srv, NULL);
+	assert(dumb_send_text(&cli, "caf\xc3", 4) == DWS_ERR_INVALID);
+	assert(dumb_send_text(&cli, "caf\xc3\xa9", 5) == 5 + 6);
+	while ((n = dumb_recv_view(&srv, &msg)) == DWS_WANT_POLL)
+		;
+	assert(n == 5 && msg.opcode == TEXT);
+	assert(memcmp(msg.data, "caf\xc3\xa9", 5) == 0);
+	assert(dumb_send_text(&srv, "\xe2\x82\xac", 3) == 3 + 2);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 3);
+	dumb_free(&cli);
+	dumb_free(&srv);
+
+	// Split mid-character across fragments, put back together and then
+	// streamed; then one that stops mid-character and one that's junk.
+	memset(&cli, 0, sizeof(cli));
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n\r\n"
+	    "\x01\x02h\xe2\x80\x02\x82\xac"
+	    "\x01\x02h\xe2\x80\x02\x82\xac"
+	    "\x01\x01\xe2\x80\x01\x82"
+	    "\x81\x02\xc0\xaf", 64, &fd) == 0);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 4);
+	assert(memcmp(buf, "h\xe2\x82\xac", 4) == 0);
+	while ((n = dumb_recv_chunk(&cli, buf, sizeof(buf), &left)) == 0
+	    || n == DWS_WANT_POLL)
+		;
+	assert(n == 2 && left == DWS_LEN_UNKNOWN);
+	while ((n = dumb_recv_chunk(&cli, buf, sizeof(buf), &left)) == 0
+	    || n == DWS_WANT_POLL)
+		;
+	assert(n == 2 && left == 0);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == DWS_ERR_INVALID);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == DWS_ERR_INVALID);
+	dumb_free(&cli);
+	close(fd);
+	printf("sent and got TEXT, but not bad UTF-8\n");
+
+	// Data ahead of the PONG stays put for dumb_recv(), which then picks
+	// up the PONG behind it, round trip and all.
+	memset(&cli, 0, sizeof(cli));
+	pair(&cli, &srv, NULL);
+	assert(dumb_send(&srv, "hi", 2) > 0);
+	for (i = 0; i < 1000 && (ret = dumb_ping(&cli)) == DWS_WANT_POLL; i++)
+		usleep(1000);
+	assert(ret == DWS_WANT_PONG);
+	assert(dumb_ping(&cli) == DWS_WANT_PONG);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 2);
+	assert(memcmp(buf, "hi", 2) == 0);
+	for (i = 0; i < 1000 && cli.pongs == 0; i++) {
+		assert(dumb_recv(&srv, buf, sizeof(buf)) == DWS_WANT_POLL);
+		assert(dumb_recv(&cli, buf, sizeof(buf)) == DWS_WANT_POLL);
+		usleep(1000);
+	}
+	assert(cli.pongs == 1 && !cli.awaiting_pong && cli.ping_sent == 0);
+	assert(cli.rtt > 0);
+
+	// Without anything in the way it waits for its own PONG.
+	while ((ret = dumb_ping(&cli)) == DWS_WANT_POLL)
+		assert(dumb_recv(&srv, buf, sizeof(buf)) == DWS_WANT_POLL);
+	assert(ret == 0 && cli.pongs == 2);
+	dumb_free(&cli);
+	dumb_free(&srv);
+	printf("PINGed past the data in the way\n");
+
+#ifdef DWS_WITH_ZLIB
+	// Compressed TEXT is checked whole, and one too big for the buffer is
+	// thrown away without losing track of the stream.
+	memset(&zs, 0, sizeof(zs));
+	assert(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+	    Z_DEFAULT_STRATEGY) == Z_OK);
+	memset(&cli, 0, sizeof(cli));
+	cli.deflate = 1;
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n"
+	    "Sec-WebSocket-Extensions: permessage-deflate\r\n\r\n",
+	    64, &fd) == 0);
+	send_deflated(fd, &zs, "h\xe2\x82\xacllo");
+	send_deflated(fd, &zs, "ok");
+	send_deflated(fd, &zs, "ab\xe2");
+	assert(recv_wait(&cli, buf, 3) == DWS_ERR_TOO_LARGE);
+	assert(recv_wait(&cli, buf, sizeof(buf)) == 2);
+	assert(memcmp(buf, "ok", 2) == 0);
+	assert(recv_wait(&cli, buf, 3) == DWS_ERR_INVALID);
+	deflateEnd(&zs);
+	dumb_free(&cli);
+	close(fd);
+	printf("checked compressed TEXT whole\n");
+
+	// Extensions over several lines add up, so a second one sneaking in
+	// after the one we asked for is still caught.
+	memset(&cli, 0, sizeof(cli));
+	cli.deflate = 1;
+	assert(fake_upgrade(&cli, "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+	    "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+	    "Sec-WebSocket-Accept: %s\r\n"
+	    "Sec-WebSocket-Extensions: x-nope\r\n\r\n",
+	    64, &fd) == DWS_ERR_HANDSHAKE_RES);
+	assert(strcmp(cli.extensions, "permessage-deflate, x-nope") == 0);
+	dumb_free(&cli);
+	close(fd);
+	printf("merged extensions over several lines\n");
+#endif
+
+	// Writing to a client that's gone is an error, not a SIGPIPE.
+	memset(&cli, 0, sizeof(cli));
+	pair(&cli, &srv, NULL);
+	dumb_free(&cli);
+	for (i = 0; i < 100 && (n = dumb_send(&srv, "hi", 2)) > 0; i++)
+		usleep(1000);
+	assert(n == DWS_ERR_WRITE);
+	dumb_free(&srv);
+	printf("lived through writing to a closed socket\n");
+
+	// Blocking: a full queue holds the producer up, nothing goes missing.
+	sender = sender_pair(&cli, &srv, 4, DWS_SENDER_BLOCK, NULL);
+	for (seq = 0; seq < 32; seq++)
+		assert(sender_send(sender, seq) == 0);
+	for (seq = 0; seq < 32; seq++)
+		assert(sender_recv(&srv) == seq);
+	dumb_sender_free(sender);
+	dumb_free(&cli);
+	dumb_free(&srv);
+
+	// Not even behind a backlog the watermark turns batches away for.
+	sender = sender_pair(&cli, &srv, 1024, DWS_SENDER_BLOCK, &got);
+	for (seq = got; seq < got + 32; seq++)
+		assert(sender_send(sender, seq) == 0);
+	for (seq = 0; seq < got + 32; seq++)
+		assert(sender_recv(&srv) == seq);
+	dumb_sender_free(sender);
+	dumb_free(&cli);
+	dumb_free(&srv);
+
+	// Whatever's still queued goes out before dumb_sender_free() returns.
+	sender = sender_pair(&cli, &srv, 1024, DWS_SENDER_BLOCK, NULL);
+	for (seq = 0; seq < 32; seq++)
+		assert(sender_send(sender, seq) == 0);
+	dumb_sender_free(sender);
+	for (seq = 0; seq < 32; seq++)
+		assert(sender_recv(&srv) == seq);
+	dumb_free(&cli);
+	dumb_free(&srv);
+
+	// Dropping the oldest: far more than fits, and every message is
+	// either received, in order, or counted as dropped.
+	sender = sender_pair(&cli, &srv, 4, DWS_SENDER_DROP_OLDEST, &got);
+	for (seq = got; seq < got + 5000; seq++)
+		assert(sender_send(sender, seq) == 0);
+	assert(dumb_sender_dropped(sender) > 0);
+	for (i = 0; i < got; i++)
+		assert(sender_recv(&srv) == i);
+	for (seq = got; seq != got + 5000; i++) {
+		n = sender_recv(&srv);
+		assert(n >= seq);
+		seq = (uint32_t) n + 1;
+	}
+	assert(i + dumb_sender_dropped(sender) == got + 5000);
+	dumb_sender_free(sender);
+	dumb_free(&cli);
+	dumb_free(&srv);
+
+	// Failing: everything up to the first DWS_ERR_FULL gets there.
+	sender = sender_pair(&cli, &srv, 4, DWS_SENDER_FAIL, &got);
+	for (seq = got; seq < got + 100000; seq++) {
+		ret = sender_send(sender, seq);
+		if (ret == DWS_ERR_FULL)
+			break;
+		assert(ret == 0);
+	}
+	assert(seq > got && seq < got + 100000);
+	for (i = 0; i < seq; i++)
+		assert(sender_recv(&srv) == i);
+	dumb_sender_free(sender);
+	dumb_free(&cli);
+	dumb_free(&srv);
+	printf("sent from a sender: blocked, dropped, failed and drained\n");
+
+	// A pool that's accepted but never answered gives up on the handshake
+	// in time, backs off and tries again, then reconnects once the server
+	// hangs up on it.
+	memset(&pcfg, 0, sizeof(pcfg));
+	pcfg.host = "127.0.0.1";
+	pcfg.port = port;
+	pcfg.proto = "dumb-ws";
+	pcfg.size = 1;
+	pcfg.timeout = 200;
+	pcfg.backoff_min = 50;
+	pcfg.backoff_max = 100;
+	pool = dumb_pool_new(&pcfg);
+	assert(pool != NULL);
+	fd = accept(listener, NULL, NULL);
+	assert(fd >= 0);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	assert(n == 0 && dumb_pool_ready(pool) == 0);
+	close(fd);
+	for (i = 0; i < 2; i++) {
+		fd = accept(listener, NULL, NULL);
+		assert(fd >= 0);
+		memset(&srv, 0, sizeof(srv));
+		srv.timeout = 5000;
+		assert(dumb_accept(&srv, fd, "dumb-ws") == 0);
+		lent = dumb_pool_get(pool, 5000);
+		assert(lent != NULL && lent->state == DWS_ST_OPEN);
+		dumb_pool_put(pool, lent, 0);
+		dumb_free(&srv);
+	}
+	dumb_pool_free(pool);
+	printf("pool timed out a handshake, backed off and reconnected\n");
+
+	close(listener);
+
+	printf("ok\n");
+	return 0;
+}
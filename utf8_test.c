@@ -0,0 +1,221 @@
+/*
+ * Checks dumb_utf8_check() against a plain decode-everything reference:
+ * every string of up to 3 bytes, every 4 byte one that starts like a 4 byte
+ * character, and a pile of random text with garbage mixed in, checked whole
+ * and in random pieces. Strings get dropped into ASCII at offsets that
+ * straddle the vector block sizes, so the vector code sees them too.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dws.h"
+
+#define PAD	64
+
+/*
+ * RFC 3629, the slow and obvious way: decode each character and see if
+ * it's one that's allowed to be encoded the way it was.
+ */
+static int
+ref_valid(const uint8_t *s, size_t len)
+{
+	uint32_t cp, min;
+	size_t i = 0, n, k;
+
+	while (i < len) {
+		if (s[i] < 0x80) {
+			i++;
+			continue;
+		} else if ((s[i] & 0xE0) == 0xC0) {
+			n = 1;
+			cp = s[i] & 0x1F;
+			min = 0x80;
+		} else if ((s[i] & 0xF0) == 0xE0) {
+			n = 2;
+			cp = s[i] & 0x0F;
+			min = 0x800;
+		} else if ((s[i] & 0xF8) == 0xF0) {
+			n = 3;
+			cp = s[i] & 0x07;
+			min = 0x10000;
+		} else
+			return 0;
+
+		if (len - i - 1 < n)
+			return 0;
+		for (k = 1; k <= n; k++) {
+			if ((s[i + k] & 0xC0) != 0x80)
+				return 0;
+			cp = cp << 6 | (s[i + k] & 0x3F);
+		}
+		if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+			return 0;
+		i += n + 1;
+	}
+
+	return 1;
+}
+
+static int
+check(const uint8_t *s, size_t len)
+{
+	uint32_t state = 0;
+
+	return dumb_utf8_check(&state, s, len) == 0 && state == 0;
+}
+
+/*
+ * Check s split at cut, so the state has to carry across.
+ */
+static int
+check_split(const uint8_t *s, size_t len, size_t cut)
+{
+	uint32_t state = 0;
+
+	return dumb_utf8_check(&state, s, cut) == 0
+	    && dumb_utf8_check(&state, s + cut, len - cut) == 0 && state == 0;
+}
+
+/*
+ * Try str in the middle of some ASCII, at offsets that cross 16 and 32
+ * byte blocks and right at the end, and split partway through it.
+ */
+static void
+try(const uint8_t *str, size_t n)
+{
+	static const size_t offs[] = { 0, 14, 30, 45 };
+	uint8_t buf[3 * PAD];
+	size_t i, len;
+	int want;
+
+	want = ref_valid(str, n);
+	assert(check(str, n) == want);
+
+	memset(buf, 'a', sizeof(buf));
+	for (i = 0; i < sizeof(offs) / sizeof(offs[0]); i++) {
+		memcpy(buf + offs[i], str, n);
+		assert(check(buf, PAD) == want);
+		assert(check_split(buf, PAD, offs[i] + 1) == want);
+		memset(buf + offs[i], 'a', n);
+	}
+
+	len = 2 * PAD - n;
+	memcpy(buf + len, str, n);
+	assert(check(buf, len + n) == want);
+}
+
+/*
+ * Something that might be text: mostly characters of every length, with
+ * the odd random byte, 1 in `junk`.
+ */
+static size_t
+random_text(uint8_t *buf, size_t max, int junk)
+{
+	static const uint32_t ranges[][2] = {
+		{ 0x20, 0x7E }, { 0x80, 0x7FF }, { 0x800, 0xD7FF },
+		{ 0xE000, 0xFFFF }, { 0x10000, 0x10FFFF },
+	};
+	size_t len = 0, target;
+	uint32_t cp;
+	int r;
+
+	target = (size_t) rand() % max;
+	while (len + 4 <= target) {
+		if (junk && rand() % junk == 0) {
+			buf[len++] = (uint8_t) rand();
+			continue;
+		}
+		r = rand() % 5;
+		cp = ranges[r][0]
+		    + (uint32_t) rand() % (ranges[r][1] - ranges[r][0] + 1);
+		if (cp < 0x80)
+			buf[len++] = (uint8_t) cp;
+		else if (cp < 0x800) {
+			buf[len++] = (uint8_t) (0xC0 | cp >> 6);
+			buf[len++] = (uint8_t) (0x80 | (cp & 0x3F));
+		} else if (cp < 0x10000) {
+			buf[len++] = (uint8_t) (0xE0 | cp >> 12);
+			buf[len++] = (uint8_t) (0x80 | ((cp >> 6) & 0x3F));
+			buf[len++] = (uint8_t) (0x80 | (cp & 0x3F));
+		} else {
+			buf[len++] = (uint8_t) (0xF0 | cp >> 18);
+			buf[len++] = (uint8_t) (0x80 | ((cp >> 12) & 0x3F));
+			buf[len++] = (uint8_t) (0x80 | ((cp >> 6) & 0x3F));
+			buf[len++] = (uint8_t) (0x80 | (cp & 0x3F));
+		}
+	}
+
+	return len;
+}
+
+int
+main(void)
+{
+	uint8_t s[4], buf[4096];
+	uint32_t a, b, c, d, state;
+	size_t len, off, cut;
+	int i, want, good = 0;
+
+	for (a = 0; a < 256; a++) {
+		s[0] = (uint8_t) a;
+		try(s, 1);
+		for (b = 0; b < 256; b++) {
+			s[1] = (uint8_t) b;
+			try(s, 2);
+			for (c = 0; c < 256; c++) {
+				s[2] = (uint8_t) c;
+				// Past anything but a lead byte, it's been seen already.
+				if (a >= 0xC2 && a <= 0xF4)
+					try(s, 3);
+				else
+					assert(check(s, 3) == ref_valid(s, 3));
+			}
+		}
+	}
+	printf("every string up to 3 bytes\n");
+
+	// Leads from F0 up, and everything near a continuation after them.
+	for (a = 0xF0; a < 0x100; a++) {
+		s[0] = (uint8_t) a;
+		for (b = 0x70; b < 0xD0; b++) {
+			s[1] = (uint8_t) b;
+			for (c = 0x70; c < 0xD0; c++) {
+				s[2] = (uint8_t) c;
+				for (d = 0x70; d < 0xD0; d++) {
+					s[3] = (uint8_t) d;
+					want = ref_valid(s, 4);
+					assert(check(s, 4) == want);
+					good += want;
+				}
+			}
+		}
+	}
+	// U+10000 through U+10FFFF, and nothing else.
+	assert(good == 0x100000);
+	printf("every 4 byte lead and what follows it\n");
+
+	srand(6455);
+	for (i = 0; i < 20000; i++) {
+		len = random_text(buf, sizeof(buf), i % 2 ? 0 : 2000);
+		want = ref_valid(buf, len);
+		assert(check(buf, len) == want);
+		if (i % 2)
+			assert(want);
+
+		// In random pieces, a byte or two up to a few hundred.
+		state = 0;
+		for (off = 0; off < len; off += cut) {
+			cut = (size_t) rand() % (i % 3 ? 4 : 300) + 1;
+			cut = cut > len - off ? len - off : cut;
+			if (dumb_utf8_check(&state, buf + off, cut))
+				break;
+		}
+		assert((off >= len && state == 0) == want);
+	}
+	printf("random text, whole and in pieces\n");
+
+	printf("ok\n");
+	return 0;
+}